@@ -0,0 +1,227 @@
+// connect4.cppの探索で時間が掛かる処理を測る
+// 乱数のシードを決めて、毎回同じ局面で測る
+#define CONNECT4_BENCHMARK
+#include "connect4.cpp"
+#include <benchmark/benchmark.h>
+
+namespace {
+// 測る局面の数
+constexpr size_t NumberOfStages {1024};
+
+// 探索木を作り直すまでに探索する回数
+// 一つの探索木で探索し続けると、木が深くなるにつれて一回の探索が遅くなる
+constexpr Node::Count PlayoutsPerTree {1024};
+
+// 勝負がつかないように、指定した局面からランダムにn_moves手打った局面を作る
+// 打てる手が無くなったら、そこまで打った局面を返す
+Stage mid_game(Stage stage, int n_moves, Random& gen) {
+    for(int i{0}; i < n_moves; ++i) {
+        const auto winning = stage.winning_moves();
+        std::vector<Board::Position> actions;
+        for(const auto& action : stage.legal_actions()) {
+            if (!(winning & Board::to_bit(Board::to_index(action.column, action.height)))) {
+                actions.push_back(action);
+            }
+        }
+
+        if (actions.empty()) {
+            break;
+        }
+
+        const auto& action = actions.at(gen.below(static_cast<uint32_t>(actions.size())));
+        if (stage.advance(action.column, action.height) != Stage::Result::Placed) {
+            break;
+        }
+    }
+
+    return stage;
+}
+
+// 序盤から終盤までの局面を並べる
+std::vector<Stage> mid_games(const CommonHashKey& keys) {
+    Random gen(1);
+    std::vector<Stage> stages;
+    for(size_t i{0}; i < NumberOfStages; ++i) {
+        stages.push_back(mid_game(Stage(keys), 8 + static_cast<int>(i % 24), gen));
+    }
+    return stages;
+}
+
+// 各局面で最後に打ったマス
+struct Placed {
+    Board board;
+    Board::Coordinate column;
+    Board::Coordinate height;
+};
+
+const CommonHashKey& common_keys() {
+    static const CommonHashKey keys(Stage::SizeOfPlayers, 1);
+    return keys;
+}
+
+// 指定した手数の局面から一回ずつ探索する
+// PlayoutsPerTree回ごとに、時間を測らずに探索エンジンを作り直して空の探索木から始める
+void run_playouts(benchmark::State& state, const MctsEngine::Config& config) {
+    const auto keys = std::make_shared<const CommonHashKey>(Stage::SizeOfPlayers, 1);
+    Random gen(3);
+    const auto start = mid_game(Stage(*keys), static_cast<int>(state.range(0)), gen);
+
+    std::unique_ptr<MctsEngine> engine;
+    Node::Count n_playouts {PlayoutsPerTree};
+    for(auto _ : state) {
+        if (n_playouts == PlayoutsPerTree) {
+            state.PauseTiming();
+            engine = std::make_unique<MctsEngine>(config, keys);
+            n_playouts = 0;
+            state.ResumeTiming();
+        }
+        engine->playout(start, 1);
+        ++n_playouts;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+}
+
+// 今打ったマスに線が完成したかどうか調べる
+static void BM_BoardCheck(benchmark::State& state) {
+    const auto& keys = common_keys();
+    Random gen(2);
+    std::vector<Placed> placed;
+    for(const auto& stage : mid_games(keys)) {
+        Board board(keys.hashkeys(0));
+        for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
+            for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
+                if (stage.cells(0) & Board::to_bit(Board::to_index(column, height))) {
+                    board.place(column, height);
+                }
+            }
+        }
+        const auto actions = stage.legal_actions();
+        if (actions.empty()) {
+            continue;
+        }
+        const auto& action = actions.at(gen.below(static_cast<uint32_t>(actions.size())));
+        board.place(action.column, action.height);
+        placed.push_back(Placed{board, action.column, action.height});
+    }
+
+    size_t index {0};
+    for(auto _ : state) {
+        const auto& p = placed[index];
+        benchmark::DoNotOptimize(p.board.check(p.column, p.height));
+        index = (index + 1) % placed.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// 合法手を列挙する
+static void BM_LegalActions(benchmark::State& state) {
+    const auto stages = mid_games(common_keys());
+    size_t index {0};
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(stages[index].legal_actions());
+        index = (index + 1) % stages.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// 一手打って戻す
+static void BM_StageAdvance(benchmark::State& state) {
+    auto stages = mid_games(common_keys());
+    std::vector<Board::Position> actions;
+    for(const auto& stage : stages) {
+        const auto legal_actions = stage.legal_actions();
+        actions.push_back(legal_actions.empty() ? Board::Position{} : legal_actions.at(0));
+    }
+
+    size_t index {0};
+    for(auto _ : state) {
+        auto& stage = stages[index];
+        const auto& action = actions[index];
+        benchmark::DoNotOptimize(stage.advance(action.column, action.height));
+        stage.undo(action.column, action.height);
+        index = (index + 1) % stages.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// 局面を置換表に登録する
+static void BM_NodeSetAdd(benchmark::State& state) {
+    const auto stages = mid_games(common_keys());
+    for(auto _ : state) {
+        state.PauseTiming();
+        auto nodeset = std::make_unique<NodeSet>(NumberOfStages * 2);
+        state.ResumeTiming();
+        for(const auto& stage : stages) {
+            benchmark::DoNotOptimize(nodeset->add(stage));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * stages.size());
+}
+
+// 置換表から局面を探す
+static void BM_NodeSetFind(benchmark::State& state) {
+    const auto stages = mid_games(common_keys());
+    NodeSet nodeset(NumberOfStages * 2);
+    for(const auto& stage : stages) {
+        nodeset.add(stage);
+    }
+
+    size_t index {0};
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(nodeset.find(stages[index]));
+        index = (index + 1) % stages.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// 十分に探索した初期局面から、子ノードを選ぶ
+static void BM_MctsSelect(benchmark::State& state) {
+    MctsEngine::Config config;
+    config.seed = 1;
+    MctsEngine engine(config);
+    const auto stage = engine.initial_stage();
+    engine.playout(stage, 20000);
+    const auto root = engine.add(stage);
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(engine.select(root));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// 一回探索する。引数は何手打った局面から探索するか。
+static void BM_MctsPlayout(benchmark::State& state) {
+    MctsEngine::Config config;
+    config.seed = 1;
+    config.capacity = PlayoutsPerTree * 64;
+    run_playouts(state, config);
+}
+
+// 重いプレイで一回探索する
+static void BM_MctsPlayoutHeavy(benchmark::State& state) {
+    MctsEngine::Config config;
+    config.seed = 1;
+    config.capacity = PlayoutsPerTree * 64;
+    config.rollout = MctsEngine::Rollout::Heavy;
+    run_playouts(state, config);
+}
+
+BENCHMARK(BM_BoardCheck);
+BENCHMARK(BM_LegalActions);
+BENCHMARK(BM_StageAdvance);
+BENCHMARK(BM_NodeSetAdd);
+BENCHMARK(BM_NodeSetFind);
+BENCHMARK(BM_MctsSelect);
+BENCHMARK(BM_MctsPlayout)->Arg(0)->Arg(12);
+BENCHMARK(BM_MctsPlayoutHeavy)->Arg(0)->Arg(12);
+BENCHMARK_MAIN();
+
+/*
+Local Variables:
+mode: c++
+coding: utf-8-dos
+tab-width: nil
+c-file-style: "stroustrup"
+Last:
+*/
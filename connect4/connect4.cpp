@@ -1,18 +1,40 @@
 #include <cmath>
+#include <algorithm>
 #include <array>
-#include <bitset>
+#include <atomic>
+#include <bit>
 #include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <queue>
 #include <set>
+#include <span>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <random>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef CONNECT4_BENCHMARK
+#include <gtest/gtest_prod.h>
+#else
 #include <gtest/gtest.h>
+#endif
 
 namespace {
 // 参加者
@@ -24,7 +46,10 @@ const MilliSec ZeroMilliSec {0};
 }
 
 // 盤面
-class Board final {
+// 列数(横方向)、最大の高さ、線上のマスが何個並んだら勝ちかをテンプレート引数にする。
+// マスクをコンパイル時に求めるので、盤面の大きさごとにループを展開したコードになる。
+template <int32_t Width, int32_t Height, int32_t Length>
+class BasicBoard final {
     FRIEND_TEST(TestBoard, Initialize);
     FRIEND_TEST(TestBoard, SetupLines);
     FRIEND_TEST(TestBoard, Digest);
@@ -33,6 +58,7 @@ class Board final {
     FRIEND_TEST(TestBoard, PlaceOutOfBounds);
     FRIEND_TEST(TestBoard, Remove);
     FRIEND_TEST(TestBoard, RemoveOutOfBounds);
+    FRIEND_TEST(TestBoard, Variant);
     FRIEND_TEST(TestBoard, Merge);
     FRIEND_TEST(TestBoard, ToIndex);
     FRIEND_TEST(TestBoard, ToStringCells);
@@ -52,6 +78,10 @@ class Board final {
     FRIEND_TEST(TestBoard, LegalActionsHeight);
     FRIEND_TEST(TestBoard, LegalActionsMax);
     FRIEND_TEST(TestBoard, Full);
+    FRIEND_TEST(TestBoard, CheckSameAsLines);
+    FRIEND_TEST(TestBoard, CheckSpeed);
+    FRIEND_TEST(TestBoard, Playable);
+    FRIEND_TEST(TestBoard, WinningCells);
     FRIEND_TEST(TestStage, Initialize);
     FRIEND_TEST(TestStage, MergeBoards);
     FRIEND_TEST(TestStage, Digest);
@@ -67,27 +97,82 @@ public:
         Coordinate column {0};  // 横方向
         Coordinate height {0};  // 縦方向
     };
-    using Positions = std::vector<Position>;  // 合法手(可能手)
-
-    static constexpr Coordinate ColumnSize {7};  // 列数(横方向)
-    static constexpr Coordinate MaxHeight  {6};  // 最大の高さ
-    static constexpr Coordinate FullWidth  {8};  // 余白込みの盤面の幅
-    static constexpr Coordinate FullHeight {8};  // 余白込みの盤面の高さ
+    using Board = BasicBoard;
+    static constexpr Coordinate ColumnSize {Width};   // 列数(横方向)
+    static constexpr Coordinate MaxHeight  {Height};  // 最大の高さ
+    static constexpr Coordinate FullWidth  {Width + 1};  // 余白込みの盤面の幅
+    // 余白込みの盤面の高さ。列の添え字を除算とビットシフトで求められるように2のべき乗にする。
+    static constexpr Coordinate FullHeight = static_cast<Coordinate>(
+        std::bit_ceil(static_cast<uint32_t>(Height + 1)));
     static constexpr Coordinate FullSize = FullWidth * FullHeight;  // 余白込みの盤面のマス数
-    using Cells = std::bitset<FullSize>;  // 全マス
+    // 全マス。列ごとに下からFullHeightビットずつ並べる。64マスを超えたら128 bitにする。
+    using Cells = std::conditional_t<(FullSize <= 64), uint64_t, unsigned __int128>;
 
     // 上下と左右をつなげないために、上と右に余白を必ず設ける
+    static_assert((Width > 0) && (Height > 0) && (Length > 1));
+    static_assert((Length <= Width) || (Length <= Height));
     static_assert(ColumnSize < FullWidth);
     static_assert(MaxHeight < FullHeight);
+    static_assert(FullSize <= std::numeric_limits<Cells>::digits);
+
+    // 合法手(可能手)
+    // 一列に一手しか打てないので、ヒープから確保せずに列数分の領域を埋め込む
+    class Positions final {
+    private:
+        using Container = std::array<Position, ColumnSize>;
+        Container positions_ {};  // 合法手
+        size_t size_ {0};  // 合法手の数
+
+    public:
+        using value_type = Position;
+        using size_type = size_t;
+        using const_iterator = Container::const_iterator;
+
+        // 合法手を追加する。列数を超えたら追加しない。
+        void push_back(const Position& position) {
+            if (size_ < positions_.size()) {
+                positions_[size_++] = position;
+            }
+        }
+
+        size_type size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        // 範囲外ならstd::vectorと同様に例外を投げる
+        const Position& at(size_type index) const {
+            if (index >= size_) {
+                throw std::out_of_range("Board::Positions::at");
+            }
+            return positions_[index];
+        }
+
+        const_iterator begin() const {
+            return positions_.begin();
+        }
+
+        const_iterator end() const {
+            return positions_.begin() + size_;
+        }
+    };
 
     static constexpr Coordinate LineTypes {4};  // 縦横斜めの線種の数
-    static constexpr Coordinate MinLen {4};     // 線上のマスが何個並んだら勝ちか
+    static constexpr Coordinate MinLen {Length};  // 線上のマスが何個並んだら勝ちか
     using HashKey = uint64_t;  // Zobrist hashing のキー
     using HashKeySet = std::array<HashKey, FullSize>;  // プレイヤーとマスごとのキー
 
+    // 線種ごとに、隣のマスに移るときのビットシフト量(縦、横、左下から右上、左上から右下)
+    static constexpr std::array<Coordinate, LineTypes> LineShifts {
+        1, FullHeight, FullHeight + 1, FullHeight - 1};
+
 private:
-    Cells placed_;        // 石を置いたマス
+    Cells placed_ {0};    // 石を置いたマス
     HashKey digest_ {0};  // 盤面全体のキー
+    HashKey mirrored_digest_ {0};  // 左右を反転した盤面全体のキー
 
     // メンバ変数のコピーを速くするために、インスタンスごとにハッシュキーを持つのではなく
     // 参照にする。所有権を持たないので、スマートポインタではなく素のポインタにする。
@@ -95,75 +180,100 @@ private:
     // staticにするとマルチスレッド化が難しい
     const HashKeySet* hashkeys_;  // それぞれのマスのキー
 
-    // メンバ変数のコピーを速くするためにSingletonにする
-    // こうするとインスタンスが24 byteになる
-    // 設定したら変更しない値は、read-onlyなのでマルチスレッド化で問題にならない
-    static inline Cells mask_;  // 余白を取り除くマスク
-    static inline std::array<Cells, LineTypes> linemasks_;  // 縦横斜めの線それぞれのマスク
-
 public:
-    explicit Board(const HashKeySet& hashkeys) : hashkeys_(&hashkeys) {
-        // 石が置ける位置をマスクする
-        for(Coordinate column{0}; column < ColumnSize; ++column) {
-            for(Coordinate height{0}; height < MaxHeight; ++height) {
-                const auto index = to_index(column, height);
-                mask_.set(index);
-            }
-        }
-
-        // 初めて使うときに初期化する
-        for(auto&& mask : linemasks_) {
-            if (mask.count() == 0) {
-                setup();
-                break;
-            }
-        }
+    // 座標をビットボードの添え字に変換する
+    static constexpr Coordinate to_index(Coordinate column, Coordinate height) {
+        return column * FullHeight + height;
     }
 
-    ~Board() = default;
+    // ビットボードの添え字をビットに変換する。範囲外なら0を返す。
+    static constexpr Cells to_bit(Coordinate index) {
+        return ((index >= 0) && (index < FullSize)) ? (Cells{1} << index) : 0;
+    }
 
-    static void setup() {
-        // 石が置ける位置をマスクする
+private:
+    // 設定したら変更しない値は、コンパイル時に求めてread-onlyにする
+    // 実行時に初期化しないので、複数のスレッドが同時に盤面を作っても競合しない
+    // 余白を取り除くマスク
+    static constexpr Cells mask_ = [] {
+        Cells mask {0};
         for(Coordinate column{0}; column < ColumnSize; ++column) {
             for(Coordinate height{0}; height < MaxHeight; ++height) {
-                const auto index = to_index(column, height);
-                mask_.set(index);
+                mask |= to_bit(to_index(column, height));
             }
         }
+        return mask;
+    }();
+
+    // 各列の一番下のマス
+    static constexpr Cells bottom_ = [] {
+        Cells bottom {0};
+        for(Coordinate column{0}; column < ColumnSize; ++column) {
+            bottom |= to_bit(to_index(column, 0));
+        }
+        return bottom;
+    }();
 
-        // 線種ごとにマスクを生成する
+    // 縦横斜めの線それぞれのマスク
+    static constexpr std::array<Cells, LineTypes> linemasks_ = [] {
+        std::array<Cells, LineTypes> linemasks {};
         for(Coordinate i{0}; i < MinLen; ++i) {
             // 縦一列
-            linemasks_.at(0).set(i);
+            linemasks.at(0) |= to_bit(i);
             // 横一列
-            linemasks_.at(1).set(i * FullHeight);
+            linemasks.at(1) |= to_bit(i * FullHeight);
             // 左下から右上
-            linemasks_.at(2).set(i * (FullHeight + 1));
+            linemasks.at(2) |= to_bit(i * (FullHeight + 1));
             // 右上から左下。この線だけ原点が(0,0)ではない。
-            linemasks_.at(3).set(MinLen - 1 + i * (FullHeight - 1));
+            linemasks.at(3) |= to_bit(MinLen - 1 + i * (FullHeight - 1));
         }
-    }
+        return linemasks;
+    }();
+
+public:
+    explicit BasicBoard(const HashKeySet& hashkeys) : hashkeys_(&hashkeys) {}
+    ~BasicBoard() = default;
 
     // 盤面全体のダイジェストを返す
     HashKey digest() const {
         return digest_;
     }
 
+    // 左右を反転した盤面全体のダイジェストを返す
+    HashKey mirrored_digest() const {
+        return mirrored_digest_;
+    }
+
+    // 左右を反転した盤面を同一視するダイジェストを返す
+    // 石を置くたびに両方の向きのダイジェストを更新しておき、小さい方を選ぶ
+    HashKey canonical_digest() const {
+        return std::min(digest_, mirrored_digest_);
+    }
+
+    // 石を置いたマスを返す
+    Cells cells() const {
+        return placed_;
+    }
+
     // 石を指定位置に置く。置ける場所は空のマスで範囲内。
     void place(Board::Coordinate column, Board::Coordinate height) {
         const auto index = to_index(column, height);
-        if (!placed_[index] && mask_[index]) {
-            placed_.set(index);
+        const auto bit = to_bit(index);
+        if (!(placed_ & bit) && (mask_ & bit)) {
+            placed_ |= bit;
             digest_ ^= hashkeys_->at(index);
+            mirrored_digest_ ^= hashkeys_->at(mirror_index(index));
         }
     }
 
     // 石を指定から除く。置く場所に石が必要である。
     void remove(Board::Coordinate column, Board::Coordinate height) {
         const auto index = to_index(column, height);
-        if (placed_[index]) {
-            placed_.reset(index);
+        const auto bit = to_bit(index);
+        if (placed_ & bit) {
+            placed_ &= ~bit;
             digest_ ^= hashkeys_->at(index);
+            mirrored_digest_ ^= hashkeys_->at(mirror_index(index));
         }
     }
 
@@ -173,12 +283,23 @@ public:
         auto retval = *this;
         retval.placed_ ^= rhs.placed_;
         retval.digest_ ^= rhs.digest_;
+        retval.mirrored_digest_ ^= rhs.mirrored_digest_;
         return retval;
     }
 
-    // 座標をビットボードの添え字に変換する
-    static Coordinate to_index(Coordinate column, Coordinate height) {
-        return column * FullHeight + height;
+    // ビットボードの添え字を、左右を反転したマスの添え字に変換する
+    static Coordinate mirror_index(Coordinate index) {
+        return to_index(ColumnSize - 1 - index / FullHeight, index % FullHeight);
+    }
+
+    // ビットボードの添え字を座標に変換する
+    static Position to_position(Coordinate index) {
+        return Position{index / FullHeight, index % FullHeight};
+    }
+
+    // ビットボードの指定したマスに石があるかどうか返す
+    static bool test(Cells cells, Coordinate index) {
+        return (cells & to_bit(index)) != 0;
     }
 
     // ビットボードを読める文字列に変換する
@@ -187,7 +308,7 @@ public:
 
         for(Coordinate height{MaxHeight-1}; height >= 0; --height) {
             for(Coordinate column{0}; column < ColumnSize; ++column) {
-                const auto c = (cells[to_index(column, height)]) ? mark : blank;
+                const auto c = test(cells, to_index(column, height)) ? mark : blank;
                 oss << c;
             }
             oss << "\n";
@@ -208,13 +329,12 @@ public:
         }
 
         // 線のビットマスクを、線の開始位置までシフトする。多すぎるマスは捨てる。
-        auto line = linemasks_.at(line_index);
-        line <<= left_shift;
+        auto line = (left_shift < FullSize) ? (linemasks_.at(line_index) << left_shift) : 0;
         line &= mask_;
         line &= placed_;
 
         // 余白を数えないので、上下と左右がループしていたらマスが足りなくなる。
-        return (line.count() >= MinLen);
+        return (std::popcount(line) >= MinLen);
     }
 
     // 指定された範囲[column, bottom..top]から垂直線が始まるかどうか調べる
@@ -273,8 +393,9 @@ public:
         return false;
     }
 
-    // 今打ったマスに線が完成したかどうか調べる
-    bool check(Coordinate column, Coordinate height) const {
+    // 今打ったマスに線が完成したかどうか、線種ごとのマスクを動かして調べる
+    // check()と同じ結果を返すが遅い
+    bool check_by_lines(Coordinate column, Coordinate height) const {
         // 右と上を無駄に調べない
         const auto left = std::max(0, column - (MinLen - 1));
         const auto right = std::min(ColumnSize - MinLen, column);
@@ -296,17 +417,105 @@ public:
         return check_line3(left, right, column, height);
     }
 
+    // 線種ごとに、MinLen個並んだマスの始点を返す
+    // 隣のマスにずらして論理積を取ると、並んだマスの始点だけが残る
+    static Cells line_starts(Cells cells, Coordinate shift) {
+        auto starts = cells;
+        for(Coordinate i{1}; i < MinLen; ++i) {
+            starts &= cells >> (shift * i);
+        }
+        return starts;
+    }
+
+    // 線種ごとに、MinLen個並んだマスの始点から、並んだマス全体に広げる
+    static Cells line_cells(Cells starts, Coordinate shift) {
+        auto cells = starts;
+        for(Coordinate i{1}; i < MinLen; ++i) {
+            cells |= starts << (shift * i);
+        }
+        return cells;
+    }
+
+    // MinLen個並んだマスがあるかどうか調べる
+    // 余白があるので、盤面の端を越えて並ぶことは無い
+    static bool has_line(Cells cells) {
+        const auto masked = cells & mask_;
+        Cells starts {0};
+        for(const auto shift : LineShifts) {
+            starts |= line_starts(masked, shift);
+        }
+        return starts != 0;
+    }
+
+    // 石を置くとMinLen個並んだマスができるマスを返す。置けるかどうかは問わない。
+    // 置くマスの前にbefore個、後ろにMinLen-1-before個の石があるかどうかを線種ごとに調べる
+    static Cells winning_cells(Cells cells) {
+        const auto masked = cells & mask_;
+        Cells winning {0};
+        for(const auto shift : LineShifts) {
+            for(Coordinate before{0}; before < MinLen; ++before) {
+                auto candidates = ~Cells{0};
+                for(Coordinate i{1}; i <= before; ++i) {
+                    candidates &= masked << (shift * i);
+                }
+                for(Coordinate i{1}; i < (MinLen - before); ++i) {
+                    candidates &= masked >> (shift * i);
+                }
+                winning |= candidates;
+            }
+        }
+
+        // 余白のマスは石が無いので、余白をまたいで並んだマスは余白だけである
+        return winning & mask_ & ~masked;
+    }
+
+    // 今打ったマスに線が完成したかどうか調べる
+    bool check(Coordinate column, Coordinate height) const {
+        if ((column < 0) || (column >= ColumnSize) || (height < 0) || (height >= MaxHeight)) {
+            return false;
+        }
+
+        const auto bit = to_bit(to_index(column, height));
+        const auto masked = placed_ & mask_;
+        if (!(masked & bit)) {
+            return false;
+        }
+
+        for(const auto shift : LineShifts) {
+            if (line_cells(line_starts(masked, shift), shift) & bit) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // 各列で次に石を置けるマスを返す
+    // 列の下から石を詰めて置くので、一番下のマスを足すと繰り上がりが次のマスに来る
+    static Cells playable(Cells placed) {
+        return ((placed & mask_) + bottom_) & mask_;
+    }
+
+    // 左右を反転したビットボードを返す
+    static Cells mirror(Cells cells) {
+        const auto column_mask = (Cells{1} << FullHeight) - 1;
+        Cells mirrored {0};
+        for(Coordinate column{0}; column < ColumnSize; ++column) {
+            const auto column_cells = (cells >> to_index(column, 0)) & column_mask;
+            mirrored |= column_cells << to_index(ColumnSize - 1 - column, 0);
+        }
+        return mirrored;
+    }
+
     // 合法手を列挙する
-    // Count leading zeros を使っても速くならない
+    // 列ごとに次に石を置けるマスを、Count trailing zerosで高さに変換する
     Positions legal_actions() const {
         Positions positions;
+        const auto cells = playable(placed_);
         for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
-            for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
-                auto index = to_index(column, height);
-                if (!placed_[index]) {
-                    positions.push_back(Position{column, height});
-                    break;
-                }
+            const auto column_cells = (cells >> to_index(column, 0)) & ((Cells{1} << FullHeight) - 1);
+            if (column_cells) {
+                positions.push_back(Position{column, std::countr_zero(column_cells)});
             }
         }
 
@@ -315,37 +524,120 @@ public:
 
     // 置ける場所が全て埋まっている
     bool full() const {
-        return placed_.count() == mask_.count();
+        return (placed_ & mask_) == mask_;
+    }
+};
+
+// 乱数生成器 (xoshiro256**)
+// std::mt19937より状態が小さく(32 byte)速い。スレッドごとに一つ持つ。
+// UniformRandomBitGeneratorの要件を満たすので、標準の分布にも渡せる。
+class Random final {
+public:
+    using result_type = uint64_t;
+    using Seed = uint64_t;
+
+private:
+    std::array<uint64_t, 4> state_ {};
+
+    static constexpr uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+public:
+    // シードをSplitMix64で広げて状態を埋める。全ビット0の状態にはならない。
+    explicit Random(Seed seed) {
+        for(auto&& s : state_) {
+            seed += 0x9e3779b97f4a7c15ull;
+            auto z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            s = z ^ (z >> 31);
+        }
+    }
+
+    // シードを決めなければ、実行ごとに異なる系列にする
+    Random() : Random(random_seed()) {}
+
+    ~Random() = default;
+
+    static constexpr result_type min() {
+        return 0;
+    }
+
+    static constexpr result_type max() {
+        return std::numeric_limits<result_type>::max();
+    }
+
+    result_type operator()() {
+        const auto result = rotl(state_[1] * 5, 7) * 9;
+        const auto t = state_[1] << 17;
+        state_[2] ^= state_[0];
+        state_[3] ^= state_[1];
+        state_[1] ^= state_[2];
+        state_[0] ^= state_[3];
+        state_[2] ^= t;
+        state_[3] = rotl(state_[3], 45);
+        return result;
+    }
+
+    // [0, bound)の一様な整数を返す。boundは1以上であること。
+    // 掛け算の上位ビットを使い、偏りが出る下位ビットの値だけ引き直す(Lemireの方法)。
+    // 引き直す確率はbound / 2^32以下なので、ほとんど割り算しない。
+    uint32_t below(uint32_t bound) {
+        auto m = static_cast<uint64_t>(static_cast<uint32_t>((*this)() >> 32)) * bound;
+        auto low = static_cast<uint32_t>(m);
+        if (low < bound) {
+            const uint32_t threshold = (0u - bound) % bound;
+            while(low < threshold) {
+                m = static_cast<uint64_t>(static_cast<uint32_t>((*this)() >> 32)) * bound;
+                low = static_cast<uint32_t>(m);
+            }
+        }
+        return static_cast<uint32_t>(m >> 32);
+    }
+
+    // 実行ごとに異なるシード
+    static Seed random_seed() {
+        std::random_device seed_gen;
+        return (static_cast<Seed>(seed_gen()) << 32) ^ seed_gen();
     }
 };
 
 // 固定ハッシュキー
-class CommonHashKey final {
+template <typename Board>
+class BasicCommonHashKey final {
     FRIEND_TEST(TestCommonHashKey, Initialize);
+public:
+    using CommonHashKey = BasicCommonHashKey;
 private:
-    std::vector<Board::HashKeySet> hashkeys_;  // それぞれのマスのキー(一人分)
+    std::vector<typename Board::HashKeySet> hashkeys_;  // それぞれのマスのキー(一人分)
 
 public:
-    explicit CommonHashKey(Player n_players) {
-        const Board::HashKey upper = std::numeric_limits<Board::HashKey>::max() - 1;
-        const Board::HashKey lower = 1;
-        std::random_device seed_gen;
-        std::mt19937 engine(seed_gen());
-        std::uniform_int_distribution<Board::HashKey> dist(lower, upper);
+    // 実行ごとに異なるキーにする
+    explicit BasicCommonHashKey(Player n_players) : CommonHashKey(n_players, Random::random_seed()) {}
+
+    // シードが同じなら同じキーにする
+    BasicCommonHashKey(Player n_players, Random::Seed seed) {
+        const typename Board::HashKey upper = std::numeric_limits<typename Board::HashKey>::max() - 1;
+        const typename Board::HashKey lower = 1;
+        Random engine(seed);
 
-        std::vector<Board::HashKeySet> hashkeys(n_players);
+        std::vector<typename Board::HashKeySet> hashkeys(n_players);
 
         for(decltype(n_players) i{0}; i<n_players; ++i) {
             // 非0の乱数をキーにする。乱数はプレイヤーごとに異なる。
+            // 標準の分布は処理系によって結果が違うので、範囲外の値を引き直す
             for(auto&& key : hashkeys.at(i)) {
-                key = dist(engine);
+                do {
+                    key = engine();
+                } while((key < lower) || (key > upper));
             }
         }
 
         std::swap(hashkeys_, hashkeys);
     }
 
-    ~CommonHashKey() = default;
+    ~BasicCommonHashKey() = default;
 
     // 固定ハッシュキー一人分を返す
     // 参照を返すので、このオブジェクトの寿命を超えて使うと
@@ -356,7 +648,8 @@ public:
 };
 
 // 局面
-class Stage final {
+template <typename Board>
+class BasicStage final {
     FRIEND_TEST(TestBoard, Initialize);
     FRIEND_TEST(TestStage, Initialize);
     FRIEND_TEST(TestStage, Player);
@@ -366,6 +659,11 @@ class Stage final {
     FRIEND_TEST(TestStage, Digest);
     FRIEND_TEST(TestStage, Full);
     FRIEND_TEST(TestStage, LegalActions);
+    FRIEND_TEST(TestStage, Playable);
+    FRIEND_TEST(TestStage, AdvanceOutOfRange);
+    FRIEND_TEST(TestStage, AdvanceUnchecked);
+    FRIEND_TEST(TestStage, Undo);
+    FRIEND_TEST(TestStage, WinningMoves);
     FRIEND_TEST(TestStage, Advance1);
     FRIEND_TEST(TestStage, Advance2);
     FRIEND_TEST(TestStage, Draw);
@@ -373,6 +671,8 @@ class Stage final {
     FRIEND_TEST(TestNode, Stage);
     FRIEND_TEST(TestNodeSet, Add);
 public:
+    using Stage = BasicStage;
+    using CommonHashKey = BasicCommonHashKey<Board>;
     static constexpr Player SizeOfPlayers {2};  // プレイヤーの数
     static inline const char Blank {'.'};       // 何も置いてないマスの記号
     static inline const std::string Marks {"+-"};  // それぞれのプレイヤーが置いたマスの記号
@@ -391,13 +691,28 @@ private:
     Player player_ {0};    // 先手番なら0, 後手番なら1
 
 public:
-    explicit Stage(const CommonHashKey& keys) :
+    explicit BasicStage(const CommonHashKey& keys) :
         boards_({Board(keys.hashkeys(0)), Board(keys.hashkeys(1))}),
         merged_board_(keys.hashkeys(0)) {
         merge_boards();
     }
 
-    ~Stage() = default;
+    // プレイヤーごとの石の配置と手番から局面を作る
+    // ダイジェストはハッシュキーから求め直すので、別のキーで保存した局面も読み込める
+    BasicStage(const CommonHashKey& keys, Board::Cells first, Board::Cells second, Player player) :
+        BasicStage(keys) {
+        const std::array<typename Board::Cells, SizeOfPlayers> cells {first, second};
+        for(Player i{0}; i < SizeOfPlayers; ++i) {
+            for(auto remaining = cells.at(i); remaining; remaining &= remaining - 1) {
+                const auto position = Board::to_position(std::countr_zero(remaining));
+                boards_.at(i).place(position.column, position.height);
+            }
+        }
+        player_ = player & 1;
+        merge_boards();
+    }
+
+    ~BasicStage() = default;
 
     // 現在のプレイヤーを取得する
     Player player() const {
@@ -432,6 +747,11 @@ public:
         return merged_board_.digest();
     }
 
+    // 左右を反転した局面を同一視するダイジェスト
+    Board::HashKey canonical_digest() const {
+        return merged_board_.canonical_digest();
+    }
+
     // 打てる場所が無ければtrue、あればfalse
     bool full() const {
         return merged_board_.full();
@@ -442,68 +762,137 @@ public:
         return merged_board_.legal_actions();
     }
 
+    // 各列で次に石を置けるマスを返す
+    Board::Cells playable() const {
+        return Board::playable(merged_board_.cells());
+    }
+
+    // 指定したプレイヤーが石を置いたマスを返す
+    Board::Cells cells(Player player) const {
+        return boards_[player].cells();
+    }
+
+    // 現在のプレイヤーが打つと勝つマスを返す
+    Board::Cells winning_moves() const {
+        return playable() & Board::winning_cells(boards_[player_].cells());
+    }
+
+    // 現在のプレイヤーが勝っているかどうか返す
+    // 勝った手を打つと打ち手を逆にしないので、勝った局面では勝者が現在のプレイヤーになる
+    bool won() const {
+        return Board::has_line(boards_[player_].cells());
+    }
+
     // 指定した場所に一手打つ
     // 勝負がついていなければ打ち手を逆にする
     Result advance(Board::Coordinate column, Board::Coordinate height) {
-        const auto positions = legal_actions();
-        if (positions.empty()) {
+        const auto cells = playable();
+        if (!cells) {
             return Result::Draw;
         }
 
-        for(const auto& [c, h] : positions) {
-            if ((column == c) && (height == h)) {
-                // 合法手かどうかは呼び出し先では確認しない
-                boards_.at(player_).place(column, height);
-                // 統合した盤面は後で使うので、適切に更新する
-                merge_boards();
+        // 高さが範囲外だと隣の列のマスを指すので、先に座標を確かめる
+        const auto in_range = (column >= 0) && (column < Board::ColumnSize) &&
+            (height >= 0) && (height < Board::MaxHeight);
+        if (!in_range || !(cells & Board::to_bit(Board::to_index(column, height)))) {
+            // 打てる手が無かった
+            return Result::Invalid;
+        }
 
-                if (boards_.at(player_).check(column, height)) {
-                    return Result::Won;
-                }
+        return advance_unchecked(column, height);
+    }
 
-                if (full()) {
-                    return Result::Draw;
-                }
+    // 合法手であることを確かめずに一手打つ
+    // 合法手を自分で列挙した探索エンジンが使う
+    Result advance_unchecked(Board::Coordinate column, Board::Coordinate height) {
+        // 合法手かどうかは呼び出し先では確認しない
+        boards_[player_].place(column, height);
+        // 統合した盤面は後で使うので、適切に更新する
+        merge_boards();
 
-                player_ ^= 1;
-                return Result::Placed;
-            }
+        if (boards_[player_].check(column, height)) {
+            return Result::Won;
         }
 
-        // 打てる手が無かった
-        return Result::Invalid;
+        if (full()) {
+            return Result::Draw;
+        }
+
+        player_ ^= 1;
+        return Result::Placed;
+    }
+
+    // 最後に打った手を戻して、その手を打ったプレイヤーの手番にする
+    // 打った順と逆の順に戻すこと
+    void undo(Board::Coordinate column, Board::Coordinate height) {
+        const auto bit = Board::to_bit(Board::to_index(column, height));
+        for(Player player{0}; player < SizeOfPlayers; ++player) {
+            if (boards_[player].cells() & bit) {
+                boards_[player].remove(column, height);
+                player_ = player;
+                merge_boards();
+                return;
+            }
+        }
     }
 };
 
 // 局面を納めるノード
-class Node final {
+template <typename Board>
+class BasicNode final {
     FRIEND_TEST(TestNode, Stage);
     FRIEND_TEST(TestNode, Tried);
     FRIEND_TEST(TestNode, FirstPlayerWon);
     FRIEND_TEST(TestNode, SecondPlayerWon);
     FRIEND_TEST(TestNode, Expanded);
+    FRIEND_TEST(TestNode, VirtualLoss);
+    FRIEND_TEST(TestNode, AddCounts);
     FRIEND_TEST(TestNode, AddParent);
     FRIEND_TEST(TestNode, AddChild);
+    FRIEND_TEST(TestNode, ChildCounts);
 public:
+    using Node = BasicNode;
+    using Stage = BasicStage<Board>;
     using Count = long long int;  // 試行回数
+    using Epoch = uint64_t;       // 逆伝播の世代
+    using Edges = std::span<Node* const>;  // 親ノードまたは子ノードの一覧
+
+    // 一手打つと石が置ける場所が一つ埋まるので、子ノードは高々列数だけある
+    // 親ノードは最後に打った列を戻した局面なので、やはり高々列数だけある
+    static constexpr size_t MaxEdges = Board::ColumnSize;
 
 private:
+    // 複数スレッドが同時に更新するので、回数はアトミックにする
+    // 回数どうしの整合性は取らない(多少ずれても探索には影響しない)
+    using AtomicCount = std::atomic<Count>;
+
     Stage stage_;  // 局面
-    Count n_tried_ {0};              // このノードを探索した回数
-    Count n_first_player_won_ {0};   // 先手が勝った回数
-    Count n_second_player_won_ {0};  // 後手が勝った回数
-    bool expanded_ {false};  // 子ノードを展開済
+    AtomicCount n_tried_ {0};              // このノードを探索した回数
+    AtomicCount n_first_player_won_ {0};   // 先手が勝った回数
+    AtomicCount n_second_player_won_ {0};  // 後手が勝った回数
+    std::atomic<bool> expanded_ {false};   // 子ノードを展開済
+    Epoch epoch_ {0};  // 最後に逆伝播で訪れた世代。探索エンジンが排他して読み書きする。
 
     // 一手ごとに石が増えるので、親子関係が循環することはあり得ない
     // ノードの所有権はNodeSetが持っているので、ここでは生ポインタにする
     // そうしないと親子ノードでshared_ptrが循環参照してオブジェクトを解放できなくなる
-    std::vector<Node*> parents_;   // 親ノード一覧
-    std::vector<Node*> children_;  // 子ノード一覧
+    // 親子ノードの数には上限があるので、ヒープから確保せずにノードに埋め込む
+    std::array<Node*, MaxEdges> parents_ {};   // 親ノード一覧
+    std::array<Node*, MaxEdges> children_ {};  // 子ノード一覧
+    uint8_t n_parents_ {0};   // 親ノードの数
+    uint8_t n_children_ {0};  // 子ノードの数
+
+    // 子ノードを選ぶときに子ノードを一つずつたどらなくてよいように、
+    // 子ノードの統計を子ノードの添え字ごとに親ノードに並べて持つ(SoA)
+    // 逆伝播で子ノードと一緒に更新する
+    std::array<AtomicCount, MaxEdges> child_first_player_won_ {};   // 子ノードで先手が勝った回数
+    std::array<AtomicCount, MaxEdges> child_second_player_won_ {};  // 子ノードで後手が勝った回数
+    std::array<AtomicCount, MaxEdges> child_virtual_loss_ {};  // 子ノードを探索中のスレッド数
 
 public:
-    explicit Node(const Stage& stage) : stage_(stage), expanded_{false} {}
+    explicit BasicNode(const Stage& stage) : stage_(stage), expanded_{false} {}
 
-    ~Node() = default;
+    ~BasicNode() = default;
 
     // 局面を返す。参照なのでコピーしない。
     const Stage& stage() const {
@@ -512,42 +901,117 @@ public:
 
     // このノードを探索した回数を取得する
     Count n_tried() const {
-        return n_tried_;
+        return n_tried_.load(std::memory_order_relaxed);
+    }
+
+    // 逆伝播で訪れた世代を記録する。その世代で初めて訪れたならtrueを返す。
+    // 世代ごとに印を付け直すので、訪れたノードの集合を作らなくてよい
+    bool mark(Epoch epoch) {
+        if (epoch_ == epoch) {
+            return false;
+        }
+        epoch_ = epoch;
+        return true;
     }
 
     // このノードを探索した回数を一回増やす
     void increment_n_tried() {
-        ++n_tried_;
+        n_tried_.fetch_add(1, std::memory_order_relaxed);
     }
 
     // 先手が勝った回数を取得する
     Count n_first_player_won() const {
-        return n_first_player_won_;
+        return n_first_player_won_.load(std::memory_order_relaxed);
     }
 
     // 先手が勝った回数を一回増やす
     void increment_n_first_player_won() {
-        ++n_first_player_won_;
+        n_first_player_won_.fetch_add(1, std::memory_order_relaxed);
     }
 
     // 後手が勝った回数を取得する
     Count n_second_player_won() const {
-        return n_second_player_won_;
+        return n_second_player_won_.load(std::memory_order_relaxed);
     }
 
     // 後手が勝った回数を一回増やす
     void increment_n_second_player_won() {
-        ++n_second_player_won_;
+        n_second_player_won_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 他の探索で数えた回数をまとめて足す
+    void add_counts(Count n_tried, Count n_first_player_won, Count n_second_player_won) {
+        n_tried_.fetch_add(n_tried, std::memory_order_relaxed);
+        n_first_player_won_.fetch_add(n_first_player_won, std::memory_order_relaxed);
+        n_second_player_won_.fetch_add(n_second_player_won, std::memory_order_relaxed);
+    }
+
+    // 子ノードの添え字を返す。子ノードでなければMaxEdgesを返す。
+    size_t child_index(const Node* node) const {
+        for(size_t i{0}; i<n_children_; ++i) {
+            if (children_[i] == node) {
+                return i;
+            }
+        }
+        return MaxEdges;
+    }
+
+    // 子ノードで先手が勝った回数を取得する
+    Count child_first_player_won(size_t index) const {
+        return child_first_player_won_[index].load(std::memory_order_relaxed);
+    }
+
+    // 子ノードで後手が勝った回数を取得する
+    Count child_second_player_won(size_t index) const {
+        return child_second_player_won_[index].load(std::memory_order_relaxed);
+    }
+
+    // 子ノードに足した回数を、親ノードに並べた統計にも足す
+    void add_child_counts(size_t index, Count n_first_player_won, Count n_second_player_won) {
+        child_first_player_won_[index].fetch_add(n_first_player_won, std::memory_order_relaxed);
+        child_second_player_won_[index].fetch_add(n_second_player_won, std::memory_order_relaxed);
+    }
+
+    // 親ノードに並べた統計を、指定した回数で置き換える
+    void set_child_counts(size_t index, Count n_first_player_won, Count n_second_player_won) {
+        child_first_player_won_[index].store(n_first_player_won, std::memory_order_relaxed);
+        child_second_player_won_[index].store(n_second_player_won, std::memory_order_relaxed);
+    }
+
+    // 子ノードを探索中のスレッド数を取得する
+    Count n_virtual_loss(size_t index) const {
+        return child_virtual_loss_[index].load(std::memory_order_relaxed);
+    }
+
+    // 全ての子ノードを探索中のスレッド数を足して返す
+    Count n_virtual_loss() const {
+        Count total {0};
+        for(size_t i{0}; i<n_children_; ++i) {
+            total += n_virtual_loss(i);
+        }
+        return total;
+    }
+
+    // 子ノードの探索を始めたスレッドを数える。結果が出るまでは負けたとみなす。
+    void add_virtual_loss(size_t index) {
+        child_virtual_loss_[index].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 子ノードの探索を終えたスレッドを数えない
+    void remove_virtual_loss(size_t index) {
+        child_virtual_loss_[index].fetch_sub(1, std::memory_order_relaxed);
     }
 
     // 子ノードを展開済かどうか返す
+    // 展開済なら、展開したスレッドが追加した子ノードが見える
     bool expanded() const {
-        return expanded_;
+        return expanded_.load(std::memory_order_acquire);
     }
 
     // 子ノードを展開済にする
+    // 子ノードを全て追加してから呼ぶ
     void set_expanded() {
-        expanded_ = true;
+        expanded_.store(true, std::memory_order_release);
     }
 
     // このノードのダイジェストを取得する
@@ -555,158 +1019,669 @@ public:
         return stage_.digest();
     }
 
-    // 親ノードを追加する
+    // 親ノードを追加する。上限を超えたら追加しない。
     void add_parent(Node* node) {
-        parents_.push_back(node);
+        if (n_parents_ < MaxEdges) {
+            parents_.at(n_parents_++) = node;
+        }
     }
 
     // 親ノード一覧を取得する
-    const std::vector<Node*>& parents() const {
-        return parents_;
+    Edges parents() const {
+        return Edges(parents_.data(), n_parents_);
     }
 
-    // 子ノードを追加する
+    // 子ノードを追加する。上限を超えたら追加しない。
+    // 子ノードの統計を、親ノードに並べた統計に写す
     void add_child(Node* node) {
-        children_.push_back(node);
+        if (n_children_ < MaxEdges) {
+            child_first_player_won_[n_children_].store(node->n_first_player_won(), std::memory_order_relaxed);
+            child_second_player_won_[n_children_].store(node->n_second_player_won(), std::memory_order_relaxed);
+            children_.at(n_children_++) = node;
+        }
     }
 
     // 子ノード一覧を取得する
-    const std::vector<Node*>& children() const {
-        return children_;
-    }
-};
-
-// 重複するノードを持たない集合
-class NodeSet final {
-public:
-    std::map<Board::HashKey, std::unique_ptr<Node>> set_;  // ノードの集合
-
-    NodeSet() = default;
-    ~NodeSet() = default;
-
-    // ノードを追加する。既にあるならあったものを返す。
-    // いずれにせよ呼び出し元のスマートポインタは空になる
-    Node* add(std::unique_ptr<Node>& node) {
-        const auto digest = node->digest();
-        if (set_.find(digest) == set_.end()) {
-            set_[digest] = std::move(node);
-        } else {
-            node.reset();
-        }
-        return set_[digest].get();
+    Edges children() const {
+        return Edges(children_.data(), n_children_);
     }
 
-    // 盤面からノードを探す
-    Node* find(const Stage& stage) const {
-        const auto digest = stage.digest();
-        auto it = set_.find(digest);
-        return (it != set_.end()) ? (it->second).get() : nullptr;
+    // 子ノードに含まれるかどうか返す
+    bool has_child(const Node* node) const {
+        const auto edges = children();
+        return std::find(edges.begin(), edges.end(), node) != edges.end();
     }
 };
 
-// MCTS (Monte Carlo Tree Search)
-class MctsEngine final {
-    FRIEND_TEST(TestMctsEngine, ExpandRoot);
-    FRIEND_TEST(TestMctsEngine, Join);
-    FRIEND_TEST(TestMctsEngine, ExpandColumns);
-    FRIEND_TEST(TestMctsEngine, Play);
-    FRIEND_TEST(TestMctsEngine, Playout);
+// ノードを確保する領域(arena)
+// ノードをまとめて確保したチャンクから順に切り出し、個々のノードを解放せずにチャンクごと解放する
+// チャンクはCASで登録するので、複数のスレッドがロックせずにノードを確保できる
+template <typename Board>
+class BasicNodeArena final {
+    FRIEND_TEST(TestNodeArena, Initialize);
+public:
+    using NodeArena = BasicNodeArena;
+    using Stage = BasicStage<Board>;
+    using Node = BasicNode<Board>;
+    using Size = size_t;  // ノードの数
+    static constexpr Size ChunkSize {4096};  // 一つのチャンクに納めるノードの数
+
 private:
-    static constexpr Node::Count ToExpand {15};  // 何回たどり着いたら展開するか
-    static_assert(ToExpand > 0);
-    using Depth = Node::Count;  // 探索の深さ
-    using Metric = double;      // 評価指標
-    static constexpr Metric Epsilon = 1e-8;   // 0除算防止のガード
-    static constexpr Metric UcbConst = 1e+2;  // UCB1の定数
+    // チャンクごと解放するので、デストラクタを呼ばなくてよいようにする
+    static_assert(std::is_trivially_destructible_v<Node>);
 
-    NodeSet nodeset_;  // 探索木のノード
-    CommonHashKey hashkeys_;  // 盤面に共通のハッシュキー
-    Stage initial_stage_;     // 初期盤面
-    Node* root_ {nullptr};    // 根つまり初期局面
+    // 初期化していないノードの領域
+    struct alignas(Node) NodeStorage {
+        std::byte bytes[sizeof(Node)];
+    };
+    using Chunk = NodeStorage[ChunkSize];
 
-    // 乱数生成器
-    std::random_device rand_dev;
-    std::mt19937 rand_gen;
+    Size capacity_ {0};  // 確保できるノードの数
+    std::unique_ptr<std::atomic<NodeStorage*>[]> chunks_;  // 確保したチャンク
+    std::atomic<Size> size_ {0};      // 確保したノードの数
+    std::atomic<Size> n_chunks_ {0};  // 確保したチャンクの数
+
+    // チャンクの数
+    Size max_chunks() const {
+        return (capacity_ + ChunkSize - 1) / ChunkSize;
+    }
 
 public:
-    // 葉まで探索した結果
-    struct Result {
-        Stage::Result result;  // 勝ちか引き分け
-        Player winner;  // 勝者
-        Depth depth;    // 探索の深さ
-    };
+    // 確保できるノードの数を指定する
+    explicit BasicNodeArena(Size capacity) :
+        capacity_(capacity), chunks_(std::make_unique<std::atomic<NodeStorage*>[]>(max_chunks())) {}
+
+    ~BasicNodeArena() {
+        const auto n_chunks = max_chunks();
+        for(Size i{0}; i<n_chunks; ++i) {
+            delete[] chunks_[i].load(std::memory_order_relaxed);
+        }
+    }
 
-    MctsEngine() :
-        hashkeys_(Stage::SizeOfPlayers), initial_stage_(hashkeys_), rand_gen(rand_dev()) {
-        auto node = std::make_unique<Node>(initial_stage_);
-        root_ = nodeset_.add(node);
+    BasicNodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    // 確保したノードの数を返す
+    Size size() const {
+        return std::min(capacity_, size_.load(std::memory_order_relaxed));
     }
 
-    ~MctsEngine() = default;
+    // 確保したチャンクの数、つまりヒープから確保した回数を返す
+    Size n_chunks() const {
+        return n_chunks_.load(std::memory_order_relaxed);
+    }
 
-    // ハッシュキーをこの探索と共有する初期局面のコピーを返す
-    // ハッシュキーを共有しない局面は探しても見つからない
-    Stage initial_stage() const {
-        return root_->stage();
+    // ヒープから確保した大きさをバイト単位で返す
+    Size n_bytes() const {
+        return n_chunks() * sizeof(Chunk);
     }
 
-    // ノードを深くたどり着けるところまで選ぶ
-    std::pair<Node*, Node::Count> visit(Node* node, Node::Count depth) {
-        if (node->n_tried() < ToExpand) {
-            return std::make_pair(node, depth);
+    // ノードを作る。確保できなければnullptrを返す。
+    Node* create(const Stage& stage) {
+        const auto index = size_.fetch_add(1, std::memory_order_relaxed);
+        if (index >= capacity_) {
+            return nullptr;
         }
 
-        // 親ノードを共有しても展開は一回だけ行う
-        if (node->n_tried() >= ToExpand) {
-            expand(node);
+        auto& chunk = chunks_[index / ChunkSize];
+        auto storage = chunk.load(std::memory_order_acquire);
+        if (!storage) {
+            // 同じチャンクを他のスレッドが先に確保したら、自分が確保したものは捨てる
+            auto new_storage = new Chunk;
+            if (chunk.compare_exchange_strong(storage, new_storage, std::memory_order_acq_rel)) {
+                storage = new_storage;
+                n_chunks_.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                delete[] new_storage;
+            }
         }
 
-        auto child = select(node);
-        if (child == node) {
-            // 子ノードが無かった
-            return std::make_pair(node, depth);
-        }
+        return new (storage[index % ChunkSize].bytes) Node(stage);
+    }
+};
+
+// 重複するノードを持たない集合
+// 盤面のダイジェストをキーにした、容量固定のopen addressingのハッシュ表(置換表)である
+// スロットはCASで確保するので、複数のスレッドがロックせずに追加と検索ができる
+template <typename Board>
+class BasicNodeSet final {
+    FRIEND_TEST(TestNodeSet, Capacity);
+public:
+    using NodeSet = BasicNodeSet;
+    using Stage = BasicStage<Board>;
+    using Node = BasicNode<Board>;
+    using NodeArena = BasicNodeArena<Board>;
+    using Size = size_t;  // スロットの数
+    // スロットの数の既定値。初期局面から約600万回探索すると一杯になる。
+    static constexpr Size DefaultCapacity {1 << 20};
+
+private:
+    // 空のスロットを表すキー
+    // 初期局面のダイジェストは0なので0は使えない。盤面のキーがこの値になることは実質無い。
+    static constexpr typename Board::HashKey EmptyKey = std::numeric_limits<typename Board::HashKey>::max();
+    static constexpr Size MaxProbes {256};  // 一回の検索で調べるスロットの最大数
+
+    // キーとノードを並べて、一回の検索で読むキャッシュラインを一つにする
+    struct alignas(16) Slot {
+        std::atomic<typename Board::HashKey> key {EmptyKey};  // 盤面のダイジェスト
+        std::atomic<Node*> node {nullptr};  // キーを確保したスレッドが後からノードを置く
+    };
 
-        return visit(child, depth + 1);
+    Size mask_ {0};  // スロットの添え字のマスク(スロットの数 - 1)
+    bool symmetric_ {true};  // 左右を反転した局面を同じノードにする
+    std::unique_ptr<Slot[]> slots_;  // スロットの配列
+    std::atomic<Size> size_ {0};     // 登録したノードの数
+    std::atomic<Size> n_lookups_ {0};  // 追加しようとした回数(既にあったものを含む)
+    std::atomic<Size> n_failed_ {0};   // 表が一杯で追加できなかった回数
+    std::unique_ptr<NodeArena> arena_;  // ノードの実体
+
+    // 局面を探すキー
+    Board::HashKey key(const Stage& stage) const {
+        return symmetric_ ? stage.canonical_digest() : stage.digest();
     }
 
-    // ノードを子から選ぶ
-    Node* select(Node* parent) {
-        if (parent->children().empty()) {
-            // 自身を返す
-            return parent;
+    // 他のスレッドがキーを確保してノードを置くまで待つ
+    static Node* wait_node(const Slot& slot) {
+        for(;;) {
+            auto node = slot.node.load(std::memory_order_acquire);
+            if (node) {
+                return node;
+            }
+            std::this_thread::yield();
         }
+    }
 
-        auto size = parent->children().size();
-        std::vector<Metric> scores(size);
+    // キーがあるスロットか、キーを置くべき空のスロットを探す
+    // 見つからなければ(表が一杯なら)nullptrを返す
+    // 表が埋まってくると探す距離が表の大きさまで伸びるので、MaxProbes個先で諦める
+    // 追加も同じ距離で諦めるので、登録したキーは必ずMaxProbes個以内にある
+    template <typename Func>
+    Node* probe(Board::HashKey digest, Func&& on_empty) const {
+        auto index = static_cast<Size>(digest) & mask_;
+        const auto n_probes = std::min(mask_ + 1, MaxProbes);
+        for(Size i{0}; i < n_probes; ++i) {
+            auto& slot = slots_[index];
+            auto key = slot.key.load(std::memory_order_acquire);
+            if (key == EmptyKey) {
+                // 空のスロットを確保できたら終わり。他のスレッドに先を越されたらキーを比べる。
+                if (on_empty(slot, key)) {
+                    return slot.node.load(std::memory_order_acquire);
+                }
+            }
 
-        Node::Count all_tried {0};
-        for(const auto& child : parent->children()) {
-            const auto n_tried = child->n_first_player_won() + child->n_second_player_won();
-            if (n_tried == 0) {
-                return child;
+            if (key == EmptyKey) {
+                return nullptr;
             }
-            all_tried += n_tried;
-        }
 
-        for(decltype(size) i{0}; i<size; ++i) {
-            auto& child = parent->children().at(i);
-            scores.at(i) = ucb1(parent->stage().player(), all_tried, child);
+            if (key == digest) {
+                return wait_node(slot);
+            }
+
+            index = (index + 1) & mask_;
         }
 
-        const auto index = std::max_element(scores.begin(), scores.end()) - scores.begin();
-        return parent->children().at(index);
+        return nullptr;
     }
 
-    // UCB1
-    Metric ucb1(Player player, Node::Count all_tried, Node* node) {
-        Metric n_tried = node->n_first_player_won() + node->n_second_player_won();
-        n_tried += Epsilon;
+public:
+    // スロットの数は2のべき乗に切り上げる
+    // symmetricなら、左右を反転した局面は同じ評価なので一つのノードにまとめる
+    explicit BasicNodeSet(Size capacity = DefaultCapacity, bool symmetric = true) : symmetric_(symmetric) {
+        Size size {1};
+        while(size < capacity) {
+            size <<= 1;
+        }
+
+        mask_ = size - 1;
+        slots_ = std::make_unique<Slot[]>(size);
+        arena_ = std::make_unique<NodeArena>(size);
+    }
+
+    // ノードはarenaがまとめて解放する
+    ~BasicNodeSet() = default;
+
+    BasicNodeSet(const NodeSet&) = delete;
+    NodeSet& operator=(const NodeSet&) = delete;
+
+    // スロットの数を返す
+    Size capacity() const {
+        return mask_ + 1;
+    }
+
+    // 登録したノードの数を返す
+    Size size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    // 局面をノードとして追加する。既にあるならあったものを返す。
+    // ノードはスロットを確保してから作るので、重複したノードを作らない
+    // 表が一杯で追加できなければnullptrを返す
+    Node* add(const Stage& stage) {
+        const auto digest = key(stage);
+        n_lookups_.fetch_add(1, std::memory_order_relaxed);
+        const auto node = probe(digest, [this, digest, &stage](Slot& slot, Board::HashKey& key) {
+            if (!slot.key.compare_exchange_strong(key, digest, std::memory_order_acq_rel)) {
+                // keyには先を越したスレッドのキーが入る
+                return false;
+            }
+
+            // スロットの数だけノードを確保できるので、ここでは必ず作れる
+            slot.node.store(arena_->create(stage), std::memory_order_release);
+            size_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        });
+
+        if (!node) {
+            n_failed_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return node;
+    }
+
+    // 盤面からノードを探す
+    Node* find(const Stage& stage) const {
+        return probe(key(stage), [](Slot&, Board::HashKey&) { return false; });
+    }
+
+    // 他の集合とノードを全て入れ替える
+    // スロットを確保中のスレッドがあってはならない
+    void swap(NodeSet& other) {
+        std::swap(mask_, other.mask_);
+        std::swap(symmetric_, other.symmetric_);
+        slots_.swap(other.slots_);
+        const auto size = size_.load(std::memory_order_relaxed);
+        size_.store(other.size_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.size_.store(size, std::memory_order_relaxed);
+        const auto n_lookups = n_lookups_.load(std::memory_order_relaxed);
+        n_lookups_.store(other.n_lookups_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.n_lookups_.store(n_lookups, std::memory_order_relaxed);
+        const auto n_failed = n_failed_.load(std::memory_order_relaxed);
+        n_failed_.store(other.n_failed_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.n_failed_.store(n_failed, std::memory_order_relaxed);
+        arena_.swap(other.arena_);
+    }
+
+    // 追加しようとした回数を返す
+    Size n_lookups() const {
+        return n_lookups_.load(std::memory_order_relaxed);
+    }
+
+    // 表が一杯で追加できなかった回数を返す
+    Size n_failed() const {
+        return n_failed_.load(std::memory_order_relaxed);
+    }
+
+    // 追加しようとした局面が既にあった割合(置換表のヒット率)を返す
+    // 他の経路から同じ局面にたどり着くと、ノードを作らずに合流する
+    double hit_rate() const {
+        const auto n_lookups = this->n_lookups();
+        const auto n_nodes = size();
+        return (n_lookups > n_nodes) ? (static_cast<double>(n_lookups - n_nodes) / n_lookups) : 0.0;
+    }
+
+    // ノードの実体を確保した領域を返す
+    const NodeArena& arena() const {
+        return *arena_;
+    }
+
+    // スロットとノードに使った大きさをバイト単位で返す
+    Size n_bytes() const {
+        return capacity() * sizeof(Slot) + arena_->n_bytes();
+    }
+
+    // 登録したノードを一つずつ引数にして関数を呼ぶ
+    template <typename Func>
+    void for_each(Func&& func) const {
+        for(Size i{0}; i <= mask_; ++i) {
+            if (auto node = slots_[i].node.load(std::memory_order_acquire)) {
+                func(node);
+            }
+        }
+    }
+};
+
+// MCTS (Monte Carlo Tree Search)
+template <typename Board>
+class BasicMctsEngine final {
+    FRIEND_TEST(TestMctsEngine, ExpandRoot);
+    FRIEND_TEST(TestMctsEngine, ExpandTableFull);
+    FRIEND_TEST(TestMctsEngine, Join);
+    FRIEND_TEST(TestMctsEngine, ExpandColumns);
+    FRIEND_TEST(TestMctsEngine, Play);
+    FRIEND_TEST(TestMctsEngine, Playout);
+    FRIEND_TEST(TestMctsEngine, PlaySpeed);
+    FRIEND_TEST(TestMctsEngine, Rollout);
+    FRIEND_TEST(TestMctsEngine, RolloutWon);
+    FRIEND_TEST(TestMctsEngine, RolloutsPerLeaf);
+    FRIEND_TEST(TestMctsEngine, RolloutBatchWon);
+    FRIEND_TEST(TestMctsEngine, RolloutBatchSameAsSequential);
+    FRIEND_TEST(TestMctsEngine, RolloutsPerLeafBatched);
+    FRIEND_TEST(TestMctsEngine, RolloutsPerLeafSpeed);
+    FRIEND_TEST(TestMctsEngine, ParallelTree);
+    FRIEND_TEST(TestMctsEngine, ParallelRoot);
+    FRIEND_TEST(TestMctsEngine, Merge);
+    FRIEND_TEST(TestMctsEngine, BackpropagateGraph);
+    FRIEND_TEST(TestMctsEngine, BackpropagatePath);
+    FRIEND_TEST(TestMctsEngine, PathEdgeCounts);
+    FRIEND_TEST(TestMctsEngine, BackpropagationSpeed);
+    FRIEND_TEST(TestMctsEngine, Commit);
+    FRIEND_TEST(TestMctsEngine, CommitInvalid);
+    FRIEND_TEST(TestMctsEngine, CommitCapacity);
+    FRIEND_TEST(TestMctsEngine, CommitMatch);
+    FRIEND_TEST(TestMctsEngine, SearchPlayouts);
+    FRIEND_TEST(TestMctsEngine, SearchTime);
+    FRIEND_TEST(TestMctsEngine, SearchEmptyBudget);
+    FRIEND_TEST(TestMctsEngine, SelectSameAsUcb1);
+    FRIEND_TEST(TestMctsEngine, SelectSpeed);
+    FRIEND_TEST(TestMctsEngine, SymmetricNodeCount);
+    FRIEND_TEST(TestMctsEngine, Reproducible);
+    FRIEND_TEST(TestMctsEngine, ParallelScaling);
+    FRIEND_TEST(TestMctsEngine, MemoryFootprint);
+    FRIEND_TEST(TestMctsEngine, ReportMirroredChild);
+    FRIEND_TEST(TestMctsEngine, LoadCapacity);
+public:
+    using MctsEngine = BasicMctsEngine;
+    using CommonHashKey = BasicCommonHashKey<Board>;
+    using Stage = BasicStage<Board>;
+    using Node = BasicNode<Board>;
+    using NodeSet = BasicNodeSet<Board>;
+private:
+    static constexpr Node::Count ToExpand {15};  // 何回たどり着いたら展開するか
+    static constexpr NodeSet::Size MinCapacity {1 << 10};  // 手を確定した後の置換表のスロットの数の下限
+    static_assert(ToExpand > 0);
+    using Depth = Node::Count;  // 探索の深さ
+    using Metric = double;      // 評価指標
+    using Path = std::vector<Node*>;  // 根から葉までにvirtual lossを加えたノード
+    using Clock = std::chrono::steady_clock;  // 探索時間を測る時計
+    static constexpr Node::Count CheckInterval {64};  // 何回探索するごとに時刻を読むか
+    static constexpr Metric Epsilon = 1e-8;   // 0除算防止のガード
+    static constexpr Metric UcbConst = 1e+2;  // UCB1の定数
+    static constexpr Node::Count UcbTableSize {1 << 10};  // UCB1の表を引く試行回数の上限
+    static constexpr size_t UcbLanes = std::bit_ceil(Node::MaxEdges);  // UCB1をまとめて計算する要素数
+
+public:
+    // 複数スレッドで探索する方法
+    enum class Parallel {
+        Tree,  // 全スレッドで一つの探索木を共有し、virtual lossで探索先を散らす
+        Root,  // スレッドごとに探索木を持ち、最後に統計を合算する
+    };
+
+    // 葉の局面から得た結果を足すノード
+    enum class Backpropagation {
+        Graph,  // 置換表で合流したノードも含めて、全ての先祖に足す
+        Path,   // 探索でたどった経路のノードだけに足す
+    };
+
+    // 葉の局面から複数回プレイする方法
+    enum class Evaluation {
+        Sequential,  // 一回ずつ最後までプレイする
+        Batched,     // BatchSize回ずつ一手ごとに揃えてプレイする
+    };
+
+    // 葉の局面からプレイするときの手の選び方
+    // どちらも一手で勝てるなら必ず勝つ
+    enum class Rollout {
+        Light,  // 置けるマスから一様に選ぶ
+        Heavy,  // 相手が次に勝つマスを塞ぎ、相手が勝つマスの真下を避けて選ぶ
+    };
+
+    // 探索の設定
+    struct Config {
+        unsigned int n_threads {1};          // 探索するスレッド数
+        Parallel parallel {Parallel::Tree};  // 複数スレッドで探索する方法
+        NodeSet::Size capacity {NodeSet::DefaultCapacity};  // 置換表のスロットの数
+        Node::Count n_rollouts {1};  // 葉の局面一つからランダムにプレイする回数
+        Evaluation evaluation {Evaluation::Sequential};  // 葉の局面から複数回プレイする方法
+        Backpropagation backpropagation {Backpropagation::Graph};  // 結果を足すノード
+        bool symmetric {true};  // 左右を反転した局面を同じノードにする
+        std::optional<Random::Seed> seed {};  // 乱数のシード(空なら実行ごとに変える)
+        Rollout rollout {Rollout::Light};     // 葉の局面からプレイするときの手の選び方
+    };
+
+    // 揃えてプレイする回数
+    static constexpr Node::Count BatchSize {8};
+
+    // 探索の予算。回数と時間の両方を指定したら、先に使い切った方で止める。
+    struct Budget {
+        Node::Count n_playouts {0};     // 探索する回数(0なら回数で制限しない)
+        MilliSec time {ZeroMilliSec};   // 探索する時間(0なら時間で制限しない)
+    };
+
+    // 探索した回数と深さ
+    struct Statistics {
+        Node::Count n_playouts {0};  // 探索した回数
+        Node::Count n_visited {0};   // 探索でたどったノードの延べ数
+        Node::Count max_depth {0};   // 探索でたどった最大の深さ
+        NodeSet::Size n_failed {0};  // 作業用の探索木の置換表が一杯でノードを追加できなかった回数
+
+        // 一回探索した結果を足す
+        void add(Node::Count depth) {
+            ++n_playouts;
+            n_visited += depth + 1;
+            max_depth = std::max(max_depth, depth);
+        }
+
+        // 他のスレッドの統計を足す
+        void merge(const Statistics& rhs) {
+            n_playouts += rhs.n_playouts;
+            n_visited += rhs.n_visited;
+            max_depth = std::max(max_depth, rhs.max_depth);
+            n_failed += rhs.n_failed;
+        }
+    };
+
+    // 探索した結果
+    struct SearchResult {
+        std::optional<typename Board::Position> action;  // 最善手(打つ手が無ければ空)
+        Metric value {0};  // 最善手を打って手番のプレイヤーが勝った割合
+        Node::Count n_playouts {0};  // 探索した回数
+        Node::Count n_visited {0};   // 探索でたどったノードの延べ数
+        Node::Count max_depth {0};   // 探索でたどった最大の深さ
+        NodeSet::Size n_nodes {0};   // 探索した後のノードの数
+        NodeSet::Size n_failed {0};  // 置換表が一杯でノードを追加できなかった延べ回数
+        std::chrono::duration<double> elapsed {0};  // 探索に掛かった時間
+
+        // 一秒あたりにたどったノードの数
+        double nodes_per_sec() const {
+            return (elapsed.count() > 0) ? (n_visited / elapsed.count()) : 0.0;
+        }
+
+        // 一秒あたりの探索回数
+        double playouts_per_sec() const {
+            return (elapsed.count() > 0) ? (n_playouts / elapsed.count()) : 0.0;
+        }
+    };
+
+private:
+    Config config_;    // 探索の設定
+    NodeSet nodeset_;  // 探索木のノード
+    // 複数の探索木でハッシュキーを共有するので、所有権を共有する
+    std::shared_ptr<const CommonHashKey> hashkeys_;  // 盤面に共通のハッシュキー
+    Stage initial_stage_;     // 初期盤面
+    Node* root_ {nullptr};    // 根つまり初期局面
+
+    // 親子関係は複数のスレッドが変更するので排他する
+    // ノードの集合はロックフリーで、試行回数はアトミックなので排他しない
+    std::mutex mutex_;
+    Node::Epoch epoch_ {0};          // 逆伝播の世代。mutex_で排他する。
+    NodeSet::Size n_search_nodes_ {0};    // 一回の探索で増えたノードの数の最大値
+    NodeSet::Size n_reserved_nodes_ {0};  // 前回の探索の前に、増える分として空けたノードの数
+    NodeSet::Size max_capacity_ {0};  // 置換表のスロットの数の上限。設定より大きな探索木を読み込んだら広げる。
+    std::vector<Node*> ancestors_;  // 逆伝播で使い回す作業領域。mutex_で排他する。
+    Path path_;  // 一つのスレッドで探索するときにたどった経路
+
+    // 乱数生成器
+    Random rand_gen;
+
+public:
+    // 葉まで探索した結果
+    struct Result {
+        Stage::Result result;  // 勝ちか引き分け
+        Player winner;  // 勝者
+        Depth depth;    // 探索の深さ
+    };
+
+    BasicMctsEngine() : MctsEngine(Config{}) {}
+
+    // シードを決めたら、ハッシュキーも同じシードから作る
+    explicit BasicMctsEngine(const Config& config) :
+        BasicMctsEngine(config, config.seed.has_value() ?
+                   std::make_shared<const CommonHashKey>(Stage::SizeOfPlayers, ~config.seed.value()) :
+                   std::make_shared<const CommonHashKey>(Stage::SizeOfPlayers)) {}
+
+    // ハッシュキーを他の探索エンジンと共有する
+    BasicMctsEngine(const Config& config, std::shared_ptr<const CommonHashKey> hashkeys) :
+        config_(config), nodeset_(config.capacity, config.symmetric), hashkeys_(hashkeys),
+        initial_stage_(*hashkeys_),
+        rand_gen(config.seed.has_value() ? config.seed.value() : Random::random_seed()) {
+        config_.n_threads = std::max(1u, config_.n_threads);
+        config_.n_rollouts = std::max(typename Node::Count{1}, config_.n_rollouts);
+        max_capacity_ = config_.capacity;
+        root_ = nodeset_.add(initial_stage_);
+    }
+
+    ~BasicMctsEngine() = default;
+
+    // ハッシュキーをこの探索と共有する初期局面のコピーを返す
+    // ハッシュキーを共有しない局面は探しても見つからない
+    // 手を確定したり探索木を読み込んだりすると、根に移した局面を返す
+    Stage initial_stage() const {
+        return root_->stage();
+    }
+
+    // ハッシュキーをこの探索と共有する、石を置いていない盤面のコピーを返す
+    // 根を移しても変わらないので、新しい対局はこの局面から始める
+    Stage empty_stage() const {
+        return initial_stage_;
+    }
+
+    // 複数のスレッドで一つの探索木を共有するなら、探索中のノードにvirtual lossを加える
+    bool uses_virtual_loss() const {
+        return config_.n_threads > 1;
+    }
+
+    // ノードを深くたどり着けるところまで選ぶ
+    // pathを指定したら、選んだ子ノードをpathに記録する
+    // さらに複数のスレッドで探索するなら、選んだ子ノードにvirtual lossを加える
+    std::pair<Node*, typename Node::Count> visit(Node* node, Node::Count depth, Path* path = nullptr) {
+        if (node->n_tried() < ToExpand) {
+            return std::make_pair(node, depth);
+        }
+
+        // 親ノードを共有しても展開は一回だけ行う
+        if (node->n_tried() >= ToExpand) {
+            expand(node);
+        }
+
+        const auto index = select_index(node);
+        if (index >= node->children().size()) {
+            // 子ノードが無かった
+            return std::make_pair(node, depth);
+        }
+
+        auto child = node->children()[index];
+        if (path) {
+            if (uses_virtual_loss()) {
+                node->add_virtual_loss(index);
+            }
+            path->push_back(child);
+        }
+
+        return visit(child, depth + 1, path);
+    }
+
+    // ノードを子から選ぶ
+    // 子ノードが無ければ自身を返す
+    Node* select(Node* parent) {
+        const auto index = select_index(parent);
+        return (index < parent->children().size()) ? parent->children()[index] : parent;
+    }
+
+    // ノードを子から選んで、子ノードの添え字を返す
+    // 子ノードが無ければMaxEdgesを返す
+    // 子ノードの統計は親ノードに並んでいるので、子ノードをたどらない
+    size_t select_index(const Node* parent) const {
+        const auto size = parent->children().size();
+        if (size == 0) {
+            return Node::MaxEdges;
+        }
 
+        // 他のスレッドが探索中のノードは、負けが決まったものとみなして選びにくくする
         // 先手も後手もそれぞれ自分が勝てる子ノードを探索する
-        // 親ノードの始点でこのノード(node)を選ぶと勝てるかどうか見ているので、
-        // 親ノードのplayerとこのノード(node)のnode->stage_.player_は反対であることに注意する
+        // 親ノードの始点で子ノードを選ぶと勝てるかどうか見ているので、
+        // 親ノードのplayerと子ノードのplayerは反対であることに注意する
         // 多くの実装では勝率を反転することで視点切り替えを組み込んでいる
+        // 子ノードが無い要素は-∞を足して選ばず、試行していない子ノードは+∞を足して先に選ぶ
+        constexpr auto infinity = std::numeric_limits<Metric>::infinity();
+        const bool first = (parent->stage().player() == 0);
+        std::array<Metric, UcbLanes> n_tried {};
+        std::array<Metric, UcbLanes> n_win {};
+        std::array<Metric, UcbLanes> bonus {};
+        n_tried.fill(1.0);
+        bonus.fill(-infinity);
+        typename Node::Count all_tried {0};
+        for(size_t i{0}; i<size; ++i) {
+            const auto n_first = parent->child_first_player_won(i);
+            const auto n_second = parent->child_second_player_won(i);
+            const auto n = n_first + n_second + parent->n_virtual_loss(i);
+            n_tried[i] = static_cast<Metric>(std::max<typename Node::Count>(n, 1));
+            n_win[i] = static_cast<Metric>(first ? n_first : n_second);
+            bonus[i] = (n == 0) ? infinity : 0.0;
+            all_tried += n;
+        }
+
+        // 子ノードの数によらず固定長の配列全体について、分岐せずにUCB1を計算する
+        // 1/sqrt(n)は表を引かずに計算するので、gatherが要らずにベクトル化できる
+        const auto exploration = UcbConst * ucb_exploration(all_tried);
+        std::array<Metric, UcbLanes> scores {};
+        for(size_t i{0}; i<UcbLanes; ++i) {
+            const auto inv_sqrt = 1.0 / std::sqrt(n_tried[i]);
+            scores[i] = n_win[i] * inv_sqrt * inv_sqrt + exploration * inv_sqrt + bonus[i];
+        }
+
+        // 最大値は半分ずつ畳んで求め、最大値と等しい最初の子ノードを選ぶ。同点なら先の子ノードを選ぶ。
+        auto max_scores = scores;
+        for(size_t width{UcbLanes / 2}; width>0; width /= 2) {
+            for(size_t i{0}; i<width; ++i) {
+                max_scores[i] = std::max(max_scores[i], max_scores[i + width]);
+            }
+        }
+
+        size_t best {0};
+        for(size_t i{UcbLanes}; i>0; --i) {
+            best = (scores[i - 1] == max_scores[0]) ? (i - 1) : best;
+        }
+        return best;
+    }
+
+    // UCB1 = 勝率 + UcbConst * sqrt(2 log(全子ノードの試行回数) / 子ノードの試行回数)
+    //      = 勝った回数 / n + UcbConst * sqrt(2 log(全子ノードの試行回数)) * (1 / sqrt(n))
+    // 小さな試行回数のsqrt(2 log N)は表を引く。表はL1キャッシュに収まる大きさにする。
+    struct UcbTable {
+        std::array<Metric, UcbTableSize> exploration;  // sqrt(2 log N)
+    };
+
+    static const UcbTable& ucb_table() {
+        static const UcbTable table = []() {
+            UcbTable t {};
+            for(typename Node::Count i{1}; i<UcbTableSize; ++i) {
+                t.exploration[i] = std::sqrt(2.0 * std::log(static_cast<Metric>(i)));
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    // sqrt(2 log N)
+    static Metric ucb_exploration(Node::Count n) {
+        return (n < UcbTableSize) ? ucb_table().exploration[n] :
+            std::sqrt(2.0 * std::log(static_cast<Metric>(n)));
+    }
+
+    // UCB1 (子ノードの統計を直接読む版。選ぶときは親ノードに並べた統計を使う)
+    Metric ucb1(Player player, Node::Count all_tried, const Node* node) const {
+        Metric n_tried = node->n_first_player_won() + node->n_second_player_won();
+        n_tried += Epsilon;
+
         const Metric n_win = (player == 0) ?
             node->n_first_player_won() : node->n_second_player_won();
 
@@ -716,99 +1691,343 @@ public:
         return n_win / n_tried + UcbConst * std::sqrt(d);
     }
 
+    // 親子関係を登録する。登録済なら何もしない。
+    void link(Node* parent, Node* child) {
+        if (parent->has_child(child)) {
+            return;
+        }
+
+        parent->add_child(child);
+        child->add_parent(parent);
+    }
+
+    // 親子関係を登録して、親ノードに並べた統計を写し元の辺から写す
+    // 経路だけに逆伝播すると、辺の統計は子ノードの統計と一致しないからである
+    void link(Node* parent, Node* child, const Node* old_parent, size_t old_index) {
+        link(parent, child);
+        const auto index = parent->child_index(child);
+        if (index < Node::MaxEdges) {
+            parent->set_child_counts(index, old_parent->child_first_player_won(old_index),
+                                     old_parent->child_second_player_won(old_index));
+        }
+    }
+
     // ノードを一段展開する
+    // 置換表が一杯で子ノードを一つでも登録できなければ、子ノードをつながずに展開しない
+    // 手を欠いたまま展開済にすると、その手(必勝手かもしれない)を二度と探索しないからである
+    // 展開しなかったノードは葉として試行を続け、次にたどり着いたときにまた展開する
     void expand(Node* parent) {
         // 展開済なら何もしない
         if (parent->expanded()) {
             return;
         }
 
+        // 他のスレッドが同じノードを展開していたら、それが終わるまで待つ
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (parent->expanded()) {
+            return;
+        }
+
         const auto actions = parent->stage().legal_actions();
-        // Early returnしても展開済にする
-        parent->set_expanded();
 
-        std::vector<std::unique_ptr<Node>> children;
+        // 子ノードの局面はヒープから確保せずに置いておく
+        std::array<std::optional<Stage>, Node::MaxEdges> children;
+        size_t n_children {0};
         for(const auto& action : actions) {
             // 変更するのでコピーする
+            // 合法手から選んだので確認せずに打つ
             Stage next_stage = parent->stage();
-            const auto result = next_stage.advance(action.column, action.height);
-
-            if (result == Stage::Result::Invalid) {
-                continue;
-            }
+            const auto result = next_stage.advance_unchecked(action.column, action.height);
 
-            auto child = std::make_unique<Node>(next_stage);
             if (result == Stage::Result::Won) {
                 // 必勝手以外は子ノードとして登録しない
-                auto ptr = nodeset_.add(child);
-                parent->add_child(ptr);
-                ptr->add_parent(parent);
-                return;
+                children.at(0) = next_stage;
+                n_children = 1;
+                break;
             }
 
-            children.push_back(std::move(child));
+            children.at(n_children++) = next_stage;
+        }
+
+        std::array<Node*, Node::MaxEdges> nodes {};
+        for(size_t i{0}; i<n_children; ++i) {
+            nodes.at(i) = nodeset_.add(children.at(i).value());
+            if (!nodes.at(i)) {
+                return;
+            }
         }
 
-        for(auto&& child : children) {
-            auto ptr = nodeset_.add(child);
-            parent->add_child(ptr);
-            ptr->add_parent(parent);
+        for(size_t i{0}; i<n_children; ++i) {
+            link(parent, nodes.at(i));
         }
+
+        // 子ノードを全て登録してから、他のスレッドに展開済であることを見せる
+        parent->set_expanded();
     }
 
     // 指定した局面以降をランダムにプレイする
     Result play(const auto& stage, Node::Count depth) {
-        const auto actions = stage.legal_actions();
-        if (actions.empty()) {
-            return Result{Stage::Result::Draw, stage.player(), depth};
+        return play(stage, depth, rand_gen);
+    }
+
+    // 指定した局面以降を、指定した乱数生成器を使ってランダムにプレイする
+    Result play(const auto& stage, Node::Count depth, Random& gen) {
+        // 作業用の局面を一回だけコピーする
+        Stage scratch = stage;
+        return rollout(scratch, depth, gen);
+    }
+
+    // 指定した局面以降をランダムにプレイする
+    // 局面をコピーせずに一手ずつ進め、勝負がついたら打った手を全て戻す
+    Result rollout(Stage& stage, Node::Count depth, Random& gen) {
+        // 勝負がついた局面は打ち進めない
+        if (stage.won()) {
+            return Result{Stage::Result::Won, stage.player(), depth};
         }
 
-        for(const auto& action : actions) {
-            auto next_stage = stage;
-            const auto result = next_stage.advance(action.column, action.height);
-            if ((result == Stage::Result::Won) || (result == Stage::Result::Invalid)) {
-                return Result{result, stage.player(), depth};
+        std::array<typename Board::Position, Board::ColumnSize * Board::MaxHeight> moves;
+        size_t n_moves {0};
+        Result result {Stage::Result::Draw, stage.player(), depth};
+        const bool heavy = (config_.rollout == Rollout::Heavy);
+
+        for(;;) {
+            const auto cells = stage.playable();
+            if (!cells) {
+                result = Result{Stage::Result::Draw, stage.player(), depth};
+                break;
+            }
+
+            // 一手で勝てるなら必ず勝つ
+            if (stage.winning_moves()) {
+                result = Result{Stage::Result::Won, stage.player(), depth};
+                break;
+            }
+
+            // 置けるマスから一つ選ぶ
+            const auto candidates = heavy ?
+                heavy_moves(stage.cells(stage.player()), stage.cells(1 - stage.player()), cells) : cells;
+            auto remaining = candidates;
+            for(auto i = gen.below(std::popcount(candidates)); i > 0; --i) {
+                remaining &= remaining - 1;
             }
+
+            const auto action = Board::to_position(std::countr_zero(remaining));
+            stage.advance_unchecked(action.column, action.height);
+            moves[n_moves++] = action;
+            ++depth;
         }
 
-        std::uniform_int_distribution<size_t> dist(0, actions.size() - 1);
-        const auto action = actions.at(dist(rand_gen));
-        auto next_stage = stage;
-        next_stage.advance(action.column, action.height);
-        return play(next_stage, depth + 1);
+        while(n_moves > 0) {
+            const auto& action = moves[--n_moves];
+            stage.undo(action.column, action.height);
+        }
+
+        return result;
     }
 
-    // 木を探索して試行する
-    void playout(Node* root_node) {
-        auto [top_node, depth] = visit(root_node, 0);
-        const auto result = play(top_node->stage(), 0);
+    // 重いプレイで選ぶマスを返す。置けるマスが無ければ0を返す。
+    // 相手が次に勝つマスがあれば塞ぐ。二つ以上あればどれを塞いでも負ける。
+    // 無ければ、相手が勝つマスの真下に打って相手に勝たせる手を避ける。避けられなければ全て候補にする。
+    static Board::Cells heavy_moves(Board::Cells own, Board::Cells other, Board::Cells playable) {
+        const auto threats = Board::winning_cells(other) & ~(own | other);
+        const auto forced = playable & threats;
+        if (forced) {
+            return forced;
+        }
 
-        std::set<Node*> visited_nodes;
-        std::queue<Node*> nodes;
-        nodes.push(top_node);
+        const auto safe = playable & ~(threats >> 1);
+        return safe ? safe : playable;
+    }
 
-        while(!nodes.empty()) {
-            auto node = nodes.front();
-            nodes.pop();
+    // 先手と後手が勝った回数
+    struct WinCounts {
+        Node::Count n_first_player_won {0};
+        Node::Count n_second_player_won {0};
+    };
 
-            if (visited_nodes.contains(node)) {
-                continue;
+    // 葉の局面を評価する
+    // 同じ局面から複数回ランダムにプレイして、勝った回数を返す
+    WinCounts evaluate(const Stage& stage, Node::Count n_rollouts, Random& gen) {
+        WinCounts counts;
+        if (config_.evaluation == Evaluation::Batched) {
+            for(typename Node::Count i{0}; i < n_rollouts; i += BatchSize) {
+                rollout_batch(stage, std::min(BatchSize, n_rollouts - i), gen, counts);
             }
-            visited_nodes.insert(node);
+            return counts;
+        }
 
-            node->increment_n_tried();
+        // 葉の局面を一回だけコピーして、そこから繰り返しプレイする
+        Stage scratch = stage;
+        for(typename Node::Count i{0}; i < n_rollouts; ++i) {
+            const auto result = rollout(scratch, 0, gen);
             if (result.result == Stage::Result::Won) {
-                if (result.winner == 0) {
-                    node->increment_n_first_player_won();
-                } else {
-                    node->increment_n_second_player_won();
+                counts.n_first_player_won += (result.winner == 0) ? 1 : 0;
+                counts.n_second_player_won += (result.winner != 0) ? 1 : 0;
+            }
+        }
+        return counts;
+    }
+
+    // 同じ局面からn_rollouts回(BatchSize回以下)、一手ずつ揃えてランダムにプレイする
+    // 盤面をプレイごとの配列に並べる(SoA)と、勝ちを調べる処理をプレイ間でベクトル化できる
+    void rollout_batch(const Stage& stage, Node::Count n_rollouts, Random& gen,
+                       WinCounts& counts) {
+        n_rollouts = std::min(BatchSize, n_rollouts);
+
+        // 勝負がついた局面は打ち進めない
+        if (stage.won()) {
+            auto& n_won = (stage.player() == 0) ? counts.n_first_player_won : counts.n_second_player_won;
+            n_won += n_rollouts;
+            return;
+        }
+
+        // 手番のプレイヤーと相手の石を入れ替えながら打つ
+        std::array<typename Board::Cells, BatchSize> own;
+        std::array<typename Board::Cells, BatchSize> other;
+        std::array<typename Board::Cells, BatchSize> playable;
+        std::array<typename Board::Cells, BatchSize> winning;
+        std::array<typename Board::Cells, BatchSize> candidates;
+        std::array<Player, BatchSize> players;
+        std::array<bool, BatchSize> active;
+        own.fill(stage.cells(stage.player()));
+        other.fill(stage.cells(1 - stage.player()));
+        players.fill(stage.player());
+        active.fill(false);
+        std::fill_n(active.begin(), n_rollouts, true);
+
+        const bool heavy = (config_.rollout == Rollout::Heavy);
+        typename Node::Count n_active = n_rollouts;
+        while(n_active > 0) {
+            // 分岐しないので、全てのプレイをまとめて計算する
+            for(typename Node::Count i{0}; i < BatchSize; ++i) {
+                playable[i] = Board::playable(own[i] | other[i]);
+                winning[i] = Board::winning_cells(own[i]) & playable[i];
+            }
+
+            if (heavy) {
+                for(typename Node::Count i{0}; i < BatchSize; ++i) {
+                    candidates[i] = heavy_moves(own[i], other[i], playable[i]);
+                }
+            } else {
+                candidates = playable;
+            }
+
+            for(typename Node::Count i{0}; i < BatchSize; ++i) {
+                if (!active[i]) {
+                    continue;
+                }
+
+                // 置ける場所が無ければ引き分け、一手で勝てるなら必ず勝つ
+                if (!playable[i] || winning[i]) {
+                    if (winning[i]) {
+                        auto& n_won = (players[i] == 0) ?
+                            counts.n_first_player_won : counts.n_second_player_won;
+                        ++n_won;
+                    }
+                    active[i] = false;
+                    --n_active;
+                    continue;
+                }
+
+                // 置けるマスから一つ選ぶ
+                auto remaining = candidates[i];
+                for(auto n = gen.below(std::popcount(candidates[i])); n > 0; --n) {
+                    remaining &= remaining - 1;
                 }
+
+                own[i] |= remaining & (~remaining + 1);
+                std::swap(own[i], other[i]);
+                players[i] ^= 1;
             }
+        }
+    }
 
+    // 指定したノードとその先祖に回数を足す
+    void backpropagate(Node* top_node, Node::Count n_tried,
+                       Node::Count n_first_player_won, Node::Count n_second_player_won) {
+        // 親ノードの一覧は他のスレッドが展開すると変わる
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // 逆伝播ごとに世代を変えて、訪れたノードに印を付ける
+        // 作業領域は使い回すので、大きさが足りていればヒープから確保しない
+        const auto epoch = ++epoch_;
+        ancestors_.clear();
+        top_node->mark(epoch);
+        ancestors_.push_back(top_node);
+
+        while(!ancestors_.empty()) {
+            auto node = ancestors_.back();
+            ancestors_.pop_back();
+            node->add_counts(n_tried, n_first_player_won, n_second_player_won);
+
+            // 親ノードに並べた統計も更新する
             for(const auto& parent : node->parents()) {
-                nodes.push(parent);
+                const auto index = parent->child_index(node);
+                if (index < Node::MaxEdges) {
+                    parent->add_child_counts(index, n_first_player_won, n_second_player_won);
+                }
+                if (parent->mark(epoch)) {
+                    ancestors_.push_back(parent);
+                }
+            }
+        }
+    }
+
+    // 探索を始めたノードと、そこから探索でたどったノードだけに回数を足す
+    // 親ノードに並べた統計は、たどった辺だけ更新する
+    // 回数はアトミックで親ノードの一覧は読まないので、排他しない
+    void backpropagate(Node* root_node, const Path& path, Node::Count n_tried,
+                       Node::Count n_first_player_won, Node::Count n_second_player_won) {
+        root_node->add_counts(n_tried, n_first_player_won, n_second_player_won);
+        auto parent = root_node;
+        for(auto&& node : path) {
+            node->add_counts(n_tried, n_first_player_won, n_second_player_won);
+            const auto index = parent->child_index(node);
+            if (index < Node::MaxEdges) {
+                parent->add_child_counts(index, n_first_player_won, n_second_player_won);
+            }
+            parent = node;
+        }
+    }
+
+    // 木を探索して試行し、たどった深さを返す
+    // pathを指定したら、探索中のノードを記録する
+    // 経路だけに逆伝播するなら、pathを指定しなくても一スレッド用の経路に記録する
+    Depth playout(Node* root_node, Random& gen, Path* path) {
+        const bool path_only = (config_.backpropagation == Backpropagation::Path);
+        if (!path && path_only) {
+            path = &path_;
+        }
+
+        if (path) {
+            path->clear();
+        }
+
+        auto [top_node, depth] = visit(root_node, 0, path);
+
+        const auto counts = evaluate(top_node->stage(), config_.n_rollouts, gen);
+        if (path_only) {
+            backpropagate(root_node, *path, config_.n_rollouts, counts.n_first_player_won,
+                          counts.n_second_player_won);
+        } else {
+            backpropagate(top_node, config_.n_rollouts, counts.n_first_player_won,
+                          counts.n_second_player_won);
+        }
+
+        if (path && uses_virtual_loss()) {
+            auto parent = root_node;
+            for(auto&& node : *path) {
+                parent->remove_virtual_loss(parent->child_index(node));
+                parent = node;
             }
         }
+
+        return depth;
+    }
+
+    // 木を探索して試行する
+    void playout(Node* root_node) {
+        playout(root_node, rand_gen, nullptr);
     }
 
     // 初期盤面からプレイする
@@ -816,55 +2035,481 @@ public:
         playout(root_);
     }
 
+    // 局面をノードとして登録する。既にあるならあったものを返す。
+    // 置換表が一杯で登録できなければnullptrを返す
+    Node* add(const Stage& stage) {
+        return nodeset_.add(stage);
+    }
+
     // 指定した局面からプレイする
     // 指定した局面は既に登録されていることが前提である
     void playout(const Stage& stage) {
-        auto node_obj = std::make_unique<Node>(stage);
-        auto node = nodeset_.add(node_obj);
-        playout(node);
+        if (auto node = add(stage)) {
+            playout(node);
+        }
+    }
+
+    // 指定した局面から指定した回数プレイする
+    // 設定したスレッド数が2以上なら、設定した方法で並列に探索する
+    void playout(const Stage& stage, Node::Count n_playouts) {
+        const Budget budget {n_playouts, ZeroMilliSec};
+        reserve(budget);
+        const auto n_nodes_before = nodeset_.size();
+        if (auto node = add(stage)) {
+            playout(node, budget, Clock::now());
+        }
+        record_search_nodes(n_nodes_before);
+    }
+
+    // 指定した回数探索すると増えるノードの数の見積もり
+    // 一回展開すると子ノードは高々列数だけ増える。葉から複数回プレイするとその分だけ早く展開する。
+    NodeSet::Size expected_nodes(Node::Count n_playouts) const {
+        return static_cast<NodeSet::Size>(
+            (n_playouts * config_.n_rollouts / ToExpand + 2) * Board::ColumnSize + 2);
+    }
+
+    // 探索する前に、探索で増えるノードが入るように置換表を大きくする
+    // 回数で制限するなら増えるノードの数を見積もり、時間だけで制限するなら
+    // これまでの探索で増えたノードの数の最大値の2倍とする。まだ探索していなければ設定した大きさにする。
+    // スロットはノードの2倍用意して、検索する距離を短く保つ
+    void reserve(const Budget& budget) {
+        if (budget.n_playouts) {
+            n_reserved_nodes_ = expected_nodes(budget.n_playouts);
+        } else if (n_search_nodes_) {
+            n_reserved_nodes_ = n_search_nodes_ * 2;
+        } else {
+            n_reserved_nodes_ = max_capacity_;
+        }
+
+        const auto capacity = std::min(max_capacity_, (nodeset_.size() + n_reserved_nodes_) * 2);
+        if (nodeset_.capacity() < capacity) {
+            rebuild(capacity);
+        }
+    }
+
+    // 全てのノードを指定した大きさの置換表に写す
+    // 探索中に呼んではならない
+    void rebuild(NodeSet::Size capacity) {
+        NodeSet nodeset(capacity, config_.symmetric);
+        nodeset_.for_each([&nodeset](const Node* old_node) {
+            if (auto node = nodeset.add(old_node->stage())) {
+                node->add_counts(old_node->n_tried(), old_node->n_first_player_won(),
+                                 old_node->n_second_player_won());
+            }
+        });
+
+        nodeset_.for_each([this, &nodeset](const Node* old_node) {
+            auto node = nodeset.find(old_node->stage());
+            if (!node) {
+                return;
+            }
+
+            const auto old_children = old_node->children();
+            for(size_t i{0}; i<old_children.size(); ++i) {
+                if (auto child = nodeset.find(old_children[i]->stage())) {
+                    link(node, child, old_node, i);
+                }
+            }
+            if (old_node->expanded()) {
+                node->set_expanded();
+            }
+        });
+
+        const auto root_stage = root_->stage();
+        nodeset_.swap(nodeset);
+        root_ = nodeset_.find(root_stage);
+    }
+
+    // 探索で増えたノードの数を、次に置換表を用意するときのために覚えておく
+    void record_search_nodes(NodeSet::Size n_nodes_before) {
+        const auto n_nodes = nodeset_.size();
+        if (n_nodes > n_nodes_before) {
+            n_search_nodes_ = std::max(n_search_nodes_, n_nodes - n_nodes_before);
+        }
+    }
+
+    // 指定した局面から予算を使い切るまで探索して、最善手と統計を返す
+    SearchResult search(const Stage& stage, const Budget& budget) {
+        const auto start_time = Clock::now();
+        SearchResult result;
+        reserve(budget);
+        const auto n_nodes_before = nodeset_.size();
+        if (auto node = add(stage)) {
+            const auto statistics = playout(node, budget, start_time + budget.time);
+            result.n_playouts = statistics.n_playouts;
+            result.n_visited = statistics.n_visited;
+            result.max_depth = statistics.max_depth;
+            result.n_failed = statistics.n_failed;
+        }
+        record_search_nodes(n_nodes_before);
+
+        result.action = select(stage);
+        if (result.action.has_value()) {
+            auto next_stage = stage;
+            next_stage.advance(result.action.value().column, result.action.value().height);
+            if (const auto node = nodeset_.find(next_stage)) {
+                const auto n_tried = node->n_first_player_won() + node->n_second_player_won();
+                const auto n_win = (stage.player() == 0) ?
+                    node->n_first_player_won() : node->n_second_player_won();
+                result.value = (n_tried > 0) ? (static_cast<Metric>(n_win) / n_tried) : 0;
+            }
+        }
+        result.n_nodes = nodeset_.size();
+        result.n_failed += nodeset_.n_failed();
+        result.elapsed = Clock::now() - start_time;
+        return result;
+    }
+
+    // 予算を使い切るまで探索する
+    // 設定したスレッド数が2以上なら、設定した方法で並列に探索する
+    Statistics playout(Node* node, const Budget& budget, Clock::time_point deadline) {
+        if (!budget.n_playouts && (budget.time == ZeroMilliSec)) {
+            return Statistics{};
+        }
+
+        if (config_.n_threads <= 1) {
+            std::atomic<typename Node::Count> n_started {0};
+            std::atomic<bool> expired {false};
+            return playout_until(node, budget, deadline, n_started, expired, rand_gen, nullptr);
+        }
+
+        if (config_.parallel == Parallel::Root) {
+            return playout_root_parallel(node, budget, deadline);
+        }
+        return playout_tree_parallel(node, budget, deadline);
+    }
+
+    // 一つのスレッドで、予算を使い切るか他のスレッドが時間切れにするまで探索する
+    // 時刻を読むのは重いので、高々CheckInterval回ごとに読む
+    // 残り時間が短いときは、締め切りを大きく過ぎないように読む間隔を詰める
+    Statistics playout_until(Node* node, const Budget& budget, Clock::time_point deadline,
+                             std::atomic<typename Node::Count>& n_started, std::atomic<bool>& expired,
+                             Random& gen, Path* path) {
+        const bool timed = (budget.time != ZeroMilliSec);
+        const auto start_time = Clock::now();
+        typename Node::Count next_check {0};
+        Statistics statistics;
+        for(typename Node::Count i{0};; ++i) {
+            if (budget.n_playouts &&
+                (n_started.fetch_add(1, std::memory_order_relaxed) >= budget.n_playouts)) {
+                break;
+            }
+
+            if (timed && (i >= next_check)) {
+                const auto now = Clock::now();
+                if (expired.load(std::memory_order_relaxed) || (now >= deadline)) {
+                    expired.store(true, std::memory_order_relaxed);
+                    break;
+                }
+
+                // 残り時間に探索できる回数の1/8だけ、時刻を読まずに探索する
+                const std::chrono::duration<double> elapsed = now - start_time;
+                const std::chrono::duration<double> remaining = deadline - now;
+                const auto n_estimated = (elapsed.count() > 0) ?
+                    (i * remaining.count() / elapsed.count() / 8) : 0.0;
+                next_check = i + std::clamp(static_cast<Node::Count>(n_estimated),
+                                            typename Node::Count{1}, CheckInterval);
+            }
+
+            statistics.add(playout(node, gen, path));
+        }
+
+        return statistics;
+    }
+
+    // 全スレッドで一つの探索木を共有して探索する
+    Statistics playout_tree_parallel(Node* node, const Budget& budget, Clock::time_point deadline) {
+        // 乱数生成器はスレッドごとに持つ
+        // 乱数生成器をスレッド間で共有しないように、シードはこの探索の乱数から先に決める
+        std::vector<Random::Seed> seeds(config_.n_threads);
+        for(auto&& seed : seeds) {
+            seed = rand_gen();
+        }
+
+        std::atomic<typename Node::Count> n_started {0};
+        std::atomic<bool> expired {false};
+        std::vector<Statistics> statistics(config_.n_threads);
+        std::vector<std::thread> threads;
+        for(size_t i{0}; i<seeds.size(); ++i) {
+            threads.emplace_back([this, node, &budget, deadline, seed=seeds.at(i),
+                                  &n_started, &expired, &result=statistics.at(i)]() {
+                Random gen(seed);
+                Path path;
+                result = playout_until(node, budget, deadline, n_started, expired, gen, &path);
+            });
+        }
+
+        for(auto&& thread : threads) {
+            thread.join();
+        }
+
+        Statistics total;
+        for(const auto& s : statistics) {
+            total.merge(s);
+        }
+        return total;
+    }
+
+    // スレッドごとに探索木を作って探索し、最後に統計を合算する
+    Statistics playout_root_parallel(Node* node, const Budget& budget, Clock::time_point deadline) {
+        // 置換表は探索で増えるノードの数に見合う大きさにする
+        // 時間だけで制限するなら回数は分からないので、設定した大きさにする
+        const typename Node::Count n_playouts = budget.n_playouts;
+        auto capacity = config_.capacity;
+        if (n_playouts && (budget.time == ZeroMilliSec)) {
+            const typename Node::Count n_per_thread = n_playouts / config_.n_threads + 1;
+            capacity = std::min(capacity, expected_nodes(n_per_thread) * 2);
+        }
+
+        // スレッドごとに異なる乱数の系列を、この探索の乱数から決める
+        Config worker_config {1, Parallel::Root, capacity, config_.n_rollouts,
+                              config_.evaluation, config_.backpropagation, config_.symmetric,
+                              std::nullopt, config_.rollout};
+        std::vector<std::unique_ptr<MctsEngine>> workers;
+        for(decltype(config_.n_threads) i{0}; i<config_.n_threads; ++i) {
+            worker_config.seed = rand_gen();
+            workers.push_back(std::make_unique<MctsEngine>(worker_config, hashkeys_));
+        }
+
+        const Stage& stage = node->stage();
+        std::vector<Statistics> statistics(config_.n_threads);
+        std::vector<std::thread> threads;
+        const typename Node::Count n_threads = config_.n_threads;
+        for(typename Node::Count i{0}; i<n_threads; ++i) {
+            // 端数は先頭のスレッドから一回ずつ割り当てる
+            Budget worker_budget = budget;
+            if (n_playouts) {
+                worker_budget.n_playouts = n_playouts / n_threads + ((i < (n_playouts % n_threads)) ? 1 : 0);
+                if (!worker_budget.n_playouts) {
+                    continue;
+                }
+            }
+
+            auto worker = workers.at(i).get();
+            threads.emplace_back([worker, &stage, worker_budget, deadline, &result=statistics.at(i)]() {
+                if (auto worker_node = worker->add(stage)) {
+                    result = worker->playout(worker_node, worker_budget, deadline);
+                }
+            });
+        }
+
+        for(auto&& thread : threads) {
+            thread.join();
+        }
+
+        Statistics total;
+        for(size_t i{0}; i<workers.size(); ++i) {
+            merge(*workers.at(i), stage);
+            statistics.at(i).n_failed = workers.at(i)->nodeset_.n_failed();
+            total.merge(statistics.at(i));
+        }
+        return total;
+    }
+
+    // 他の探索エンジンが指定した局面から探索した統計を合算する
+    // ハッシュキーを共有していることが前提である
+    void merge(const MctsEngine& other, const Stage& stage) {
+        const auto other_top = other.nodeset_.find(stage);
+        if (!other_top) {
+            return;
+        }
+
+        other.nodeset_.for_each([this](const Node* other_node) {
+            add(other_node->stage());
+        });
+
+        // 展開の結果は局面だけで決まるので、展開済のノードは同じ子ノードを持つ
+        // ここで未展開のノードだけ、相手の子ノードをつなぐ
+        // 回数を足す前につなぐので、親ノードに並べた統計はこちらの子ノードの統計から始まる
+        other.nodeset_.for_each([this](const Node* other_node) {
+            auto node = nodeset_.find(other_node->stage());
+            if (!node || !other_node->expanded() || node->expanded()) {
+                return;
+            }
+
+            for(const auto& other_child : other_node->children()) {
+                if (auto child = nodeset_.find(other_child->stage())) {
+                    link(node, child);
+                }
+            }
+            node->set_expanded();
+        });
+
+        // 回数と親ノードに並べた統計を足す。指定した局面とその先祖は後でまとめて足す。
+        // 経路だけに逆伝播すると辺の統計は子ノードの統計と一致しないので、子ノードの統計に揃えない
+        other.nodeset_.for_each([this, other_top](const Node* other_node) {
+            auto node = nodeset_.find(other_node->stage());
+            if (!node) {
+                return;
+            }
+
+            if (other_node != other_top) {
+                node->add_counts(other_node->n_tried(), other_node->n_first_player_won(),
+                                 other_node->n_second_player_won());
+            }
+
+            const auto other_children = other_node->children();
+            for(size_t i{0}; i<other_children.size(); ++i) {
+                const auto child = (other_children[i] != other_top) ?
+                    nodeset_.find(other_children[i]->stage()) : nullptr;
+                const auto index = child ? node->child_index(child) : Node::MaxEdges;
+                if (index < Node::MaxEdges) {
+                    node->add_child_counts(index, other_node->child_first_player_won(i),
+                                           other_node->child_second_player_won(i));
+                }
+            }
+        });
+
+        if (auto top = nodeset_.find(stage)) {
+            backpropagate(top, other_top->n_tried(),
+                          other_top->n_first_player_won(), other_top->n_second_player_won());
+        }
+    }
+
+    // 手を確定する前後のノードの数とメモリ量
+    struct MemoryUsage {
+        NodeSet::Size n_nodes_before {0};  // 確定する前のノードの数
+        NodeSet::Size n_nodes_after {0};   // 確定した後のノードの数
+        NodeSet::Size n_bytes_before {0};  // 確定する前のスロットとノードのバイト数
+        NodeSet::Size n_bytes_after {0};   // 確定した後のスロットとノードのバイト数
+    };
+
+    // 対戦中に根の局面から一手打って確定し、打った後の局面を新しい根にする
+    // 無効な手なら何もしない
+    MemoryUsage commit(const Board::Position& action) {
+        auto stage = root_->stage();
+        if (stage.advance(action.column, action.height) == Stage::Result::Invalid) {
+            const auto size = nodeset_.size();
+            const auto n_bytes = nodeset_.n_bytes();
+            return MemoryUsage{size, size, n_bytes, n_bytes};
+        }
+
+        return commit(stage);
+    }
+
+    // 指定した局面を新しい根にする
+    // 新しい根から子をたどれるノードの統計は残し、それ以外のノードは解放する
+    // 置換表は設定した大きさを上限に、たどれるノードと前回の探索で空けた分が入る大きさにするので、
+    // 一手ごとに大きな置換表を確保して初期化しない。足りなければ次の探索の前にreserve()が大きくする。
+    // 探索中に呼んではならない
+    MemoryUsage commit(const Stage& stage) {
+        MemoryUsage usage {nodeset_.size(), 0, nodeset_.n_bytes(), 0};
+
+        const auto n_reachable = count_reachable(stage);
+        const auto capacity = std::min(max_capacity_,
+                                       std::max(MinCapacity, (n_reachable + n_reserved_nodes_) * 2));
+
+        // たどれるノードを新しい集合に写す。親は新しい集合にある親だけつなぐ。
+        NodeSet nodeset(capacity, config_.symmetric);
+        auto top = nodeset.add(stage);
+        std::queue<const Node*> nodes;
+        if (const auto old_top = nodeset_.find(stage)) {
+            top->add_counts(old_top->n_tried(), old_top->n_first_player_won(),
+                            old_top->n_second_player_won());
+            nodes.push(old_top);
+        }
+
+        while(!nodes.empty()) {
+            const auto old_node = nodes.front();
+            nodes.pop();
+            auto node = nodeset.find(old_node->stage());
+
+            const auto old_children = old_node->children();
+            for(size_t i{0}; i<old_children.size(); ++i) {
+                const auto old_child = old_children[i];
+                auto child = nodeset.find(old_child->stage());
+                if (!child) {
+                    // 集合はたどれるノードの2倍以上の大きさなので、たどれるノードは全て入る
+                    child = nodeset.add(old_child->stage());
+                    if (!child) {
+                        continue;
+                    }
+                    child->add_counts(old_child->n_tried(), old_child->n_first_player_won(),
+                                      old_child->n_second_player_won());
+                    nodes.push(old_child);
+                }
+                link(node, child, old_node, i);
+            }
+
+            if (old_node->expanded()) {
+                node->set_expanded();
+            }
+        }
+
+        // 古いノードはここで解放する
+        nodeset_.swap(nodeset);
+        root_ = top;
+
+        usage.n_nodes_after = nodeset_.size();
+        usage.n_bytes_after = nodeset_.n_bytes();
+        return usage;
+    }
+
+    // 指定した局面から子をたどれるノードの数を返す
+    // 合流したノードは逆伝播と同じく世代の印で一回だけ数える
+    NodeSet::Size count_reachable(const Stage& stage) {
+        auto top = nodeset_.find(stage);
+        if (!top) {
+            return 0;
+        }
+
+        const auto epoch = ++epoch_;
+        top->mark(epoch);
+        std::queue<Node*> nodes;
+        nodes.push(top);
+        typename NodeSet::Size n_nodes {0};
+        while(!nodes.empty()) {
+            const auto node = nodes.front();
+            nodes.pop();
+            ++n_nodes;
+            for(const auto& child : node->children()) {
+                if (child->mark(epoch)) {
+                    nodes.push(child);
+                }
+            }
+        }
+
+        return n_nodes;
     }
 
     // 対戦中に一手進める
     // ここまでの手番は既に登録されていることが前提である
     void advance(const Stage& stage, const Board::Position& action) {
-        auto parent_obj = std::make_unique<Node>(stage);
-        auto parent = nodeset_.add(parent_obj);
+        auto parent = add(stage);
         auto next_stage = stage;
         const auto result = next_stage.advance(action.column, action.height);
 
-        if (result == Stage::Result::Invalid) {
+        if (!parent || (result == Stage::Result::Invalid)) {
             return;
         }
 
-        auto child_obj = std::make_unique<Node>(next_stage);
-        auto child = nodeset_.add(child_obj);
-        parent->add_child(child);
-        child->add_parent(parent);
+        if (auto child = add(next_stage)) {
+            link(parent, child);
+        }
         return;
     }
 
     // ランダムな手を選ぶ
-    std::optional<Board::Position> select_random(const Stage& stage) {
+    std::optional<typename Board::Position> select_random(const Stage& stage) {
         const auto actions = stage.legal_actions();
         if (actions.empty()) {
-            std::optional<Board::Position> zero;
+            std::optional<typename Board::Position> zero;
             return zero;
         }
 
-        std::uniform_int_distribution<size_t> dist(0, actions.size() - 1);
-        return actions.at(dist(rand_gen));
+        return actions.at(rand_gen.below(static_cast<uint32_t>(actions.size())));
     }
 
     // 学習した手を選ぶ
-    std::optional<Board::Position> select(const Stage& stage) {
+    std::optional<typename Board::Position> select(const Stage& stage) {
         const auto actions = stage.legal_actions();
         if (actions.empty()) {
-            std::optional<Board::Position> zero;
+            std::optional<typename Board::Position> zero;
             return zero;
         }
 
         const auto player = stage.player();
-        std::optional<Board::Position> best_action;
+        std::optional<typename Board::Position> best_action;
         Metric max_value = std::numeric_limits<Metric>::min();
 
         for(const auto& action : actions) {
@@ -875,26 +2520,1211 @@ public:
                 continue;
             }
 
-            const auto n_tried = node->n_first_player_won() + node->n_second_player_won();
-            const auto n_win = (player == 0) ?
-                node->n_first_player_won() : node->n_second_player_won();
+            const auto n_tried = node->n_first_player_won() + node->n_second_player_won();
+            const auto n_win = (player == 0) ?
+                node->n_first_player_won() : node->n_second_player_won();
+
+            Metric ratio = n_win;
+            ratio /= n_tried;
+            if (max_value < ratio) {
+                best_action = typename Board::Position {action.column, action.height};
+            }
+            max_value = std::max(max_value, ratio);
+        }
+
+        if (best_action.has_value()) {
+            return best_action;
+        }
+
+        return select_random(stage);
+    }
+
+    // 読み筋の一手
+    struct PvMove {
+        typename Board::Position action;  // 打つ手
+        Node::Count n_tried {0};  // 打った後のノードを探索した回数
+        Metric value {0};         // 打ったプレイヤーが勝った割合
+    };
+
+    // 探索木の統計
+    struct Report {
+        std::vector<PvMove> principal_variation;  // 読み筋
+        Metric branching_factor {0};  // 展開したノード一つあたりの子ノードの数
+        std::vector<typename NodeSet::Size> depth_histogram;  // 指定した局面から何手先のノードがいくつあるか
+        NodeSet::Size n_nodes {0};     // ノードの数
+        NodeSet::Size n_expanded {0};  // 展開したノードの数
+        NodeSet::Size n_lookups {0};   // 置換表に追加しようとした回数
+        double hit_rate {0};           // 置換表に既に局面があった割合
+        NodeSet::Size n_failed {0};    // 置換表が一杯で追加できなかった回数
+        NodeSet::Size n_bytes {0};     // スロットとノードに使った大きさ(バイト)
+    };
+
+    // 探索木を書き出すときの一ノード分
+    struct SubtreeRecord {
+        typename Board::HashKey digest {0};  // 局面のダイジェスト
+        Node::Count n_tried {0};             // 探索した回数
+        Node::Count n_first_player_won {0};  // 先手が勝った回数
+        Node::Count n_second_player_won {0}; // 後手が勝った回数
+        uint32_t parent {0};  // 親の添え字(根は自身を指す)
+        uint8_t column {0};   // 親から打った手の列
+        uint8_t height {0};   // 親から打った手の高さ
+        uint16_t depth {0};   // 根から何手先か
+    };
+    static_assert(sizeof(SubtreeRecord) == 40);
+    static_assert(std::is_trivially_copyable_v<SubtreeRecord>);
+
+    // 探索中に他のスレッドから呼んでもよい
+    // 回数はアトミックに読み、子ノードは展開済のノードだけたどるので、探索を止めない
+    // 統計どうしの整合性は取らない。探索中に根を移すcommit()とは同時に呼んではならない。
+    Report report(const Stage& stage, size_t max_pv_length = Board::ColumnSize * Board::MaxHeight) const {
+        Report report;
+        const auto n_stones = stone_count(stage);
+        nodeset_.for_each([&report, n_stones](const Node* node) {
+            ++report.n_nodes;
+            const auto depth = stone_count(node->stage()) - n_stones;
+            if (depth >= 0) {
+                if (static_cast<size_t>(depth) >= report.depth_histogram.size()) {
+                    report.depth_histogram.resize(depth + 1, 0);
+                }
+                ++report.depth_histogram.at(depth);
+            }
+
+            if (node->expanded()) {
+                ++report.n_expanded;
+                report.branching_factor += node->children().size();
+            }
+        });
+
+        if (report.n_expanded) {
+            report.branching_factor /= report.n_expanded;
+        }
+        report.n_lookups = nodeset_.n_lookups();
+        report.hit_rate = nodeset_.hit_rate();
+        report.n_failed = nodeset_.n_failed();
+        report.n_bytes = nodeset_.n_bytes();
+
+        // 最も多く探索した子ノードをたどる
+        // 左右を反転して合流したノードがあるので、手は指定した局面の向きで求める
+        auto current = stage;
+        const Node* node = nodeset_.find(current);
+        while(node && node->expanded() && (report.principal_variation.size() < max_pv_length)) {
+            const Node* best {nullptr};
+            for(const auto& child : node->children()) {
+                if (!best || (child->n_tried() > best->n_tried())) {
+                    best = child;
+                }
+            }
+            if (!best || (best->n_tried() == 0)) {
+                break;
+            }
+
+            const auto action = child_action(current, best);
+            if (!action.has_value()) {
+                break;
+            }
+
+            report.principal_variation.push_back(
+                PvMove{action.value(), best->n_tried(), win_ratio(best, current.player())});
+            if (current.advance(action->column, action->height) != Stage::Result::Placed) {
+                break;
+            }
+            node = best;
+        }
+
+        return report;
+    }
+
+    // 指定した局面から、探索した回数が多い子ノードを高々top_k個ずつたどった部分木を返す
+    // 親は子より先に並ぶ。report()と同様に探索中に呼んでもよい。
+    std::vector<SubtreeRecord> subtree(const Stage& stage, size_t top_k, size_t max_depth) const {
+        std::vector<SubtreeRecord> records;
+        std::vector<const Node*> nodes;
+        std::vector<Stage> stages;  // 指定した局面の向きにそろえた局面
+        const auto top = nodeset_.find(stage);
+        if (!top) {
+            return records;
+        }
+
+        records.push_back(SubtreeRecord{top->digest(), top->n_tried(),
+                                        top->n_first_player_won(), top->n_second_player_won()});
+        nodes.push_back(top);
+        stages.push_back(stage);
+        for(size_t index{0}; index < nodes.size(); ++index) {
+            const auto node = nodes.at(index);
+            const auto depth = records.at(index).depth;
+            if (!node->expanded() || (depth >= max_depth)) {
+                continue;
+            }
+
+            std::vector<const Node*> children(node->children().begin(), node->children().end());
+            const auto n_children = std::min(top_k, children.size());
+            std::partial_sort(children.begin(), children.begin() + n_children, children.end(),
+                              [](const Node* lhs, const Node* rhs) { return lhs->n_tried() > rhs->n_tried(); });
+
+            for(size_t i{0}; i < n_children; ++i) {
+                const auto child = children.at(i);
+                const auto action = child_action(stages.at(index), child);
+                if (!action.has_value()) {
+                    continue;
+                }
+
+                auto next_stage = stages.at(index);
+                next_stage.advance(action->column, action->height);
+                stages.push_back(next_stage);
+                records.push_back(SubtreeRecord{
+                        child->digest(), child->n_tried(), child->n_first_player_won(),
+                        child->n_second_player_won(), static_cast<uint32_t>(index),
+                        static_cast<uint8_t>(action->column), static_cast<uint8_t>(action->height),
+                        static_cast<uint16_t>(depth + 1)});
+                nodes.push_back(child);
+            }
+        }
+
+        return records;
+    }
+
+    // 部分木をGraphvizのDOT形式で書き出す
+    // ラベルは打った手(列,高さ)、探索した回数、先手が勝った割合である
+    static void write_dot(std::ostream& os, const std::vector<SubtreeRecord>& records) {
+        os << "digraph mcts {\n";
+        for(size_t i{0}; i < records.size(); ++i) {
+            const auto& record = records.at(i);
+            const auto n_played = record.n_first_player_won + record.n_second_player_won;
+            const auto value = (n_played > 0) ?
+                (static_cast<Metric>(record.n_first_player_won) / n_played) : 0.0;
+            os << "  n" << i << " [label=\"";
+            if (i == 0) {
+                os << "root";
+            } else {
+                os << static_cast<int>(record.column) << "," << static_cast<int>(record.height);
+            }
+            os << "\\n" << record.n_tried << "\\n" << value << "\"];\n";
+            if (i > 0) {
+                os << "  n" << record.parent << " -> n" << i << ";\n";
+            }
+        }
+        os << "}\n";
+    }
+
+    // 探索木をファイルに保存する。探索中に呼んではならない。
+    // ノードごとに石の配置と回数と子ノードの添え字を固定長のレコードに書き、
+    // レコードはブロックごとに書き出すので、探索木全体を複製しない。
+    // 局面はハッシュキーに依存しないので、別のシードで作った探索エンジンでも読み込める。
+    bool save(const std::string& path) const {
+        // ノードの添え字を先に決める。for_each()は毎回同じ順にたどる。
+        std::unordered_map<const Node*, uint32_t> indexes;
+        indexes.reserve(nodeset_.size());
+        nodeset_.for_each([&indexes](const Node* node) {
+            const auto index = static_cast<uint32_t>(indexes.size());
+            indexes.emplace(node, index);
+        });
+
+        const auto root = indexes.find(root_);
+        if (root == indexes.end()) {
+            return false;
+        }
+
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        if (!ofs) {
+            return false;
+        }
+
+        const SnapshotHeader header {SnapshotMagic, Board::ColumnSize, Board::MaxHeight, Board::MinLen,
+                                     sizeof(SnapshotRecord), indexes.size(), root->second};
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::vector<SnapshotRecord> block;
+        block.reserve(SnapshotBlockSize);
+        const auto flush = [&ofs, &block]() {
+            ofs.write(reinterpret_cast<const char*>(block.data()),
+                      static_cast<std::streamsize>(block.size() * sizeof(SnapshotRecord)));
+            block.clear();
+        };
+
+        nodeset_.for_each([&indexes, &block, &flush](const Node* node) {
+            const auto& stage = node->stage();
+            SnapshotRecord record {{stage.cells(0), stage.cells(1)}, node->n_tried(),
+                                   node->n_first_player_won(), node->n_second_player_won()};
+            for(const auto& child : node->children()) {
+                record.children.at(record.n_children++) = indexes.at(child);
+            }
+            record.player = static_cast<uint8_t>(stage.player());
+            record.expanded = node->expanded() ? 1 : 0;
+
+            block.push_back(record);
+            if (block.size() >= SnapshotBlockSize) {
+                flush();
+            }
+        });
+        flush();
+
+        ofs.close();
+        return !ofs.fail();
+    }
+
+    // 保存した探索木を読み込んで、保存したときの根から探索を続けられるようにする
+    // 読めなければ何もせずにfalseを返す。探索中に呼んではならない。
+    // ファイルはメモリにマップして先頭から順に読む
+    bool load(const std::string& path) {
+        const auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st {};
+        void* address {nullptr};
+        size_t length {0};
+        if ((::fstat(fd, &st) == 0) && (static_cast<size_t>(st.st_size) >= sizeof(SnapshotHeader))) {
+            length = static_cast<size_t>(st.st_size);
+            address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                address = nullptr;
+            }
+        }
+        // マップした領域はファイルを閉じても使える
+        ::close(fd);
+
+        if (!address) {
+            return false;
+        }
+
+        ::madvise(address, length, MADV_SEQUENTIAL);
+        const auto loaded = load(static_cast<const char*>(address), length);
+        ::munmap(address, length);
+        return loaded;
+    }
+
+    // 部分木を固定長のレコードを並べたバイナリファイルに書き出す
+    // ファイルはこのプログラムと同じエンディアンの計算機で読むことが前提である
+    static bool write_subtree(const std::string& path, const std::vector<SubtreeRecord>& records) {
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        if (!ofs) {
+            return false;
+        }
+
+        const uint64_t n_records = records.size();
+        ofs.write(SubtreeMagic.data(), SubtreeMagic.size());
+        ofs.write(reinterpret_cast<const char*>(&n_records), sizeof(n_records));
+        ofs.write(reinterpret_cast<const char*>(records.data()),
+                  static_cast<std::streamsize>(records.size() * sizeof(SubtreeRecord)));
+        return static_cast<bool>(ofs);
+    }
+
+private:
+    static constexpr std::array<char, 8> SubtreeMagic {'C', '4', 'T', 'R', 'E', 'E', '0', '1'};
+    static constexpr std::array<char, 8> SnapshotMagic {'C', '4', 'S', 'N', 'A', 'P', '0', '1'};
+    static constexpr size_t SnapshotBlockSize {4096};  // 一回に書き出すレコードの数
+
+    // 保存した探索木の先頭に置く
+    struct SnapshotHeader {
+        std::array<char, 8> magic {};  // ファイルの種類と版
+        int32_t width {0};       // 盤面の列数
+        int32_t height {0};      // 盤面の最大の高さ
+        int32_t length {0};      // 何個並んだら勝ちか
+        uint32_t record_size {0};  // レコードの大きさ
+        uint64_t n_records {0};  // ノードの数
+        uint64_t root {0};       // 根の添え字
+    };
+    static_assert(sizeof(SnapshotHeader) == 40);
+
+    // 保存した探索木の一ノード分
+    struct SnapshotRecord {
+        std::array<typename Board::Cells, Stage::SizeOfPlayers> cells {};  // プレイヤーごとの石
+        Node::Count n_tried {0};             // 探索した回数
+        Node::Count n_first_player_won {0};  // 先手が勝った回数
+        Node::Count n_second_player_won {0}; // 後手が勝った回数
+        std::array<uint32_t, Node::MaxEdges> children {};  // 子ノードの添え字
+        uint8_t n_children {0};  // 子ノードの数
+        uint8_t player {0};      // 手番
+        uint8_t expanded {0};    // 子ノードを展開済なら1
+    };
+    static_assert(std::is_trivially_copyable_v<SnapshotRecord>);
+
+    // メモリに読み込んだ探索木を、新しいノードの集合に写す
+    bool load(const char* address, size_t length) {
+        SnapshotHeader header;
+        std::memcpy(&header, address, sizeof(header));
+        const auto n_records = header.n_records;
+        if ((header.magic != SnapshotMagic) || (header.width != Board::ColumnSize) ||
+            (header.height != Board::MaxHeight) || (header.length != Board::MinLen) ||
+            (header.record_size != sizeof(SnapshotRecord)) ||
+            (n_records > (length - sizeof(header)) / sizeof(SnapshotRecord)) ||
+            (length != sizeof(header) + n_records * sizeof(SnapshotRecord)) ||
+            (header.root >= n_records)) {
+            return false;
+        }
+
+        // reserve()と同じく、保存したノードの2倍の大きさにして半分以上空けておく
+        // 置換表が一杯に近いと、探索で足すノードが探す回数の上限までに空きを見つけられない
+        const auto capacity = std::max<typename NodeSet::Size>(MinCapacity, n_records * 2);
+        NodeSet nodeset(capacity, config_.symmetric);
+        std::vector<Node*> nodes(n_records, nullptr);
+        const auto* records = address + sizeof(header);
+        SnapshotRecord record;
+        for(size_t i{0}; i < n_records; ++i) {
+            std::memcpy(&record, records + i * sizeof(record), sizeof(record));
+            const Stage stage(*hashkeys_, record.cells.at(0), record.cells.at(1), record.player);
+            const auto n_nodes = nodeset.size();
+            nodes.at(i) = nodeset.add(stage);
+            if (!nodes.at(i) || (record.n_children > Node::MaxEdges)) {
+                return false;
+            }
+
+            // 左右を反転した局面を別に保存していたら、回数は一回だけ足す
+            if (nodeset.size() > n_nodes) {
+                nodes.at(i)->add_counts(record.n_tried, record.n_first_player_won, record.n_second_player_won);
+            }
+        }
+
+        // 子ノードの回数を足してからつなぐと、親ノードに並べた統計も揃う
+        for(size_t i{0}; i < n_records; ++i) {
+            std::memcpy(&record, records + i * sizeof(record), sizeof(record));
+            for(size_t edge{0}; edge < record.n_children; ++edge) {
+                const auto child = record.children.at(edge);
+                if (child >= n_records) {
+                    return false;
+                }
+                link(nodes.at(i), nodes.at(child));
+            }
+            if (record.expanded) {
+                nodes.at(i)->set_expanded();
+            }
+        }
+
+        // 手を確定するときも全てのノードが入るように、設定は変えずに上限を広げる
+        nodeset_.swap(nodeset);
+        root_ = nodes.at(header.root);
+        max_capacity_ = std::max(config_.capacity, nodeset_.capacity());
+        return true;
+    }
+
+    // 置いた石の数
+    static Board::Coordinate stone_count(const Stage& stage) {
+        return std::popcount(stage.cells(0) | stage.cells(1));
+    }
+
+    // 指定したプレイヤーが勝った割合。引き分けは数えない。
+    static Metric win_ratio(const Node* node, Player player) {
+        const auto n_tried = node->n_first_player_won() + node->n_second_player_won();
+        const auto n_win = (player == 0) ? node->n_first_player_won() : node->n_second_player_won();
+        return (n_tried > 0) ? (static_cast<Metric>(n_win) / n_tried) : 0;
+    }
+
+    // 指定した局面の向きで、子ノードに進む手
+    // 左右を反転して合流した子ノードは、石の置き方ではなく置換表で引いたノードで照合する
+    std::optional<typename Board::Position> child_action(const Stage& stage, const Node* child) const {
+        for(const auto& action : stage.legal_actions()) {
+            auto next_stage = stage;
+            next_stage.advance_unchecked(action.column, action.height);
+            if (nodeset_.find(next_stage) == child) {
+                return action;
+            }
+        }
+        return std::nullopt;
+    }
+};
+
+// 完全読みで局面の勝敗を求める
+// 手番のプレイヤーの石と、両者の石をビットボードで持ち、alpha-beta法のnegamaxで探索する
+template <typename Board>
+class BasicSolver final {
+    FRIEND_TEST(TestSolver, Key);
+    FRIEND_TEST(TestSolver, NonLosingMoves);
+    FRIEND_TEST(TestSolver, OrderedMoves);
+    FRIEND_TEST(TestSolver, TranspositionTable);
+public:
+    using Solver = BasicSolver;
+    using Stage = BasicStage<Board>;
+    // 局面の値。正なら手番のプレイヤーが勝ち、負なら負け、0なら引き分けである。
+    // 勝つなら早く勝つほど、負けるなら遅く負けるほど、絶対値が大きい。
+    using Score = int;
+    using Count = uint64_t;
+    static constexpr Board::Coordinate MaxMoves = Board::ColumnSize * Board::MaxHeight;  // 全マス数
+    // 最も早く負けたときの値と、最も早く勝ったときの値
+    // 先手はMinLen手目、後手は相手がMinLen-1手打った後に初めて勝てる
+    static constexpr Score MinScore = -MaxMoves / 2 + (Board::MinLen - 1);
+    static constexpr Score MaxScore = (MaxMoves + 1) / 2 - (Board::MinLen - 1);
+    static constexpr size_t DefaultTableBits {22};  // 置換表のエントリ数(2の冪)
+
+private:
+    using Cells = Board::Cells;
+    using Key = Cells;
+    using Value = uint8_t;
+    // 置換表の値は上限か下限で、どちらでもなければ0にする
+    static constexpr Value LowerBoundOffset = MaxScore - MinScore + 1;
+    static_assert((MaxScore - MinScore + 1) * 2 <= std::numeric_limits<Value>::max());
+
+    // 中央に近い列ほど線を作りやすいので先に調べる
+    // 7列なら 3, 2, 4, 1, 5, 0, 6 の順になる
+    static constexpr std::array<typename Board::Coordinate, Board::ColumnSize> ColumnOrder = [] {
+        std::array<typename Board::Coordinate, Board::ColumnSize> order {};
+        for(typename Board::Coordinate i{0}; i < Board::ColumnSize; ++i) {
+            const auto offset = (i + 1) / 2;
+            order.at(i) = Board::ColumnSize / 2 + ((i % 2) ? -offset : offset);
+        }
+        return order;
+    }();
+
+    // 置換表。衝突したら上書きする。
+    // 局面のキーは一意なのでキー全体を持ち、偽のヒットは起きない。
+    class TranspositionTable final {
+    private:
+        std::vector<Key> keys_;
+        std::vector<Value> values_;
+        size_t bits_ {0};
+
+        size_t index(Key key) const {
+            // 64 bitを超える盤面では、上位を下位に畳み込む
+            auto folded = static_cast<uint64_t>(key);
+            if constexpr (sizeof(Key) > sizeof(uint64_t)) {
+                folded ^= static_cast<uint64_t>(key >> 64);
+            }
+            // 下位ビットは左端の列しか表さないので、掛け算で全ビットを混ぜる
+            return static_cast<size_t>((folded * 0x9e3779b97f4a7c15ull) >> (64 - bits_));
+        }
+
+    public:
+        explicit TranspositionTable(size_t bits) :
+            keys_(size_t{1} << bits, 0), values_(size_t{1} << bits, 0), bits_(bits) {}
+
+        void put(Key key, Value value) {
+            const auto i = index(key);
+            keys_[i] = key;
+            values_[i] = value;
+        }
+
+        // 無ければ0を返す
+        Value get(Key key) const {
+            const auto i = index(key);
+            return (keys_[i] == key) ? values_[i] : 0;
+        }
+
+        void clear() {
+            std::fill(keys_.begin(), keys_.end(), 0);
+            std::fill(values_.begin(), values_.end(), 0);
+        }
+    };
+
+    TranspositionTable table_;
+    Count n_nodes_ {0};  // 探索したノード数
+
+public:
+    explicit BasicSolver(size_t table_bits = DefaultTableBits) : table_(table_bits) {}
+    ~BasicSolver() = default;
+    BasicSolver(const Solver&) = delete;
+    Solver& operator=(const Solver&) = delete;
+
+    // 局面の値を求める。勝負が付いた局面は渡さないこと。
+    // 値の範囲を二分して、幅1の窓で探索を繰り返す
+    Score solve(const Stage& stage) {
+        const auto current = stage.cells(stage.player());
+        const auto mask = current | stage.cells(1 - stage.player());
+        const typename Board::Coordinate n_moves = std::popcount(mask);
+
+        if (n_moves >= MaxMoves) {
+            return 0;
+        }
+
+        if (Board::winning_cells(current) & Board::playable(mask)) {
+            return (MaxMoves + 1 - n_moves) / 2;
+        }
+
+        Score min = -(MaxMoves - n_moves) / 2;
+        Score max = (MaxMoves + 1 - n_moves) / 2;
+        while(min < max) {
+            // 0に近い値から調べると早く窓が狭まる
+            auto med = min + (max - min) / 2;
+            if ((med <= 0) && ((min / 2) < med)) {
+                med = min / 2;
+            } else if ((med >= 0) && ((max / 2) > med)) {
+                med = max / 2;
+            }
+
+            const auto score = negamax(current, mask, n_moves, med, med + 1);
+            if (score <= med) {
+                max = score;
+            } else {
+                min = score;
+            }
+        }
+
+        return min;
+    }
+
+    // 直前のsolve()までに探索したノード数
+    Count n_nodes() const {
+        return n_nodes_;
+    }
+
+    // 探索したノード数と置換表を消す
+    void reset() {
+        n_nodes_ = 0;
+        table_.clear();
+    }
+
+private:
+    // 局面を一意に表すキー
+    // 各列は石があるマスの一つ上に1を足した値になり、列の高さと手番の石の配置が復元できる
+    static Key key(Cells current, Cells mask) {
+        return current + mask;
+    }
+
+    // 置換表に入れる値に変換する。0は空きを表すので1以上にする。
+    // 浅い局面では窓が値の範囲より広いので、範囲に収めても上限と下限として正しい。
+    static Value to_value(Score score) {
+        return static_cast<Value>(std::clamp(score, MinScore, MaxScore) - MinScore + 1);
+    }
+
+    // 相手が次に勝つ手を防ぎ、相手が勝つマスの真下にも打たない手を返す
+    // 相手が勝つマスが二つ以上あれば、どこに打っても負けるので0を返す
+    static Cells non_losing_moves(Cells current, Cells mask) {
+        auto possible = Board::playable(mask);
+        const auto opponent_win = Board::winning_cells(current ^ mask) & ~mask;
+        const auto forced = possible & opponent_win;
+        if (forced) {
+            if (forced & (forced - 1)) {
+                return 0;
+            }
+            possible = forced;
+        }
+
+        return possible & ~(opponent_win >> 1);
+    }
+
+    // 打つと自分が勝つマスが多い手から先に調べる。同数なら中央に近い列から調べる。
+    static auto ordered_moves(Cells current, Cells mask, Cells possible) {
+        std::array<std::pair<typename Board::Coordinate, Cells>, Board::ColumnSize> moves {};
+        size_t size {0};
+        for(const auto column : ColumnOrder) {
+            const auto column_cells = ((Cells{1} << Board::FullHeight) - 1) << Board::to_index(column, 0);
+            const auto move = possible & column_cells;
+            if (!move) {
+                continue;
+            }
+
+            const auto next_mask = mask | move;
+            const typename Board::Coordinate n_threats = std::popcount(
+                Board::winning_cells(current | move) & ~next_mask);
+
+            // 挿入ソートで、同数なら先に入れた手を前に残す
+            auto i = size++;
+            for(; (i > 0) && (moves[i - 1].first < n_threats); --i) {
+                moves[i] = moves[i - 1];
+            }
+            moves[i] = {n_threats, move};
+        }
+
+        return std::make_pair(moves, size);
+    }
+
+    // 手番のプレイヤーが次の一手で勝てない局面の値を、窓(alpha, beta)で求める
+    Score negamax(Cells current, Cells mask, Board::Coordinate n_moves, Score alpha, Score beta) {
+        ++n_nodes_;
+
+        const auto possible = non_losing_moves(current, mask);
+        if (!possible) {
+            return -(MaxMoves - n_moves) / 2;
+        }
+
+        // 手番と相手が一手ずつ打っても勝たなければ引き分け
+        if (n_moves >= MaxMoves - 2) {
+            return 0;
+        }
+
+        // 相手は次の一手で勝てないので、早く負けるとしても二手後より遅い
+        const Score min = -(MaxMoves - 2 - n_moves) / 2;
+        if (alpha < min) {
+            alpha = min;
+            if (alpha >= beta) {
+                return alpha;
+            }
+        }
+
+        // 手番は次の一手で勝てないので、早く勝つとしても三手目より遅い
+        Score max = (MaxMoves - 1 - n_moves) / 2;
+        const auto k = key(current, mask);
+        if (const auto value = table_.get(k)) {
+            if (value > LowerBoundOffset) {
+                const Score lower = value + MinScore - 1 - LowerBoundOffset;
+                if (alpha < lower) {
+                    alpha = lower;
+                    if (alpha >= beta) {
+                        return alpha;
+                    }
+                }
+            } else {
+                max = value + MinScore - 1;
+            }
+        }
+
+        if (beta > max) {
+            beta = max;
+            if (alpha >= beta) {
+                return beta;
+            }
+        }
+
+        const auto [moves, size] = ordered_moves(current, mask, possible);
+        for(size_t i{0}; i < size; ++i) {
+            // 打った後は相手の手番なので、相手の石を手番の石にする
+            const auto move = moves[i].second;
+            const auto score = -negamax(current ^ mask, mask | move, n_moves + 1, -beta, -alpha);
+            if (score >= beta) {
+                table_.put(k, static_cast<Value>(to_value(score) + LowerBoundOffset));
+                return score;
+            }
+            alpha = std::max(alpha, score);
+        }
+
+        table_.put(k, to_value(alpha));
+        return alpha;
+    }
+};
+
+// 定石
+// 序盤の局面ごとに最善手と評価値を、局面のキーで整列したバイナリファイルに書き出しておき、
+// 対戦中はファイルをメモリにマップして二分探索で引く。
+// 左右を反転した局面は同じ定石を引くので、キーが小さい方の向きで登録する。
+// ファイルはこのプログラムと同じエンディアンの計算機で読み書きすることが前提である。
+template <typename Board>
+class BasicOpeningBook final {
+public:
+    using OpeningBook = BasicOpeningBook;
+    using Stage = BasicStage<Board>;
+    using MctsEngine = BasicMctsEngine<Board>;
+    using Key = uint64_t;
+    // 定石ファイルの書式を盤面の大きさによらず固定するので、キーは64 bitに収まること
+    static_assert(sizeof(typename Board::Cells) <= sizeof(Key));
+
+    // ファイルに書き出す一局面分の定石
+    struct Entry {
+        Key key {0};        // 左右反転を同一視した局面のキー
+        float value {0};    // 最善手を打って手番のプレイヤーが勝つ割合
+        uint8_t column {0}; // キーの向きでの最善手の列
+        std::array<uint8_t, 3> reserved {0, 0, 0};
+    };
+    static_assert(sizeof(Entry) == 16);
+    static_assert(std::is_trivially_copyable_v<Entry>);
+
+    // 定石を引いた結果
+    struct Move {
+        Board::Position action;  // 最善手
+        float value {0};         // 最善手を打って手番のプレイヤーが勝つ割合
+    };
+
+private:
+    // ファイルの先頭に置く
+    struct Header {
+        std::array<char, 8> magic {};  // ファイルの種類と版
+        uint64_t n_entries {0};        // 定石の数
+    };
+    static_assert(sizeof(Header) == 16);
+    static constexpr std::array<char, 8> Magic {'C', '4', 'B', 'O', 'O', 'K', '0', '1'};
+
+    void* address_ {nullptr};  // マップした領域
+    size_t length_ {0};        // マップした領域の大きさ
+    std::span<const Entry> entries_;  // キーで整列した定石
+
+public:
+    // ファイルをメモリにマップする。読めなければ空の定石にする。
+    explicit BasicOpeningBook(const std::string& path) {
+        const auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat st {};
+        if ((::fstat(fd, &st) == 0) && (static_cast<size_t>(st.st_size) >= sizeof(Header))) {
+            length_ = static_cast<size_t>(st.st_size);
+            address_ = ::mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address_ == MAP_FAILED) {
+                address_ = nullptr;
+                length_ = 0;
+            }
+        }
+        // マップした領域はファイルを閉じても使える
+        ::close(fd);
+
+        if (!address_) {
+            return;
+        }
+
+        // 二分探索で飛び飛びに読むので、先読みさせない
+        ::madvise(address_, length_, MADV_RANDOM);
+        const auto* header = static_cast<const Header*>(address_);
+        const auto n_entries = header->n_entries;
+        if ((header->magic != Magic) ||
+            (n_entries > (length_ - sizeof(Header)) / sizeof(Entry)) ||
+            (length_ != sizeof(Header) + n_entries * sizeof(Entry))) {
+            unmap();
+            return;
+        }
+
+        const auto* entries = reinterpret_cast<const Entry*>(static_cast<const char*>(address_) + sizeof(Header));
+        entries_ = std::span<const Entry>(entries, n_entries);
+    }
+
+    ~BasicOpeningBook() {
+        unmap();
+    }
+
+    BasicOpeningBook(const OpeningBook&) = delete;
+    OpeningBook& operator=(const OpeningBook&) = delete;
+
+    // 定石の数
+    size_t size() const {
+        return entries_.size();
+    }
+
+    // 局面の定石を引く。無ければ空を返す。
+    std::optional<Move> find(const Stage& stage) const {
+        const auto [key, mirrored] = canonical_key(stage);
+        const auto it = std::lower_bound(entries_.begin(), entries_.end(), key,
+                                         [](const Entry& entry, Key k) { return entry.key < k; });
+        if ((it == entries_.end()) || (it->key != key)) {
+            return std::nullopt;
+        }
+
+        // 反転した向きで登録したなら、列を反転して戻す
+        const typename Board::Coordinate column = mirrored ? (Board::ColumnSize - 1 - it->column) : it->column;
+        for(const auto& action : stage.legal_actions()) {
+            if (action.column == column) {
+                return Move{action, it->value};
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    // 左右反転を同一視した局面のキーと、キーが左右を反転した向きかどうかを返す
+    // 各列は石があるマスの一つ上に1を足した値になり、列の高さと手番の石の配置が一意に決まる
+    static std::pair<Key, bool> canonical_key(const Stage& stage) {
+        const auto current = stage.cells(stage.player());
+        const auto mask = current | stage.cells(1 - stage.player());
+        const Key key = current + mask;
+        const Key mirrored = Board::mirror(current) + Board::mirror(mask);
+        return (mirrored < key) ? std::make_pair(mirrored, true) : std::make_pair(key, false);
+    }
+
+    // 初期局面からmax_ply手までの勝負がついていない局面を、探索エンジンで予算を使い切るまで探索して
+    // 最善手を求める。左右を反転した局面は一方だけ探索する。
+    // n_failedを指定したら、置換表が一杯でノードを追加できなかった延べ回数を返す
+    static std::vector<Entry> generate(MctsEngine& engine, Board::Coordinate max_ply,
+                                       const MctsEngine::Budget& budget,
+                                       typename MctsEngine::NodeSet::Size* n_failed = nullptr) {
+        if (n_failed) {
+            *n_failed = 0;
+        }
+
+        std::vector<Entry> entries;
+        std::set<Key> visited;
+        const auto initial_stage = engine.initial_stage();
+        std::vector<Stage> stages {initial_stage};
+        visited.insert(canonical_key(initial_stage).first);
+
+        for(typename Board::Coordinate ply{0}; (ply <= max_ply) && !stages.empty(); ++ply) {
+            std::vector<Stage> next_stages;
+            for(const auto& stage : stages) {
+                // 局面ごとに根を移して、この局面からたどれないノードを解放する
+                // 全ての局面の探索木を一つの置換表に足すと、数手先で一杯になって探索できなくなる
+                engine.commit(stage);
+                const auto result = engine.search(stage, budget);
+                if (n_failed) {
+                    *n_failed += result.n_failed;
+                }
+
+                if (result.action.has_value()) {
+                    const auto [key, mirrored] = canonical_key(stage);
+                    const auto column = result.action.value().column;
+                    Entry entry;
+                    entry.key = key;
+                    entry.value = static_cast<float>(result.value);
+                    entry.column = static_cast<uint8_t>(mirrored ? (Board::ColumnSize - 1 - column) : column);
+                    entries.push_back(entry);
+                }
+
+                if (ply == max_ply) {
+                    continue;
+                }
+
+                for(const auto& action : stage.legal_actions()) {
+                    auto next_stage = stage;
+                    if ((next_stage.advance(action.column, action.height) == Stage::Result::Placed) &&
+                        visited.insert(canonical_key(next_stage).first).second) {
+                        next_stages.push_back(next_stage);
+                    }
+                }
+            }
+            std::swap(stages, next_stages);
+        }
+
+        // 探索エンジンの根を初期局面に戻す
+        engine.commit(initial_stage);
+        return entries;
+    }
+
+    // 定石をキーで整列してファイルに書き出す。書き出せたらtrueを返す。
+    static bool write(const std::string& path, std::vector<Entry> entries) {
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& lhs, const Entry& rhs) { return lhs.key < rhs.key; });
+        entries.erase(std::unique(entries.begin(), entries.end(),
+                                  [](const Entry& lhs, const Entry& rhs) { return lhs.key == rhs.key; }),
+                      entries.end());
+
+        Header header;
+        header.magic = Magic;
+        header.n_entries = entries.size();
+
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char*>(entries.data()),
+                  static_cast<std::streamsize>(entries.size() * sizeof(Entry)));
+        ofs.close();
+        return !ofs.fail();
+    }
+
+private:
+    void unmap() {
+        if (address_) {
+            ::munmap(address_, length_);
+        }
+        address_ = nullptr;
+        length_ = 0;
+        entries_ = {};
+    }
+};
+
+// 二つの探索の設定を自己対戦させて、強さと速さを比べる
+// 一つのスレッドが一局ずつ対局する。先手と後手は一局ごとに入れ替える。
+// シードを決めると、各局の乱数は局の番号だけで決まるので、スレッド数によらず同じ結果になる。
+template <typename Board>
+class BasicTournament final {
+public:
+    using Tournament = BasicTournament;
+    using CommonHashKey = BasicCommonHashKey<Board>;
+    using Stage = BasicStage<Board>;
+    using MctsEngine = BasicMctsEngine<Board>;
+    using Count = uint64_t;
+    static constexpr Player SizeOfEntrants {2};  // 参加する設定の数
+
+    // 参加する設定
+    struct Entrant {
+        MctsEngine::Config config;  // 探索の設定
+        MctsEngine::Budget budget;  // 一手ごとの探索の予算
+    };
+
+    // 一局の結果
+    struct Game {
+        std::optional<Player> winner;  // 勝った設定の番号(引き分けなら空)
+        Count n_moves {0};             // 両者が打った手数
+        std::array<Count, SizeOfEntrants> n_playouts {0, 0};    // 設定ごとの探索回数
+        std::array<Count, SizeOfEntrants> n_searches {0, 0};    // 設定ごとの手数
+    };
+
+    // 全局の結果。勝ち負けは0番目の設定から見る。
+    struct Result {
+        Count n_games {0};   // 対局数
+        Count n_wins {0};    // 0番目の設定が勝った数
+        Count n_losses {0};  // 0番目の設定が負けた数
+        Count n_draws {0};   // 引き分けた数
+        Count n_moves {0};   // 全局の手数
+        std::array<Count, SizeOfEntrants> n_playouts {0, 0};  // 設定ごとの探索回数
+        std::array<Count, SizeOfEntrants> n_searches {0, 0};  // 設定ごとの手数
+        std::chrono::duration<double> elapsed {0};  // 全局に掛かった時間
+
+        // 一局の結果を足す
+        void add(const Game& game) {
+            ++n_games;
+            if (!game.winner.has_value()) {
+                ++n_draws;
+            } else if (game.winner.value() == 0) {
+                ++n_wins;
+            } else {
+                ++n_losses;
+            }
+
+            n_moves += game.n_moves;
+            for(Player i{0}; i < SizeOfEntrants; ++i) {
+                n_playouts.at(i) += game.n_playouts.at(i);
+                n_searches.at(i) += game.n_searches.at(i);
+            }
+        }
+
+        // 0番目の設定の得点率(勝ちを1、引き分けを0.5とする)
+        double score() const {
+            return n_games ? ((n_wins + 0.5 * n_draws) / n_games) : 0.5;
+        }
+
+        // 得点率の標準誤差
+        double score_stderr() const {
+            if (!n_games) {
+                return 0.0;
+            }
+
+            const auto s = score();
+            const auto variance = (n_wins * (1.0 - s) * (1.0 - s) + n_draws * (0.5 - s) * (0.5 - s) +
+                                   n_losses * s * s) / n_games;
+            return std::sqrt(variance / n_games);
+        }
+
+        // 0番目の設定の1番目の設定に対するEloレーティングの差
+        double elo() const {
+            return to_elo(score());
+        }
+
+        // Eloレーティングの差の信頼区間。zは正規分布の分位点で、1.96なら95%信頼区間。
+        std::pair<double, double> elo_interval(double z = 1.96) const {
+            const auto s = score();
+            const auto margin = z * score_stderr();
+            return {to_elo(s - margin), to_elo(s + margin)};
+        }
+
+        // 一秒あたりの対局数
+        double games_per_sec() const {
+            return (elapsed.count() > 0) ? (n_games / elapsed.count()) : 0.0;
+        }
+
+        // 一手あたりの探索回数
+        double playouts_per_move(Player entrant) const {
+            const auto n = n_searches.at(entrant);
+            return n ? (static_cast<double>(n_playouts.at(entrant)) / n) : 0.0;
+        }
+    };
+
+private:
+    std::array<Entrant, SizeOfEntrants> entrants_;  // 参加する設定
+    unsigned int n_threads_ {1};  // 同時に対局するスレッド数
+    std::optional<Random::Seed> seed_;  // 乱数のシード(空なら実行ごとに変える)
+
+public:
+    BasicTournament(const Entrant& first, const Entrant& second, unsigned int n_threads,
+               std::optional<Random::Seed> seed = std::nullopt) :
+        entrants_({first, second}), n_threads_(std::max(1u, n_threads)), seed_(seed) {}
+
+    ~BasicTournament() = default;
+
+    // 得点率をEloレーティングの差に変換する。全勝と全敗は無限大になる。
+    static double to_elo(double score) {
+        if (score <= 0.0) {
+            return -std::numeric_limits<double>::infinity();
+        }
+        if (score >= 1.0) {
+            return std::numeric_limits<double>::infinity();
+        }
+        return -400.0 * std::log10(1.0 / score - 1.0);
+    }
+
+    // n_games局対局する
+    Result run(Count n_games) const {
+        std::vector<Game> games(n_games);
+        std::atomic<Count> next_game {0};
+        const auto start_time = std::chrono::steady_clock::now();
+
+        // 局の番号を取り合い、取った局の結果をその番号に書く
+        std::vector<std::thread> threads;
+        const auto n_threads = static_cast<Count>(std::min<Count>(n_threads_, std::max<Count>(1, n_games)));
+        for(Count i{0}; i < n_threads; ++i) {
+            threads.emplace_back([this, &games, &next_game, n_games]() {
+                for(;;) {
+                    const auto index = next_game.fetch_add(1);
+                    if (index >= n_games) {
+                        break;
+                    }
+                    games.at(index) = play(index);
+                }
+            });
+        }
+
+        for(auto&& thread : threads) {
+            thread.join();
+        }
+
+        Result result;
+        for(const auto& game : games) {
+            result.add(game);
+        }
+        result.elapsed = std::chrono::steady_clock::now() - start_time;
+        return result;
+    }
+
+    // index番目の局を対局する。偶数番目の局は0番目の設定が先手になる。
+    Game play(Count index) const {
+        // 両者が同じ局面を探せるように、ハッシュキーを共有する
+        const auto game_seed = seed_.has_value() ?
+            std::optional<Random::Seed>(seed_.value() + index * 0x9e3779b97f4a7c15ull) : std::nullopt;
+        auto hashkeys = game_seed.has_value() ?
+            std::make_shared<const CommonHashKey>(Stage::SizeOfPlayers, game_seed.value()) :
+            std::make_shared<const CommonHashKey>(Stage::SizeOfPlayers);
+
+        std::array<std::unique_ptr<MctsEngine>, SizeOfEntrants> engines;
+        for(Player i{0}; i < SizeOfEntrants; ++i) {
+            auto config = entrants_.at(i).config;
+            if (game_seed.has_value()) {
+                config.seed = game_seed.value() + i + 1;
+            }
+            engines.at(i) = std::make_unique<MctsEngine>(config, hashkeys);
+        }
+
+        Game game;
+        Stage stage(*hashkeys);
+        const Player first = static_cast<Player>(index % SizeOfEntrants);
+        for(;;) {
+            // 手番の設定で探索して打つ
+            const Player entrant = (first + stage.player()) % SizeOfEntrants;
+            const auto search = engines.at(entrant)->search(stage, entrants_.at(entrant).budget);
+            if (!search.action.has_value()) {
+                break;
+            }
+
+            game.n_playouts.at(entrant) += search.n_playouts;
+            ++game.n_searches.at(entrant);
+            ++game.n_moves;
+
+            const auto& action = search.action.value();
+            const auto result = stage.advance(action.column, action.height);
+            if (result == Stage::Result::Won) {
+                game.winner = entrant;
+                break;
+            }
+            if (result != Stage::Result::Placed) {
+                break;
+            }
+
+            // 打った手を確定して、たどれなくなったノードを解放する
+            for(auto&& engine : engines) {
+                engine->commit(stage);
+            }
+        }
+
+        return game;
+    }
+};
+
+// 独立した複数の探索エンジン
+// エンジンごとに別の対局を持ち、エンジンと同数のスレッドで同時に自己対戦する。
+// エンジンどうしはハッシュキーも置換表も共有しないので、排他しない。
+// シードを決めると、各局の乱数はエンジンの番号と何局目かだけで決まるので、一つずつ対局しても同じ結果になる。
+template <typename Board>
+class BasicEnginePool final {
+public:
+    using EnginePool = BasicEnginePool;
+    using Stage = BasicStage<Board>;
+    using MctsEngine = BasicMctsEngine<Board>;
+    using Size = size_t;
+
+    // 一局の結果
+    struct Game {
+        std::optional<Player> winner;  // 勝ったプレイヤー(引き分けなら空)
+        std::vector<typename Board::Position> moves;  // 打った手
+        uint64_t n_playouts {0};  // 全手の探索回数
+    };
+
+private:
+    std::vector<std::unique_ptr<MctsEngine>> engines_;  // 探索エンジン
+
+public:
+    // エンジンを作るだけでも置換表の確保に時間が掛かるので、エンジンごとのスレッドで作る
+    BasicEnginePool(const typename MctsEngine::Config& config, Size n_engines) : engines_(n_engines) {
+        run([this, &config](Size index) {
+            engines_.at(index) = std::make_unique<MctsEngine>(engine_config(config, index));
+        });
+    }
+
+    ~BasicEnginePool() = default;
+    BasicEnginePool(const EnginePool&) = delete;
+    EnginePool& operator=(const EnginePool&) = delete;
+
+    // index番目のエンジンの設定。シードはエンジンごとにずらす。
+    static MctsEngine::Config engine_config(const typename MctsEngine::Config& config, Size index) {
+        auto engine_config = config;
+        if (config.seed.has_value()) {
+            engine_config.seed = config.seed.value() + index * 0x9e3779b97f4a7c15ull;
+        }
+        return engine_config;
+    }
+
+    // エンジンの数
+    Size size() const {
+        return engines_.size();
+    }
+
+    // index番目のエンジン
+    MctsEngine& engine(Size index) {
+        return *engines_.at(index);
+    }
 
-            Metric ratio = n_win;
-            ratio /= n_tried;
-            if (max_value < ratio) {
-                best_action = Board::Position {action.column, action.height};
+    // 全エンジンがそれぞれ初期局面から終局まで自己対戦する
+    std::vector<Game> play(const typename MctsEngine::Budget& budget) {
+        std::vector<Game> games(engines_.size());
+        run([this, &games, &budget](Size index) {
+            games.at(index) = play(*engines_.at(index), budget);
+        });
+        return games;
+    }
+
+    // 一つのエンジンが初期局面から終局まで自己対戦する
+    // 前の対局で手を確定して根が移っていても、初期局面を根にし直してから始める
+    static Game play(MctsEngine& engine, const typename MctsEngine::Budget& budget) {
+        Game game;
+        auto stage = engine.empty_stage();
+        engine.commit(stage);
+        for(;;) {
+            const auto search = engine.search(stage, budget);
+            if (!search.action.has_value()) {
+                break;
             }
-            max_value = std::max(max_value, ratio);
+
+            game.n_playouts += search.n_playouts;
+            const auto& action = search.action.value();
+            game.moves.push_back(action);
+            const auto player = stage.player();
+            const auto result = stage.advance(action.column, action.height);
+            if (result == Stage::Result::Won) {
+                game.winner = player;
+                break;
+            }
+            if (result != Stage::Result::Placed) {
+                break;
+            }
+
+            // 打った手を確定して、たどれなくなったノードを解放する
+            engine.commit(stage);
         }
 
-        if (best_action.has_value()) {
-            return best_action;
+        return game;
+    }
+
+private:
+    // エンジンの番号ごとに一つのスレッドで関数を呼ぶ
+    template <typename Func>
+    void run(Func func) {
+        std::vector<std::thread> threads;
+        for(Size i{0}; i < engines_.size(); ++i) {
+            threads.emplace_back(func, i);
         }
 
-        return select_random(stage);
+        for(auto&& thread : threads) {
+            thread.join();
+        }
     }
 };
 
+// 標準の盤面(7列6行、4個並んだら勝ち)
+using Board = BasicBoard<7, 6, 4>;
+using CommonHashKey = BasicCommonHashKey<Board>;
+using Stage = BasicStage<Board>;
+using Node = BasicNode<Board>;
+using NodeArena = BasicNodeArena<Board>;
+using NodeSet = BasicNodeSet<Board>;
+using MctsEngine = BasicMctsEngine<Board>;
+using Solver = BasicSolver<Board>;
+using OpeningBook = BasicOpeningBook<Board>;
+using Tournament = BasicTournament<Board>;
+using EnginePool = BasicEnginePool<Board>;
+
+// ベンチマークはこのファイルを取り込んで探索エンジンだけを使うので、テストとmainを除く
+// FRIEND_TESTはgtest_prod.hだけで使えるので、ベンチマークはgtestをリンクしない
+#ifndef CONNECT4_BENCHMARK
 // 線種とハッシュキー
 class TestBoard : public ::testing::Test {};
 
@@ -906,15 +3736,14 @@ TEST_F(TestBoard, Initialize) {
     // できるだけ小さくする
     ASSERT_GE(32, sizeof(board));
 
-    ASSERT_EQ(Board::FullSize, board.placed_.size());
-    ASSERT_EQ(Board::FullSize, board.mask_.size());
-    auto size = board.mask_.size();
+    ASSERT_GE(std::numeric_limits<Board::Cells>::digits, Board::FullSize);
+    constexpr auto size = Board::FullSize;
 
-    for(decltype(size) i{0}; i<size; ++i) {
-        ASSERT_FALSE(board.placed_[i]);
+    for(Board::Coordinate i{0}; i<size; ++i) {
+        ASSERT_FALSE(Board::test(board.placed_, i));
         const auto expected = ((i / Board::FullHeight) < Board::ColumnSize) &
             ((i % Board::FullHeight) < Board::MaxHeight);
-        ASSERT_EQ(expected, board.mask_[i]);
+        ASSERT_EQ(expected, Board::test(board.mask_, i));
     }
 
     ASSERT_EQ(0, board.digest_);
@@ -926,23 +3755,23 @@ TEST_F(TestBoard, SetupLines) {
     Board board(keys.hashkeys(0));
 
     for(const auto& line : board.linemasks_) {
-        ASSERT_EQ(Board::MinLen, line.count());
+        ASSERT_EQ(Board::MinLen, std::popcount(line));
     }
 
     for(Board::Coordinate i{0}; i < Board::MinLen; ++i) {
-        ASSERT_TRUE(board.linemasks_.at(0)[i]);
+        ASSERT_TRUE(Board::test(board.linemasks_.at(0), i));
     }
 
     for(Board::Coordinate i{0}; i < Board::MinLen; ++i) {
-        ASSERT_TRUE(board.linemasks_.at(1)[i * Board::FullHeight]);
+        ASSERT_TRUE(Board::test(board.linemasks_.at(1), i * Board::FullHeight));
     }
 
     for(Board::Coordinate i{0}; i < Board::MinLen; ++i) {
-        ASSERT_TRUE(board.linemasks_.at(2)[i * (Board::FullHeight + 1)]);
+        ASSERT_TRUE(Board::test(board.linemasks_.at(2), i * (Board::FullHeight + 1)));
     }
 
     for(Board::Coordinate i{0}; i < Board::MinLen; ++i) {
-        ASSERT_TRUE(board.linemasks_.at(3)[Board::MinLen - 1 + i * (Board::FullHeight - 1)]);
+        ASSERT_TRUE(Board::test(board.linemasks_.at(3), Board::MinLen - 1 + i * (Board::FullHeight - 1)));
     }
 }
 
@@ -963,6 +3792,44 @@ TEST_F(TestBoard, Digest) {
     }
 }
 
+// 左右を反転した盤面のダイジェストは、反転した盤面のダイジェストと一致する
+TEST_F(TestBoard, MirroredDigest) {
+    CommonHashKey keys(1);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> dist(0, 2);
+
+    for(int trial{0}; trial < 100; ++trial) {
+        Board board(keys.hashkeys(0));
+        Board mirrored(keys.hashkeys(0));
+        for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
+            for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
+                if (dist(gen) == 0) {
+                    board.place(column, height);
+                    mirrored.place(Board::ColumnSize - 1 - column, height);
+                }
+            }
+        }
+
+        ASSERT_EQ(mirrored.digest(), board.mirrored_digest());
+        ASSERT_EQ(board.digest(), mirrored.mirrored_digest());
+        ASSERT_EQ(board.canonical_digest(), mirrored.canonical_digest());
+        ASSERT_EQ(std::min(board.digest(), mirrored.digest()), board.canonical_digest());
+
+        // 石を除いても、反転した盤面と一致し続ける
+        board.remove(0, 0);
+        mirrored.remove(Board::ColumnSize - 1, 0);
+        ASSERT_EQ(mirrored.digest(), board.mirrored_digest());
+        ASSERT_EQ(board.canonical_digest(), mirrored.canonical_digest());
+    }
+
+    // 左右対称な盤面は、どちらの向きでも同じダイジェストになる
+    Board symmetric(keys.hashkeys(0));
+    symmetric.place(3, 0);
+    symmetric.place(0, 0);
+    symmetric.place(6, 0);
+    ASSERT_EQ(symmetric.digest(), symmetric.mirrored_digest());
+}
+
 // 石を指定位置に置く
 TEST_F(TestBoard, Place) {
     CommonHashKey keys(2);
@@ -985,8 +3852,8 @@ TEST_F(TestBoard, Place) {
 
             full.place(column, height);
             one.place(column, height);
-            ASSERT_TRUE(full.placed_[index]);
-            ASSERT_TRUE(one.placed_[index]);
+            ASSERT_TRUE(Board::test(full.placed_, index));
+            ASSERT_TRUE(Board::test(one.placed_, index));
 
             ASSERT_EQ(digest_one, one.digest_);
             ASSERT_EQ(expected_digest, full.digest_);
@@ -1009,7 +3876,7 @@ TEST_F(TestBoard, PlaceTwice) {
             const auto expected = one.digest_;
             one.place(column, height);
 
-            ASSERT_TRUE(one.placed_[index]);
+            ASSERT_TRUE(Board::test(one.placed_, index));
             ASSERT_EQ(expected , one.digest_);
             ASSERT_TRUE(one.digest_);
         }
@@ -1029,7 +3896,7 @@ TEST_F(TestBoard, PlaceOutOfBounds) {
             Board one(keys.hashkeys(0));
             const auto index = Board::to_index(column, height);
             one.place(column, height);
-            ASSERT_FALSE(one.placed_[index]);
+            ASSERT_FALSE(Board::test(one.placed_, index));
             ASSERT_FALSE(one.digest_);
         }
     }
@@ -1047,17 +3914,17 @@ TEST_F(TestBoard, Remove) {
             Board one(keys_one);
 
             one.remove(column, height);
-            ASSERT_FALSE(one.placed_[index]);
+            ASSERT_FALSE(Board::test(one.placed_, index));
             ASSERT_FALSE(one.digest_);
 
             one.place(column, height);
             one.remove(column, height);
 
-            ASSERT_FALSE(one.placed_[index]);
+            ASSERT_FALSE(Board::test(one.placed_, index));
             ASSERT_FALSE(one.digest_);
 
             one.remove(column, height);
-            ASSERT_FALSE(one.placed_[index]);
+            ASSERT_FALSE(Board::test(one.placed_, index));
             ASSERT_FALSE(one.digest_);
         }
     }
@@ -1070,7 +3937,7 @@ TEST_F(TestBoard, Remove) {
             const auto expected = full.digest_;
 
             full.remove(column, height);
-            ASSERT_FALSE(full.placed_[index]);
+            ASSERT_FALSE(Board::test(full.placed_, index));
             ASSERT_EQ(expected, full.digest_);
 
             full.place(column, height);
@@ -1083,11 +3950,11 @@ TEST_F(TestBoard, Remove) {
         for(Board::Coordinate height{Board::MaxHeight - 1}; height >= Board::MaxHeight; --height) {
             const auto index = Board::to_index(column, height);
             full.remove(column, height);
-            ASSERT_FALSE(full.placed_[index]);
+            ASSERT_FALSE(Board::test(full.placed_, index));
             ASSERT_EQ(digests.back(), full.digest_);
 
             full.remove(column, height);
-            ASSERT_FALSE(full.placed_[index]);
+            ASSERT_FALSE(Board::test(full.placed_, index));
             ASSERT_EQ(digests.back(), full.digest_);
 
             digests.pop_back();
@@ -1106,7 +3973,7 @@ TEST_F(TestBoard, RemoveOutOfBounds) {
             one.place(column, height);
             one.remove(column, height);
 
-            ASSERT_FALSE(one.placed_[index]);
+            ASSERT_FALSE(Board::test(one.placed_, index));
             ASSERT_FALSE(one.digest_);
         }
     }
@@ -1129,10 +3996,10 @@ TEST_F(TestBoard, Merge) {
                 // 互い違いに配置する
                 const auto index = Board::to_index(column, height);
                 if (((column & 1) ^ (height & 1)) == offset) {
-                    lhs.placed_.set(index);
+                    lhs.placed_ |= Board::to_bit(index);
                     ++expected;
                 } else {
-                    rhs.placed_.set(index);
+                    rhs.placed_ |= Board::to_bit(index);
                 }
             }
         }
@@ -1141,8 +4008,8 @@ TEST_F(TestBoard, Merge) {
         const auto actual_left = lhs.merge(rhs);
         const auto actual_right = rhs.merge(lhs);
 
-        ASSERT_EQ(Board::ColumnSize * Board::MaxHeight, actual_left.placed_.count());
-        ASSERT_EQ(Board::ColumnSize * Board::MaxHeight, actual_right.placed_.count());
+        ASSERT_EQ(Board::ColumnSize * Board::MaxHeight, std::popcount(actual_left.placed_));
+        ASSERT_EQ(Board::ColumnSize * Board::MaxHeight, std::popcount(actual_right.placed_));
         ASSERT_EQ(expected_digest, actual_left.digest_);
         ASSERT_EQ(expected_digest, actual_left.digest_);
 
@@ -1157,8 +4024,8 @@ TEST_F(TestBoard, Merge) {
         // 空の盤面と合成するとそのままの値が返る
         const auto zero_left = zero.merge(lhs);
         const auto zero_right = lhs.merge(zero);
-        ASSERT_EQ(expected, zero_left.placed_.count());
-        ASSERT_EQ(expected, zero_right.placed_.count());
+        ASSERT_EQ(expected, std::popcount(zero_left.placed_));
+        ASSERT_EQ(expected, std::popcount(zero_right.placed_));
         ASSERT_EQ(lhs.digest_, zero_left.digest_);
         ASSERT_EQ(lhs.digest_, zero_right.digest_);
     }
@@ -1181,14 +4048,14 @@ TEST_F(TestBoard, ToStringCells) {
     const char mark {'+'};
 
     for(Board::Coordinate offset{0}; offset < 2; ++offset) {
-        Board::Cells cells;
+        Board::Cells cells {0};
         std::string lines(Board::ColumnSize * Board::MaxHeight, blank);
 
         for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
             for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
                 // 互い違いに配置する
                 if (((column ^ height) ^ offset) > 0) {
-                    cells.set(Board::to_index(column, height));
+                    cells |= Board::to_bit(Board::to_index(column, height));
                     lines.at(column + (Board::MaxHeight - 1 - height) * Board::ColumnSize) = mark;
                 }
             }
@@ -1254,10 +4121,10 @@ TEST_F(TestBoard, CheckVerticalLineAll) {
         Board board(keys.hashkeys(0));
 
         for(Board::Coordinate height{0}; height < Board::FullHeight; ++height) {
-            board.placed_.set(Board::to_index(column, height));
+            board.placed_ |= Board::to_bit(Board::to_index(column, height));
         }
 
-        for(Board::Coordinate i{0}; i < board.placed_.size(); ++i) {
+        for(Board::Coordinate i{0}; i < Board::FullSize; ++i) {
             const auto x = i / Board::FullHeight;
             const auto y = i % Board::FullHeight;
             const bool expected = (x == column) & (x < Board::ColumnSize) &
@@ -1275,7 +4142,7 @@ TEST_F(TestBoard, CheckVerticalLineRanged) {
         Board board(keys.hashkeys(0));
 
         for(Board::Coordinate height{0}; height < Board::FullHeight; ++height) {
-            board.placed_.set(Board::to_index(column, height));
+            board.placed_ |= Board::to_bit(Board::to_index(column, height));
         }
 
         for(Board::Coordinate x{0}; x < Board::FullWidth; ++x) {
@@ -1296,10 +4163,10 @@ TEST_F(TestBoard, CheckLineHorizontalAll) {
         Board board(keys.hashkeys(0));
 
         for(Board::Coordinate column{0}; column < Board::FullWidth; ++column) {
-            board.placed_.set(Board::to_index(column, height));
+            board.placed_ |= Board::to_bit(Board::to_index(column, height));
         }
 
-        for(Board::Coordinate i{0}; i < board.placed_.size(); ++i) {
+        for(Board::Coordinate i{0}; i < Board::FullSize; ++i) {
             const auto x = i / Board::FullHeight;
             const auto y = i % Board::FullHeight;
             const bool expected = (y == height) & (y < Board::MaxHeight) &
@@ -1318,7 +4185,7 @@ TEST_F(TestBoard, CheckLineHorizontalRanged) {
         Board board(keys.hashkeys(0));
 
         for(Board::Coordinate column{0}; column < Board::FullWidth; ++column) {
-            board.placed_.set(Board::to_index(column, height));
+            board.placed_ |= Board::to_bit(Board::to_index(column, height));
         }
 
         for(Board::Coordinate y{0}; y < Board::FullHeight; ++y) {
@@ -1342,12 +4209,12 @@ TEST_F(TestBoard, CheckLine2All) {
         for(Board::Coordinate height{0}; height < Board::FullHeight; ++height) {
             const auto x = column + height;
             if ((x >= 0) && (x < Board::FullWidth)) {
-                board.placed_.set(Board::to_index(x, height));
+                board.placed_ |= Board::to_bit(Board::to_index(x, height));
                 n_placed += (x < Board::ColumnSize) & (height < Board::MaxHeight);
             }
         }
 
-        for(Board::Coordinate i{0}; i < board.placed_.size(); ++i) {
+        for(Board::Coordinate i{0}; i < Board::FullSize; ++i) {
             const auto x = i / Board::FullHeight;
             const auto y = i % Board::FullHeight;
             const bool expected = ((x - y) == column) &
@@ -1374,12 +4241,12 @@ TEST_F(TestBoard, CheckLine3All) {
         for(Board::Coordinate height{Board::FullHeight - 1}; height >= 0; --height) {
             const auto x = column + Board::FullHeight - 1 - height;
             if ((x >= 0) && (x < Board::FullWidth)) {
-                board.placed_.set(Board::to_index(x, height));
+                board.placed_ |= Board::to_bit(Board::to_index(x, height));
                 n_placed += (x < Board::ColumnSize) & (height < Board::MaxHeight);
             }
         }
 
-        for(Board::Coordinate i{0}; i < board.placed_.size(); ++i) {
+        for(Board::Coordinate i{0}; i < Board::FullSize; ++i) {
             const auto x = i / Board::FullHeight;
             const auto y = i % Board::FullHeight;
             const auto total = std::min(Board::ColumnSize - x, y + 1);
@@ -1417,7 +4284,7 @@ TEST_F(TestBoard, CheckLineCorners) {
         auto y = sy;
 
         for(Board::Coordinate i{0}; i < Board::MinLen; ++i) {
-            board.placed_.set(Board::to_index(x, y));
+            board.placed_ |= Board::to_bit(Board::to_index(x, y));
             ps.insert(std::make_pair(x, y));
             x += dx;
             y += dy;
@@ -1454,7 +4321,7 @@ TEST_F(TestBoard, CheckLineAll) {
                         break;
                     }
 
-                    board.placed_.set(Board::to_index(x, y));
+                    board.placed_ |= Board::to_bit(Board::to_index(x, y));
                     ps.insert(std::make_pair(x, y));
                     x += dx;
                     y += dy;
@@ -1493,7 +4360,7 @@ TEST_F(TestBoard, CheckLoop) {
                         ++total;
                     }
 
-                    board.placed_.set(Board::to_index(x, y));
+                    board.placed_ |= Board::to_bit(Board::to_index(x, y));
                     ps.insert(std::make_pair(x, y));
                     x = (x + dx + Board::FullWidth) % Board::FullWidth;
                     y = (y + dy + Board::FullHeight) % Board::FullHeight;
@@ -1530,9 +4397,7 @@ TEST_F(TestBoard, LegalActionsFull) {
     CommonHashKey keys(1);
     Board board(keys.hashkeys(0));
 
-    for(size_t i{0}; i<board.placed_.size(); ++i) {
-        board.placed_.set(i);
-    }
+    board.placed_ = ~Board::Cells{0};
 
     const auto actual = board.legal_actions();
     ASSERT_TRUE(actual.empty());
@@ -1550,7 +4415,7 @@ TEST_F(TestBoard, LegalActionsHeight) {
         Board board(keys.hashkeys(0));
         for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
             for(Board::Coordinate height{0}; height < expected.at(column); ++height) {
-                board.placed_.set(Board::to_index(column, height));
+                board.placed_ |= Board::to_bit(Board::to_index(column, height));
             }
         }
 
@@ -1574,7 +4439,7 @@ TEST_F(TestBoard, LegalActionsMax) {
         Board board(keys.hashkeys(0));
         for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
             for(Board::Coordinate height{0}; height < expected.at(column); ++height) {
-                board.placed_.set(Board::to_index(column, height));
+                board.placed_ |= Board::to_bit(Board::to_index(column, height));
             }
         }
 
@@ -1601,6 +4466,84 @@ TEST_F(TestBoard, LegalActionsMax) {
     }
 }
 
+// 置くと線が完成するマスを、一マスずつ置いて調べた結果と比べる
+TEST_F(TestBoard, WinningCells) {
+    CommonHashKey keys(1);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> dist(0, 2);
+
+    for(int trial{0}; trial < 1000; ++trial) {
+        Board board(keys.hashkeys(0));
+        for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
+            for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
+                if (dist(gen) == 0) {
+                    board.place(column, height);
+                }
+            }
+        }
+
+        Board::Cells expected {0};
+        for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
+            for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
+                const auto index = Board::to_index(column, height);
+                if (Board::test(board.placed_, index)) {
+                    continue;
+                }
+
+                auto next = board;
+                next.place(column, height);
+                if (next.check(column, height)) {
+                    expected |= Board::to_bit(index);
+                }
+            }
+        }
+
+        ASSERT_EQ(expected, Board::winning_cells(board.placed_));
+    }
+}
+
+// 左右を反転する
+TEST_F(TestBoard, Mirror) {
+    ASSERT_EQ(0, Board::mirror(0));
+    for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
+        for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
+            const auto bit = Board::to_bit(Board::to_index(column, height));
+            const auto expected = Board::to_bit(Board::to_index(Board::ColumnSize - 1 - column, height));
+            ASSERT_EQ(expected, Board::mirror(bit));
+            ASSERT_EQ(bit, Board::mirror(Board::mirror(bit)));
+        }
+    }
+
+    // 列の高さは反転しても変わらない
+    const Board::Cells cells = 0x0000'1f00'0301'0f07ull;
+    ASSERT_EQ(0x0007'0f01'0300'1f00ull, Board::mirror(cells));
+}
+
+// 合法手は列数分だけ埋め込んだ領域に入る
+TEST_F(TestBoard, Positions) {
+    Board::Positions positions;
+    ASSERT_TRUE(positions.empty());
+    ASSERT_EQ(0, positions.size());
+    ASSERT_EQ(positions.begin(), positions.end());
+    ASSERT_THROW(positions.at(0), std::out_of_range);
+
+    for(Board::Coordinate i{0}; i < Board::ColumnSize * 2; ++i) {
+        positions.push_back(Board::Position{i, i + 1});
+    }
+
+    ASSERT_FALSE(positions.empty());
+    ASSERT_EQ(Board::ColumnSize, positions.size());
+    ASSERT_THROW(positions.at(Board::ColumnSize), std::out_of_range);
+
+    Board::Coordinate expected {0};
+    for(const auto& [column, height] : positions) {
+        ASSERT_EQ(expected, column);
+        ASSERT_EQ(expected + 1, height);
+        ++expected;
+    }
+    ASSERT_EQ(Board::ColumnSize, expected);
+}
+
 // 置ける場所が全て埋まっている
 TEST_F(TestBoard, Full) {
     CommonHashKey keys(1);
@@ -1610,7 +4553,7 @@ TEST_F(TestBoard, Full) {
 
     for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
         for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
-            board.placed_.set(Board::to_index(column, height));
+            board.placed_ |= Board::to_bit(Board::to_index(column, height));
             ++total;
             const auto expected = (total == (Board::MaxHeight * Board::ColumnSize));
             ASSERT_EQ(expected, board.full());
@@ -1618,6 +4561,208 @@ TEST_F(TestBoard, Full) {
     }
 }
 
+// 線種ごとのマスクで調べた結果と同じになる
+TEST_F(TestBoard, CheckSameAsLines) {
+    CommonHashKey keys(1);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<Board::Cells> dist;
+
+    for(int trial{0}; trial < 10000; ++trial) {
+        Board board(keys.hashkeys(0));
+        // 石を疎らにしないと、どこを調べても線がある
+        board.placed_ = dist(gen) & dist(gen);
+
+        bool has_line {false};
+        for(Board::Coordinate column{0}; column < Board::FullWidth; ++column) {
+            for(Board::Coordinate height{0}; height < Board::FullHeight; ++height) {
+                const auto expected = board.check_by_lines(column, height);
+                ASSERT_EQ(expected, board.check(column, height));
+                has_line |= expected;
+            }
+        }
+
+        ASSERT_EQ(has_line, Board::has_line(board.placed_));
+    }
+}
+
+// 各列で次に石を置けるマス
+TEST_F(TestBoard, Playable) {
+    ASSERT_EQ(Board::bottom_, Board::playable(0));
+    ASSERT_EQ(0, Board::playable(Board::mask_));
+
+    CommonHashKey keys(1);
+    for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
+        Board board(keys.hashkeys(0));
+        for(Board::Coordinate height{0}; height <= Board::MaxHeight; ++height) {
+            const auto actual = Board::playable(board.placed_);
+            const auto expected_bit = (height < Board::MaxHeight) ?
+                Board::to_bit(Board::to_index(column, height)) : 0;
+            const auto others = Board::bottom_ & ~Board::to_bit(Board::to_index(column, 0));
+            ASSERT_EQ(others | expected_bit, actual);
+            board.place(column, height);
+        }
+    }
+}
+
+// 盤面の大きさを変える。9列7行は64マスを超えるので128 bitで表す。
+TEST_F(TestBoard, Variant) {
+    // マスクはコンパイル時に求める
+    static_assert(std::popcount(Board::mask_) == Board::ColumnSize * Board::MaxHeight);
+    static_assert(std::popcount(Board::bottom_) == Board::ColumnSize);
+    static_assert(Board::linemasks_.at(3) == 0x01020408ull);
+
+    using Variant = BasicBoard<9, 7, 5>;
+    static_assert(std::is_same_v<unsigned __int128, Variant::Cells>);
+    static_assert(Variant::FullHeight == 8);
+    static_assert(Variant::FullSize == 80);
+    static_assert(std::popcount(Variant::mask_) == 63);
+    static_assert(std::popcount(Variant::bottom_) == 9);
+
+    BasicCommonHashKey<Variant> keys(1);
+    Variant horizontal(keys.hashkeys(0));
+    for(Variant::Coordinate column{0}; column < 4; ++column) {
+        horizontal.place(column, 0);
+        ASSERT_FALSE(horizontal.check(column, 0));
+    }
+    horizontal.place(4, 0);
+    ASSERT_TRUE(horizontal.check(4, 0));
+    ASSERT_TRUE(Variant::has_line(horizontal.cells()));
+
+    // 64 bitを超える右上の角に届く斜めの線
+    Variant diagonal(keys.hashkeys(0));
+    for(Variant::Coordinate i{0}; i < 4; ++i) {
+        diagonal.place(8 - i, 6 - i);
+    }
+    ASSERT_FALSE(Variant::has_line(diagonal.cells()));
+    ASSERT_TRUE(Variant::test(Variant::winning_cells(diagonal.cells()), Variant::to_index(4, 2)));
+    diagonal.place(4, 2);
+    ASSERT_TRUE(diagonal.check(8, 6));
+    ASSERT_TRUE(diagonal.check_by_lines(8, 6));
+
+    const auto actions = horizontal.legal_actions();
+    ASSERT_EQ(Variant::ColumnSize, actions.size());
+    ASSERT_EQ(1, actions.at(4).height);
+    ASSERT_EQ(0, actions.at(8).height);
+    ASSERT_EQ(Variant::mirror(Variant::mirror(diagonal.cells())), diagonal.cells());
+}
+
+// 線種ごとのマスクで調べる方法と、ビットシフトで調べる方法の速さを比べる
+TEST_F(TestBoard, CheckSpeed) {
+    CommonHashKey keys(1);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<Board::Cells> dist;
+
+    std::vector<Board> boards;
+    for(int i{0}; i < 1000; ++i) {
+        Board board(keys.hashkeys(0));
+        board.placed_ = dist(gen) & dist(gen) & Board::mask_;
+        boards.push_back(board);
+    }
+
+    using Func = bool (Board::*)(Board::Coordinate, Board::Coordinate) const;
+    const std::vector<std::pair<std::string, Func>> funcs {
+        {"check_by_lines", &Board::check_by_lines}, {"check", &Board::check}};
+
+    for(const auto& [name, func] : funcs) {
+        size_t n_calls {0};
+        size_t n_lines {0};
+        const auto start_time = std::chrono::steady_clock::now();
+        for(int i{0}; i < 20; ++i) {
+            for(const auto& board : boards) {
+                for(Board::Coordinate column{0}; column < Board::ColumnSize; ++column) {
+                    for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
+                        n_lines += (board.*func)(column, height);
+                        ++n_calls;
+                    }
+                }
+            }
+        }
+
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start_time;
+        std::cout << name << " : " << (elapsed.count() / n_calls) << " nsec/call, " <<
+            n_lines << " lines\n";
+    }
+}
+
+// 乱数生成器
+class TestRandom : public ::testing::Test {};
+
+// シードが同じなら同じ系列になる
+TEST_F(TestRandom, Seed) {
+    Random gen1(1);
+    Random gen2(1);
+    Random gen3(2);
+
+    size_t n_same {0};
+    for(int i{0}; i < 1000; ++i) {
+        const auto value = gen1();
+        ASSERT_EQ(value, gen2());
+        n_same += (value == gen3()) ? 1 : 0;
+    }
+    ASSERT_EQ(0, n_same);
+
+    // シードを決めなければ実行ごとに変わる
+    Random random1;
+    Random random2;
+    ASSERT_NE(random1(), random2());
+}
+
+// 範囲内の整数を偏り無く返す
+TEST_F(TestRandom, Below) {
+    Random gen(1);
+    for(int i{0}; i < 100; ++i) {
+        ASSERT_EQ(0, gen.below(1));
+    }
+
+    for(uint32_t bound {2}; bound <= Board::ColumnSize; ++bound) {
+        constexpr int n_trials = 70000;
+        std::vector<int> counts(bound, 0);
+        for(int i{0}; i < n_trials; ++i) {
+            const auto value = gen.below(bound);
+            ASSERT_GT(bound, value);
+            ++counts.at(value);
+        }
+
+        // 各値の回数は期待値から標準偏差の数倍以内に収まる
+        const double expected = static_cast<double>(n_trials) / bound;
+        const double sigma = std::sqrt(expected * (1.0 - 1.0 / bound));
+        for(const auto count : counts) {
+            ASSERT_NEAR(expected, count, sigma * 5);
+        }
+    }
+
+    // 2^32に近い上限では引き直しが起きる
+    const uint32_t large = (1u << 31) + 1;
+    for(int i{0}; i < 1000; ++i) {
+        ASSERT_GT(large, gen.below(large));
+    }
+}
+
+// 標準の乱数生成器と分布を使うより速い
+TEST_F(TestRandom, Speed) {
+    constexpr int n_trials = 10000000;
+    uint64_t checksum {0};
+
+    std::mt19937 mt(1);
+    const auto start_mt = std::chrono::steady_clock::now();
+    for(int i{0}; i < n_trials; ++i) {
+        std::uniform_int_distribution<int> dist(0, Board::ColumnSize - 1);
+        checksum += dist(mt);
+    }
+    const std::chrono::duration<double> elapsed_mt = std::chrono::steady_clock::now() - start_mt;
+
+    Random gen(1);
+    const auto start = std::chrono::steady_clock::now();
+    for(int i{0}; i < n_trials; ++i) {
+        checksum += gen.below(Board::ColumnSize);
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    ASSERT_LT(0, checksum);
+    std::cout << "mt19937 + uniform_int_distribution : " << (elapsed_mt.count() * 1e+9 / n_trials) <<
+        " nsec/call, xoshiro256** + Lemire : " << (elapsed.count() * 1e+9 / n_trials) << " nsec/call\n";
+}
+
 class TestCommonHashKey : public ::testing::Test {};
 
 // ハッシュキー
@@ -1642,6 +4787,18 @@ TEST_F(TestCommonHashKey, Initialize) {
     }
 }
 
+// シードが同じなら同じキーになる
+TEST_F(TestCommonHashKey, Seed) {
+    CommonHashKey keys1(Stage::SizeOfPlayers, 1);
+    CommonHashKey keys2(Stage::SizeOfPlayers, 1);
+    CommonHashKey keys3(Stage::SizeOfPlayers, 2);
+    for(Player i{0}; i < Stage::SizeOfPlayers; ++i) {
+        ASSERT_EQ(keys1.hashkeys(i), keys2.hashkeys(i));
+        ASSERT_NE(keys1.hashkeys(i), keys3.hashkeys(i));
+    }
+    ASSERT_NE(keys1.hashkeys(0), keys1.hashkeys(1));
+}
+
 class TestStage : public ::testing::Test {
 protected:
     std::string get_blank_lines() {
@@ -1735,21 +4892,21 @@ TEST_F(TestStage, MergeBoards) {
     Stage stage(keys);
     constexpr Board::Coordinate index0 {2};
     constexpr Board::Coordinate index1 {5};
-    ASSERT_FALSE(stage.merged_board_.placed_[index0]);
-    ASSERT_FALSE(stage.merged_board_.placed_[index1]);
+    ASSERT_FALSE(Board::test(stage.merged_board_.placed_, index0));
+    ASSERT_FALSE(Board::test(stage.merged_board_.placed_, index1));
 
-    stage.boards_.at(0).placed_.set(index0);
+    stage.boards_.at(0).placed_ |= Board::to_bit(index0);
     stage.merge_boards();
     ASSERT_EQ(stage.boards_.at(0).hashkeys_, stage.merged_board_.hashkeys_);
-    ASSERT_TRUE(stage.merged_board_.placed_[index0]);
-    ASSERT_FALSE(stage.merged_board_.placed_[index1]);
+    ASSERT_TRUE(Board::test(stage.merged_board_.placed_, index0));
+    ASSERT_FALSE(Board::test(stage.merged_board_.placed_, index1));
 
     stage.player_ = 1;
-    stage.boards_.at(1).placed_.set(index1);
+    stage.boards_.at(1).placed_ |= Board::to_bit(index1);
     stage.merge_boards();
     ASSERT_EQ(stage.boards_.at(1).hashkeys_, stage.merged_board_.hashkeys_);
-    ASSERT_TRUE(stage.merged_board_.placed_[index0]);
-    ASSERT_TRUE(stage.merged_board_.placed_[index1]);
+    ASSERT_TRUE(Board::test(stage.merged_board_.placed_, index0));
+    ASSERT_TRUE(Board::test(stage.merged_board_.placed_, index1));
 }
 
 TEST_F(TestStage, Digest) {
@@ -1758,12 +4915,12 @@ TEST_F(TestStage, Digest) {
     constexpr Board::Coordinate index0 {3};
     constexpr Board::Coordinate index1 {7};
 
-    stage.boards_.at(0).placed_.set(index0);
+    stage.boards_.at(0).placed_ |= Board::to_bit(index0);
     auto expected = stage.boards_.at(0).merge(stage.boards_.at(1)).digest();
     stage.merge_boards();
     ASSERT_EQ(expected, stage.merged_board_.digest());
 
-    stage.boards_.at(1).placed_.set(index1);
+    stage.boards_.at(1).placed_ |= Board::to_bit(index1);
     expected = stage.boards_.at(0).merge(stage.boards_.at(1)).digest();
     stage.merge_boards();
     ASSERT_EQ(expected, stage.merged_board_.digest());
@@ -1778,9 +4935,9 @@ TEST_F(TestStage, Full) {
         for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
             const auto index = Board::to_index(column, height);
             if ((height & 1) == 0) {
-                stage.boards_.at(0).placed_.set(index);
+                stage.boards_.at(0).placed_ |= Board::to_bit(index);
             } else {
-                stage.boards_.at(1).placed_.set(index);
+                stage.boards_.at(1).placed_ |= Board::to_bit(index);
             }
 
             stage.merge_boards();
@@ -1813,6 +4970,130 @@ TEST_F(TestStage, LegalActions) {
     }
 }
 
+// 石を置けるマスを返す
+TEST_F(TestStage, Playable) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+    ASSERT_EQ(Board::ColumnSize, std::popcount(stage.playable()));
+
+    for(Board::Coordinate i{0}; i < Board::MaxHeight; ++i) {
+        const auto cells = stage.playable();
+        ASSERT_TRUE(Board::test(cells, Board::to_index(0, i)));
+        ASSERT_FALSE(Board::test(cells, Board::to_index(0, i + 1)));
+        stage.advance(0, i);
+    }
+
+    ASSERT_FALSE(Board::test(stage.playable(), Board::to_index(0, Board::MaxHeight)));
+    ASSERT_EQ(Board::ColumnSize - 1, std::popcount(stage.playable()));
+}
+
+// 範囲外の座標には打てない
+TEST_F(TestStage, AdvanceOutOfRange) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+
+    const std::vector<Board::Position> positions {
+        {-1, 0}, {Board::ColumnSize, 0}, {0, -1}, {0, Board::MaxHeight},
+        {0, Board::FullHeight}, {0, Board::FullHeight * 2}};
+    for(const auto& [column, height] : positions) {
+        ASSERT_EQ(Stage::Result::Invalid, stage.advance(column, height));
+    }
+    ASSERT_EQ(0, stage.merged_board_.cells());
+}
+
+// 合法手なら確かめても確かめなくても同じ結果になる
+TEST_F(TestStage, AdvanceUnchecked) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    std::mt19937 gen(1);
+
+    for(int trial{0}; trial < 100; ++trial) {
+        Stage checked(keys);
+        Stage unchecked(keys);
+
+        for(;;) {
+            const auto actions = checked.legal_actions();
+            ASSERT_FALSE(actions.empty());
+            std::uniform_int_distribution<size_t> dist(0, actions.size() - 1);
+            const auto [column, height] = actions.at(dist(gen));
+
+            const auto expected = checked.advance(column, height);
+            const auto actual = unchecked.advance_unchecked(column, height);
+            ASSERT_EQ(expected, actual);
+            ASSERT_EQ(checked.player(), unchecked.player());
+            ASSERT_EQ(checked.merged_board_.cells(), unchecked.merged_board_.cells());
+            ASSERT_EQ(checked.digest(), unchecked.digest());
+
+            if (expected != Stage::Result::Placed) {
+                break;
+            }
+        }
+    }
+}
+
+// 打った手を逆順に戻すと元の局面に戻る
+TEST_F(TestStage, Undo) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    std::mt19937 gen(1);
+
+    for(int trial{0}; trial < 100; ++trial) {
+        Stage stage(keys);
+        std::vector<Stage> stages;
+        std::vector<Board::Position> moves;
+
+        for(;;) {
+            const auto actions = stage.legal_actions();
+            ASSERT_FALSE(actions.empty());
+            std::uniform_int_distribution<size_t> dist(0, actions.size() - 1);
+            const auto action = actions.at(dist(gen));
+
+            stages.push_back(stage);
+            moves.push_back(action);
+            if (stage.advance_unchecked(action.column, action.height) != Stage::Result::Placed) {
+                break;
+            }
+        }
+
+        while(!moves.empty()) {
+            stage.undo(moves.back().column, moves.back().height);
+            const auto& expected = stages.back();
+            ASSERT_EQ(expected.player(), stage.player());
+            ASSERT_EQ(expected.digest(), stage.digest());
+            ASSERT_EQ(expected.merged_board_.cells(), stage.merged_board_.cells());
+            for(Player player{0}; player < Stage::SizeOfPlayers; ++player) {
+                ASSERT_EQ(expected.boards_.at(player).cells(), stage.boards_.at(player).cells());
+            }
+            moves.pop_back();
+            stages.pop_back();
+        }
+    }
+}
+
+// 打つと勝つマスと、勝った局面
+TEST_F(TestStage, WinningMoves) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+    ASSERT_FALSE(stage.winning_moves());
+
+    /*
+     * 2+-
+     * 1+-
+     * 0+-
+     *  0123456
+     */
+    for(Board::Coordinate height{0}; height < 3; ++height) {
+        stage.advance(0, height);
+        stage.advance(1, height);
+    }
+
+    ASSERT_EQ(0, stage.player());
+    ASSERT_EQ(Board::to_bit(Board::to_index(0, 3)), stage.winning_moves());
+    ASSERT_FALSE(stage.won());
+
+    ASSERT_EQ(Stage::Result::Won, stage.advance(0, 3));
+    ASSERT_EQ(0, stage.player());
+    ASSERT_TRUE(stage.won());
+}
+
 // 一手ずつ交互に合法手を打つ
 TEST_F(TestStage, Advance1) {
     struct Step {
@@ -1960,12 +5241,12 @@ TEST_F(TestStage, WinAtLastMove) {
 
     for(Board::Coordinate i{0}; i < (size - 4); ++i) {
         if ((i % Board::FullHeight) < Board::MaxHeight) {
-            stage.boards_.at(1).placed_.set(i);
+            stage.boards_.at(1).placed_ |= Board::to_bit(i);
         }
     }
 
     for(Board::Coordinate i{size-4}; i < (size-1); ++i) {
-        stage.boards_.at(0).placed_.set(i);
+        stage.boards_.at(0).placed_ |= Board::to_bit(i);
     }
     stage.merge_boards();
 
@@ -2042,6 +5323,46 @@ TEST_F(TestNode, Expanded) {
     ASSERT_TRUE(node.expanded());
 }
 
+// 探索中のスレッド数
+TEST_F(TestNode, VirtualLoss) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+    Node node(stage);
+
+    Node child0(stage);
+    Node child1(stage);
+    node.add_child(&child0);
+    node.add_child(&child1);
+
+    ASSERT_EQ(0, node.n_virtual_loss());
+    node.add_virtual_loss(0);
+    node.add_virtual_loss(1);
+    node.add_virtual_loss(1);
+    ASSERT_EQ(1, node.n_virtual_loss(0));
+    ASSERT_EQ(2, node.n_virtual_loss(1));
+    ASSERT_EQ(3, node.n_virtual_loss());
+    node.remove_virtual_loss(1);
+    ASSERT_EQ(1, node.n_virtual_loss(1));
+    ASSERT_EQ(2, node.n_virtual_loss());
+    ASSERT_FALSE(node.n_tried());
+    ASSERT_FALSE(node.n_first_player_won());
+    ASSERT_FALSE(node.n_second_player_won());
+}
+
+// 回数をまとめて足す
+TEST_F(TestNode, AddCounts) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+    Node node(stage);
+
+    node.add_counts(5, 3, 1);
+    node.add_counts(2, 0, 1);
+    ASSERT_EQ(7, node.n_tried());
+    ASSERT_EQ(3, node.n_first_player_won());
+    ASSERT_EQ(2, node.n_second_player_won());
+    ASSERT_FALSE(node.n_virtual_loss());
+}
+
 // 初期状態から順に追加する
 TEST_F(TestNode, Digest) {
     CommonHashKey keys(Stage::SizeOfPlayers);
@@ -2075,20 +5396,27 @@ TEST_F(TestNode, AddParent) {
     CommonHashKey keys(Stage::SizeOfPlayers);
     Stage stage(keys);
     Node  node(stage);
-    using Size = decltype(node.parents_)::size_type;
-
-    for(Size i{1}; i<=3; ++i) {
-        auto parent = std::make_unique<Node>(stage);
-        node.add_parent(parent.get());
-        ASSERT_EQ(i, node.parents_.size());
-        ASSERT_EQ(parent.get(), node.parents_.at(i-1));
-
-        const auto& actual = node.parents();
-        ASSERT_EQ(&actual, &node.parents_);
-        ASSERT_EQ(actual, node.parents_);
+    std::vector<std::unique_ptr<Node>> parents;
+
+    for(size_t i{1}; i<=Node::MaxEdges; ++i) {
+        parents.push_back(std::make_unique<Node>(stage));
+        auto parent = parents.back().get();
+        node.add_parent(parent);
+        ASSERT_EQ(i, node.n_parents_);
+        ASSERT_EQ(parent, node.parents_.at(i-1));
+
+        const auto actual = node.parents();
+        ASSERT_EQ(node.parents_.data(), actual.data());
+        ASSERT_EQ(i, actual.size());
+        ASSERT_EQ(parent, actual.back());
     };
 
-    ASSERT_FALSE(node.children_.size());
+    // 上限を超えたら追加しない
+    Node extra(stage);
+    node.add_parent(&extra);
+    ASSERT_EQ(Node::MaxEdges, node.parents().size());
+    ASSERT_EQ(parents.back().get(), node.parents().back());
+    ASSERT_FALSE(node.children().size());
 }
 
 // 子ノードを追加する
@@ -2096,20 +5424,103 @@ TEST_F(TestNode, AddChild) {
     CommonHashKey keys(Stage::SizeOfPlayers);
     Stage stage(keys);
     Node  node(stage);
-    using Size = decltype(node.children_)::size_type;
+    std::vector<std::unique_ptr<Node>> children;
+
+    for(size_t i{1}; i<=Node::MaxEdges; ++i) {
+        children.push_back(std::make_unique<Node>(stage));
+        auto child = children.back().get();
+        ASSERT_FALSE(node.has_child(child));
+        node.add_child(child);
+        ASSERT_TRUE(node.has_child(child));
+        ASSERT_EQ(i, node.n_children_);
+        ASSERT_EQ(child, node.children_.at(i-1));
+
+        const auto actual = node.children();
+        ASSERT_EQ(node.children_.data(), actual.data());
+        ASSERT_EQ(i, actual.size());
+        ASSERT_EQ(child, actual.back());
+    };
 
-    for(Size i{1}; i<=3; ++i) {
-        auto child = std::make_unique<Node>(stage);
-        node.add_child(child.get());
-        ASSERT_EQ(i, node.children_.size());
-        ASSERT_EQ(child.get(), node.children_.at(i-1));
+    // 上限を超えたら追加しない
+    Node extra(stage);
+    node.add_child(&extra);
+    ASSERT_EQ(Node::MaxEdges, node.children().size());
+    ASSERT_FALSE(node.has_child(&extra));
+    ASSERT_FALSE(node.parents().size());
+}
 
-        const auto& actual = node.children();
-        ASSERT_EQ(&actual, &node.children_);
-        ASSERT_EQ(actual, node.children_);
-    };
+// 子ノードの統計を親ノードに並べる
+TEST_F(TestNode, ChildCounts) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+    Node node(stage);
+    Node child0(stage);
+    Node child1(stage);
+    Node other(stage);
+
+    child0.add_counts(10, 3, 4);
+    node.add_child(&child0);
+    node.add_child(&child1);
+    ASSERT_EQ(0, node.child_index(&child0));
+    ASSERT_EQ(1, node.child_index(&child1));
+    ASSERT_EQ(Node::MaxEdges, node.child_index(&other));
+
+    // 追加したときの子ノードの統計を写す
+    ASSERT_EQ(3, node.child_first_player_won(0));
+    ASSERT_EQ(4, node.child_second_player_won(0));
+    ASSERT_EQ(0, node.child_first_player_won(1));
+    ASSERT_EQ(0, node.child_second_player_won(1));
+
+    node.add_child_counts(1, 5, 6);
+    ASSERT_EQ(5, node.child_first_player_won(1));
+    ASSERT_EQ(6, node.child_second_player_won(1));
+
+    // 子ノードの統計とは別に置き換える
+    node.set_child_counts(1, 1, 0);
+    ASSERT_EQ(3, node.child_first_player_won(0));
+    ASSERT_EQ(4, node.child_second_player_won(0));
+    ASSERT_EQ(1, node.child_first_player_won(1));
+    ASSERT_EQ(0, node.child_second_player_won(1));
+}
 
-    ASSERT_FALSE(node.parents_.size());
+class TestNodeArena : public ::testing::Test {};
+
+// チャンクは必要になったら確保する
+TEST_F(TestNodeArena, Initialize) {
+    constexpr NodeArena::Size capacity = NodeArena::ChunkSize + 1;
+    NodeArena arena(capacity);
+    ASSERT_EQ(0, arena.size());
+    ASSERT_EQ(0, arena.n_chunks());
+    ASSERT_EQ(0, arena.n_bytes());
+    ASSERT_EQ(2, arena.max_chunks());
+
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+    auto first = arena.create(stage);
+    ASSERT_TRUE(first);
+    ASSERT_EQ(stage.digest(), first->digest());
+    ASSERT_EQ(1, arena.size());
+    ASSERT_EQ(1, arena.n_chunks());
+    ASSERT_LT(0, arena.n_bytes());
+
+    // 一つのチャンクからノードを連続して切り出す
+    Node* prev = first;
+    for(NodeArena::Size i{1}; i<NodeArena::ChunkSize; ++i) {
+        auto node = arena.create(stage);
+        ASSERT_EQ(prev + 1, node);
+        prev = node;
+    }
+    ASSERT_EQ(1, arena.n_chunks());
+
+    // チャンクを使い切ったら次のチャンクを確保する
+    ASSERT_TRUE(arena.create(stage));
+    ASSERT_EQ(2, arena.n_chunks());
+    ASSERT_EQ(capacity, arena.size());
+
+    // 容量を超えたら確保しない
+    ASSERT_FALSE(arena.create(stage));
+    ASSERT_EQ(capacity, arena.size());
+    ASSERT_EQ(2, arena.n_chunks());
 }
 
 class TestNodeSet : public ::testing::Test {};
@@ -2119,67 +5530,179 @@ TEST_F(TestNodeSet, Add) {
     NodeSet nodeset;
     CommonHashKey keys(Stage::SizeOfPlayers);
     Stage stage(keys);
+    const auto stage0 = stage;
 
-    auto node0 = std::make_unique<Node>(stage);
-    auto ptr0 = node0.get();
-    auto actual = nodeset.add(node0);
-    ASSERT_FALSE(node0);
-    ASSERT_EQ(ptr0, actual);
-    ASSERT_EQ(1, nodeset.set_.size());
+    auto ptr0 = nodeset.add(stage);
+    ASSERT_TRUE(ptr0);
+    ASSERT_EQ(stage.digest(), ptr0->digest());
+    ASSERT_EQ(1, nodeset.size());
 
     // 二度追加すると最初の物が得られる
-    auto node0_alt = std::make_unique<Node>(stage);
-    auto node02 = std::make_unique<Node>(stage);
-    actual = nodeset.add(node0_alt);
-    ASSERT_FALSE(node0_alt);
+    auto actual = nodeset.add(stage);
     ASSERT_EQ(ptr0, actual);
-    ASSERT_EQ(1, nodeset.set_.size());
+    ASSERT_EQ(1, nodeset.size());
 
     // 初手
     stage.advance(0, 0);
-    auto node1 = std::make_unique<Node>(stage);
-    auto node12 = std::make_unique<Node>(stage);
-    auto ptr1 = node1.get();
-    actual = nodeset.add(node1);
-    ASSERT_FALSE(node1);
+    const auto stage1 = stage;
+    auto ptr1 = nodeset.add(stage);
+    ASSERT_TRUE(ptr1);
+    ASSERT_NE(ptr0, ptr1);
+    ASSERT_EQ(2, nodeset.size());
+
+    actual = nodeset.add(stage);
     ASSERT_EQ(ptr1, actual);
-    ASSERT_EQ(2, nodeset.set_.size());
+    ASSERT_EQ(2, nodeset.size());
+
+    // 二番手
+    stage.advance(0, 1);
+    auto ptr2 = nodeset.add(stage);
+    ASSERT_TRUE(ptr2);
+    ASSERT_EQ(3, nodeset.size());
+
+    // Stageはノード間で共有しないので、初期状態も初手も残っている
+    ASSERT_EQ(ptr0, nodeset.add(stage0));
+    ASSERT_EQ(0, std::popcount(ptr0->stage().merged_board_.placed_));
+    ASSERT_EQ(ptr1, nodeset.add(stage1));
+    ASSERT_EQ(1, std::popcount(ptr1->stage().merged_board_.placed_));
+    ASSERT_EQ(2, std::popcount(ptr2->stage().merged_board_.placed_));
+
+    // ノードは重複して作らない
+    ASSERT_EQ(3, nodeset.arena().size());
+}
+
+// 盤面からノードを探す
+TEST_F(TestNodeSet, Find) {
+    NodeSet nodeset;
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+
+    auto ptr0 = nodeset.add(stage);
+    ASSERT_TRUE(ptr0);
+    ASSERT_EQ(ptr0, nodeset.find(stage));
+
+    stage.advance(0, 0);
+    ASSERT_FALSE(nodeset.find(stage));
+}
+
+// スロットの数は2のべき乗に切り上げる
+TEST_F(TestNodeSet, Capacity) {
+    const std::vector<std::pair<NodeSet::Size, NodeSet::Size>> testcases {
+        {0, 1}, {1, 1}, {2, 2}, {3, 4}, {1000, 1024}, {1024, 1024}};
+
+    for(const auto& [capacity, expected] : testcases) {
+        NodeSet nodeset(capacity);
+        ASSERT_EQ(expected, nodeset.capacity());
+        ASSERT_EQ(expected - 1, nodeset.mask_);
+        ASSERT_EQ(0, nodeset.size());
+    }
+
+    NodeSet nodeset;
+    ASSERT_EQ(NodeSet::DefaultCapacity, nodeset.capacity());
+}
+
+// 表が一杯なら追加できない
+TEST_F(TestNodeSet, Full) {
+    NodeSet nodeset(4);
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+    std::vector<Node*> nodes;
+
+    for(Board::Coordinate column{0}; column < 4; ++column) {
+        auto actual = nodeset.add(stage);
+        ASSERT_TRUE(actual);
+        nodes.push_back(actual);
+        stage.advance(column, 0);
+    }
+    ASSERT_EQ(4, nodeset.size());
+
+    ASSERT_FALSE(nodeset.add(stage));
+    ASSERT_FALSE(nodeset.find(stage));
+    ASSERT_EQ(4, nodeset.size());
+
+    // 登録済の局面は探せる
+    for(const auto& expected : nodes) {
+        ASSERT_EQ(expected, nodeset.find(expected->stage()));
+    }
+
+    size_t n_nodes {0};
+    nodeset.for_each([&n_nodes](const Node*) { ++n_nodes; });
+    ASSERT_EQ(4, n_nodes);
+}
+
+// 複数のスレッドが同じ局面を同時に追加しても、一つだけ登録される
+TEST_F(TestNodeSet, Concurrent) {
+    NodeSet nodeset(256, false);
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage initial_stage(keys);
+
+    std::vector<Stage> stages;
+    for(Board::Coordinate first{0}; first < Board::ColumnSize; ++first) {
+        for(Board::Coordinate second{0}; second < Board::ColumnSize; ++second) {
+            auto stage = initial_stage;
+            stage.advance(first, 0);
+            stage.advance(second, (first == second) ? 1 : 0);
+            stages.push_back(stage);
+        }
+    }
 
-    auto node1_ptr = std::make_unique<Node>(stage);
-    actual = nodeset.add(node1_ptr);
-    ASSERT_EQ(ptr1, actual);
-    ASSERT_EQ(2, nodeset.set_.size());
+    constexpr size_t n_threads = 4;
+    std::vector<std::vector<Node*>> actual(n_threads);
+    std::vector<std::thread> threads;
+    for(size_t i{0}; i<n_threads; ++i) {
+        threads.emplace_back([&nodeset, &stages, &actual, i]() {
+            for(const auto& stage : stages) {
+                actual.at(i).push_back(nodeset.add(stage));
+            }
+        });
+    }
 
-    // 二番手
-    stage.advance(0, 1);
-    auto node2 = std::make_unique<Node>(stage);
-    auto ptr2 = node2.get();
-    actual = nodeset.add(node2);
-    ASSERT_EQ(ptr2, actual);
-    ASSERT_EQ(3, nodeset.set_.size());
+    for(auto&& thread : threads) {
+        thread.join();
+    }
 
-    // Stageはノード間で共有しないので、初期状態も初手も残っている
-    ASSERT_EQ(ptr0, nodeset.add(node02));
-    ASSERT_EQ(0, ptr0->stage().merged_board_.placed_.count());
-    ASSERT_EQ(ptr1, nodeset.add(node12));
-    ASSERT_EQ(1, ptr1->stage().merged_board_.placed_.count());
-    ASSERT_EQ(2, ptr2->stage().merged_board_.placed_.count());
+    ASSERT_EQ(stages.size(), nodeset.size());
+    ASSERT_EQ(stages.size(), nodeset.arena().size());
+    for(size_t i{0}; i<stages.size(); ++i) {
+        const auto expected = nodeset.find(stages.at(i));
+        ASSERT_TRUE(expected);
+        for(const auto& nodes : actual) {
+            ASSERT_EQ(expected, nodes.at(i));
+        }
+    }
 }
 
-// 盤面からノードを探す
-TEST_F(TestNodeSet, Find) {
-    NodeSet nodeset;
+// 左右を反転した局面は同じノードになる
+TEST_F(TestNodeSet, Symmetric) {
     CommonHashKey keys(Stage::SizeOfPlayers);
-    Stage stage(keys);
-
-    auto node0 = std::make_unique<Node>(stage);
-    auto ptr0 = node0.get();
-    auto actual = nodeset.add(node0);
-    ASSERT_EQ(ptr0, actual);
-    ASSERT_EQ(ptr0, nodeset.find(stage));
+    Stage initial_stage(keys);
+
+    NodeSet symmetric(256);
+    NodeSet asymmetric(256, false);
+    for(Board::Coordinate first{0}; first < Board::ColumnSize; ++first) {
+        for(Board::Coordinate second{0}; second < Board::ColumnSize; ++second) {
+            auto stage = initial_stage;
+            stage.advance(first, 0);
+            stage.advance(second, (first == second) ? 1 : 0);
+            auto mirrored = initial_stage;
+            mirrored.advance(Board::ColumnSize - 1 - first, 0);
+            mirrored.advance(Board::ColumnSize - 1 - second, (first == second) ? 1 : 0);
+
+            const auto node = symmetric.add(stage);
+            ASSERT_TRUE(node);
+            ASSERT_EQ(node, symmetric.find(mirrored));
+            ASSERT_EQ(node, symmetric.add(mirrored));
+
+            asymmetric.add(stage);
+            if (stage.digest() != mirrored.digest()) {
+                ASSERT_NE(asymmetric.find(stage), asymmetric.find(mirrored));
+            }
+        }
+    }
 
-    stage.advance(0, 0);
-    ASSERT_FALSE(nodeset.find(stage));
+    // 中央に二つ重ねた局面だけが左右対称
+    ASSERT_EQ((Board::ColumnSize * Board::ColumnSize - 1) / 2 + 1, symmetric.size());
+    ASSERT_EQ(Board::ColumnSize * Board::ColumnSize, asymmetric.size());
 }
 
 // MCTS (Monte Carlo Tree Search)
@@ -2192,7 +5715,7 @@ protected:
     };
 
     // 対戦結果(どのプレイヤーが、どの戦略で、何回勝ったか
-    using ResultMatrix = std::array<std::array<Node::Count, Stage::SizeOfPlayers>, Stage::SizeOfPlayers>;
+    using ResultMatrix = std::array<std::array<typename Node::Count, Stage::SizeOfPlayers>, Stage::SizeOfPlayers>;
     // プレイヤーの戦略。試行ごとに入れ替えて実行する。
     using Strategies = std::array<Strategy, Stage::SizeOfPlayers>;
 
@@ -2275,15 +5798,9 @@ protected:
                     // MCTSエンジンでこの局面から探索を開始する
                     // 指定回数まで時間いっぱいまでの少ない方まで探索する。時間0なら全く検索しない。
                     // 1ミリ秒で10-100回くらいplayoutできる
-                    const auto start_time = std::chrono::high_resolution_clock::now();
-                    for(decltype(n_train_online) i{0}; i<n_train_online; ++i) {
-                        const auto diff = std::chrono::high_resolution_clock::now() - start_time;
-                        if ((limit_msec == ZeroMilliSec) || (diff >= limit_msec)) {
-                            break;
-                        }
-
-                        engine.playout(stage);
-                        ++n_playout;
+                    if (n_train_online && (limit_msec != ZeroMilliSec)) {
+                        const MctsEngine::Budget budget {n_train_online, limit_msec};
+                        n_playout += engine.search(stage, budget).n_playouts;
                     }
                 }
             }
@@ -2298,26 +5815,62 @@ protected:
 
 // ノードを一段展開する
 TEST_F(TestMctsEngine, ExpandRoot) {
-    MctsEngine engine;
-    Stage stage(engine.hashkeys_);
+    for(const auto symmetric : {false, true}) {
+        MctsEngine::Config config;
+        config.symmetric = symmetric;
+        MctsEngine engine(config);
 
-    ASSERT_TRUE(engine.root_);
-    ASSERT_FALSE(engine.root_->expanded());
-    engine.expand(engine.root_);
-    ASSERT_TRUE(engine.root_->expanded());
-    ASSERT_EQ(Board::ColumnSize, engine.root_->children().size());
+        ASSERT_TRUE(engine.root_);
+        ASSERT_FALSE(engine.root_->expanded());
+        engine.expand(engine.root_);
+        ASSERT_TRUE(engine.root_->expanded());
 
-    for(const auto& child : engine.root_->children()) {
-        ASSERT_FALSE(child->children().size());
-        ASSERT_EQ(1, child->parents().size());
-        ASSERT_EQ(engine.root_, child->parents().at(0));
+        // 左右を反転した局面を同じノードにすると、初手は中央と左右の片側だけになる
+        const size_t expected = symmetric ? ((Board::ColumnSize + 1) / 2) : Board::ColumnSize;
+        ASSERT_EQ(expected, engine.root_->children().size());
+
+        for(const auto& child : engine.root_->children()) {
+            ASSERT_FALSE(child->children().size());
+            ASSERT_EQ(1, child->parents().size());
+            ASSERT_EQ(engine.root_, child->parents()[0]);
+        }
     }
 }
 
+// 置換表が一杯なら、手を欠いたまま展開済にしない
+TEST_F(TestMctsEngine, ExpandTableFull) {
+    MctsEngine::Config config;
+    // 根と、左右対称を除いた初手4個は入らない
+    config.capacity = 4;
+    MctsEngine engine(config);
+    ASSERT_EQ(4, engine.nodeset_.capacity());
+
+    engine.expand(engine.root_);
+    ASSERT_FALSE(engine.root_->expanded());
+    ASSERT_EQ(0, engine.root_->children().size());
+    ASSERT_LT(0, engine.nodeset_.n_failed());
+
+    // 展開できなければ根から試行を続け、失敗した回数を返す
+    const auto stage = engine.initial_stage();
+    const auto result = engine.search(stage, MctsEngine::Budget{100, ZeroMilliSec});
+    ASSERT_EQ(100, result.n_playouts);
+    ASSERT_EQ(100, engine.root_->n_tried());
+    ASSERT_FALSE(engine.root_->expanded());
+    ASSERT_LE(engine.nodeset_.n_failed(), result.n_failed);
+    ASSERT_LT(0, result.n_failed);
+    ASSERT_EQ(result.n_failed, engine.report(stage).n_failed);
+
+    // 余裕がある置換表では失敗しない
+    MctsEngine large;
+    large.expand(large.root_);
+    ASSERT_TRUE(large.root_->expanded());
+    ASSERT_EQ(0, large.nodeset_.n_failed());
+}
+
 // 異なる手順で同じ盤面に到達する
 TEST_F(TestMctsEngine, Join) {
     MctsEngine engine;
-    Stage stage(engine.hashkeys_);
+    Stage stage(*engine.hashkeys_);
 
     auto stage12 = stage;
     auto stage21 = stage;
@@ -2331,90 +5884,1200 @@ TEST_F(TestMctsEngine, Join) {
     stage21.advance(1, 0);
     stage21.advance(3, 0);
 
-    auto node12_obj = std::make_unique<Node>(stage12);
-    auto node12 = engine.nodeset_.add(node12_obj);
+    auto node12 = engine.nodeset_.add(stage12);
     ASSERT_FALSE(node12->expanded());
     engine.expand(node12);
     ASSERT_TRUE(node12->expanded());
     ASSERT_EQ(Board::ColumnSize, node12->children().size());
 
-    auto node21_obj = std::make_unique<Node>(stage21);
-    auto node21 = engine.nodeset_.add(node21_obj);
+    auto node21 = engine.nodeset_.add(stage21);
     ASSERT_EQ(node21, node12);
     ASSERT_TRUE(node21->expanded());
     EXPECT_EQ(Board::ColumnSize, node21->children().size());
 
-    for(const auto& child : node12->children()) {
-        ASSERT_EQ(1, child->parents().size());
-        ASSERT_EQ(node12, child->parents().at(0));
+    for(const auto& child : node12->children()) {
+        ASSERT_EQ(1, child->parents().size());
+        ASSERT_EQ(node12, child->parents()[0]);
+    }
+}
+
+// 合流した局面から、全ての先祖に一回ずつ足す
+TEST_F(TestMctsEngine, BackpropagateGraph) {
+    MctsEngine engine;
+    const auto stage = engine.initial_stage();
+
+    // (0,0),(6,0),(1,0) と (1,0),(6,0),(0,0) の順に打つと合流する
+    auto stage0 = stage;
+    auto stage1 = stage;
+    engine.advance(stage0, Board::Position{0, 0});
+    engine.advance(stage1, Board::Position{1, 0});
+    stage0.advance(0, 0);
+    stage1.advance(1, 0);
+    engine.advance(stage0, Board::Position{6, 0});
+    engine.advance(stage1, Board::Position{6, 0});
+    stage0.advance(6, 0);
+    stage1.advance(6, 0);
+    engine.advance(stage0, Board::Position{1, 0});
+    engine.advance(stage1, Board::Position{0, 0});
+
+    auto stage01 = stage0;
+    stage01.advance(1, 0);
+
+    const auto node01 = engine.nodeset_.find(stage01);
+    ASSERT_TRUE(node01);
+    ASSERT_EQ(2, node01->parents().size());
+
+    // 世代を変えるので、何回足しても一回ずつ足す
+    for(Node::Count i{1}; i<=3; ++i) {
+        engine.backpropagate(node01, 2, 1, 0);
+        ASSERT_EQ(2 * i, node01->n_tried());
+        ASSERT_EQ(2 * i, engine.nodeset_.find(stage0)->n_tried());
+        ASSERT_EQ(2 * i, engine.nodeset_.find(stage1)->n_tried());
+        ASSERT_EQ(2 * i, engine.root_->n_tried());
+        ASSERT_EQ(i, engine.root_->n_first_player_won());
+        ASSERT_EQ(0, engine.root_->n_second_player_won());
+    }
+}
+
+// 探索でたどった経路のノードだけに足す
+TEST_F(TestMctsEngine, BackpropagatePath) {
+    MctsEngine::Config config;
+    config.backpropagation = MctsEngine::Backpropagation::Path;
+    MctsEngine engine(config);
+    constexpr Node::Count n_playouts = 5000;
+
+    engine.playout(engine.initial_stage(), n_playouts);
+    ASSERT_EQ(n_playouts, engine.root_->n_tried());
+    EXPECT_GT(engine.root_->n_first_player_won(), engine.root_->n_second_player_won());
+
+    // 根で展開するまでの探索以外は、ちょうど一つの子ノードをたどる
+    Node::Count n_children_tried {0};
+    for(const auto& child : engine.root_->children()) {
+        n_children_tried += child->n_tried();
+    }
+    ASSERT_EQ(n_playouts - MctsEngine::ToExpand, n_children_tried);
+    ASSERT_TRUE(engine.path_.size());
+}
+
+// 逆伝播の方法ごとに、深く探索したときの一秒あたりのplayout回数を測る
+// 経路だけに逆伝播した辺の統計は、置換表を作り直しても、他の探索を合算しても子ノードの統計に揃えない
+TEST_F(TestMctsEngine, PathEdgeCounts) {
+    MctsEngine::Config config;
+    config.backpropagation = MctsEngine::Backpropagation::Path;
+    // 左右対称な局面を同じノードにすると、ダイジェストで辺を特定できない
+    config.symmetric = false;
+    MctsEngine engine(config);
+    MctsEngine other(config, engine.hashkeys_);
+    const auto stage = engine.initial_stage();
+    engine.playout(stage, 2000);
+    other.playout(stage, 1000);
+
+    // 親子の局面のキーごとに、親ノードに並べた統計を集める
+    using EdgeCounts = std::map<std::pair<Board::HashKey, Board::HashKey>,
+                                std::pair<Node::Count, Node::Count>>;
+    const auto edge_counts = [](const MctsEngine& e) {
+        EdgeCounts counts;
+        e.nodeset_.for_each([&counts](const Node* node) {
+            const auto children = node->children();
+            for(size_t i{0}; i<children.size(); ++i) {
+                counts[{node->digest(), children[i]->digest()}] =
+                    {node->child_first_player_won(i), node->child_second_player_won(i)};
+            }
+        });
+        return counts;
+    };
+
+    // 合流したノードでは、辺の統計が子ノードの統計より少ない
+    bool differs {false};
+    engine.nodeset_.for_each([&differs](const Node* node) {
+        const auto children = node->children();
+        for(size_t i{0}; i<children.size(); ++i) {
+            differs |= (node->child_first_player_won(i) != children[i]->n_first_player_won());
+        }
+    });
+    ASSERT_TRUE(differs);
+
+    const auto expected = edge_counts(engine);
+    engine.rebuild(engine.nodeset_.capacity() * 2);
+    ASSERT_EQ(expected, edge_counts(engine));
+
+    // 両方にある辺は統計を足し、片方にある辺はその統計を残す
+    const auto other_counts = edge_counts(other);
+    engine.merge(other, stage);
+    const auto actual = edge_counts(engine);
+    Node::Count n_checked {0};
+    for(const auto& [edge, counts] : expected) {
+        auto sum = counts;
+        if (const auto it = other_counts.find(edge); it != other_counts.end()) {
+            sum.first += it->second.first;
+            sum.second += it->second.second;
+            ++n_checked;
+        }
+        ASSERT_EQ(sum, actual.at(edge));
+    }
+    ASSERT_LT(0, n_checked);
+}
+
+TEST_F(TestMctsEngine, BackpropagationSpeed) {
+    constexpr Node::Count n_playouts = 300000;
+    for(const auto backpropagation : {MctsEngine::Backpropagation::Graph,
+                                      MctsEngine::Backpropagation::Path}) {
+        MctsEngine::Config config;
+        config.backpropagation = backpropagation;
+        MctsEngine engine(config);
+
+        const MctsEngine::Budget budget {n_playouts, ZeroMilliSec};
+        const auto result = engine.search(engine.initial_stage(), budget);
+        ASSERT_EQ(n_playouts, result.n_playouts);
+        ASSERT_EQ(n_playouts, engine.root_->n_tried());
+
+        std::cout << ((backpropagation == MctsEngine::Backpropagation::Graph) ? "Graph" : "Path") <<
+            " backpropagation : " << static_cast<Node::Count>(result.playouts_per_sec()) <<
+            " playouts/sec, max depth " << result.max_depth << ", " << result.n_nodes << " nodes\n";
+    }
+}
+
+// 上まで積みあげる
+TEST_F(TestMctsEngine, ExpandColumns) {
+    MctsEngine engine;
+    Stage stage(*engine.hashkeys_);
+    constexpr auto len = Board::MinLen - 1;
+
+    for(Board::Coordinate column{0}; column < len; ++column) {
+        for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
+            stage.advance(column, height);
+        }
+
+        auto new_stage = stage;
+        auto parent = engine.nodeset_.add(new_stage);
+        ASSERT_FALSE(parent->expanded());
+        engine.expand(parent);
+        ASSERT_TRUE(parent->expanded());
+
+        if ((column + 1) == len) {
+            ASSERT_EQ(1, parent->children().size());
+            const auto& child = parent->children()[0];
+            ASSERT_FALSE(child->children().size());
+            ASSERT_EQ(1, child->parents().size());
+            ASSERT_EQ(parent, child->parents()[0]);
+        } else {
+            const auto expected = Board::ColumnSize - 1 - column;
+            ASSERT_EQ(expected, parent->children().size());
+
+            for(const auto& child : parent->children()) {
+                for(const auto& p : child->parents()) {
+                    ASSERT_FALSE(child->children().size());
+                    ASSERT_EQ(1, child->parents().size());
+                    ASSERT_EQ(parent, child->parents()[0]);
+                }
+            }
+        }
+    }
+}
+
+// 初期状態からランダムにプレイする
+// ランダムなら先手有利らしい
+TEST_F(TestMctsEngine, Play) {
+    MctsEngine engine;
+
+    std::array<Player, Stage::SizeOfPlayers> ct {0};
+    for(Node::Count i{0}; i<10000; ++i) {
+        MctsEngine::Result result = engine.play(engine.initial_stage_, 0);
+        if (result.result == Stage::Result::Won) {
+            ct.at(result.winner) += 1;
+        }
+    }
+
+    EXPECT_GT(ct.at(0), ct.at(1));
+    std::cout << "Random match 1st vs 2nd : " << ct.at(0) << " , " << ct.at(1) << "\n";
+}
+
+// 初期状態からランダムにプレイする速さを測る
+TEST_F(TestMctsEngine, PlaySpeed) {
+    MctsEngine engine;
+    constexpr Node::Count n_rollouts = 50000;
+
+    Node::Count n_moves {0};
+    const auto start_time = std::chrono::steady_clock::now();
+    for(Node::Count i{0}; i<n_rollouts; ++i) {
+        n_moves += engine.play(engine.initial_stage_, 0).depth;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+    ASSERT_LT(n_rollouts, n_moves);
+    std::cout << "rollouts : " << static_cast<Node::Count>(n_rollouts / elapsed.count()) <<
+        " /sec, " << static_cast<Node::Count>(n_moves / elapsed.count()) << " moves/sec\n";
+}
+
+// 作業用の局面をその場で進め、プレイが終わったら元に戻す
+TEST_F(TestMctsEngine, Rollout) {
+    MctsEngine engine;
+    Random gen(1);
+
+    auto stage = engine.initial_stage();
+    stage.advance(3, 0);
+    const auto expected = stage;
+
+    for(int i{0}; i<1000; ++i) {
+        const auto result = engine.rollout(stage, 1, gen);
+        ASSERT_NE(Stage::Result::Invalid, result.result);
+        ASSERT_NE(Stage::Result::Placed, result.result);
+        ASSERT_LE(1, result.depth);
+        ASSERT_EQ(expected.player(), stage.player());
+        ASSERT_EQ(expected.digest(), stage.digest());
+        ASSERT_EQ(expected.to_string(), stage.to_string());
+    }
+}
+
+// 勝負がついた局面と、一手で勝てる局面
+TEST_F(TestMctsEngine, RolloutWon) {
+    MctsEngine engine;
+    Random gen(1);
+
+    auto stage = engine.initial_stage();
+    for(Board::Coordinate height{0}; height < 3; ++height) {
+        stage.advance(0, height);
+        stage.advance(1, height);
+    }
+
+    for(int i{0}; i<100; ++i) {
+        const auto result = engine.rollout(stage, 0, gen);
+        ASSERT_EQ(Stage::Result::Won, result.result);
+        ASSERT_EQ(0, result.winner);
+        ASSERT_EQ(0, result.depth);
+    }
+
+    ASSERT_EQ(Stage::Result::Won, stage.advance(0, 3));
+    for(int i{0}; i<100; ++i) {
+        const auto result = engine.rollout(stage, 0, gen);
+        ASSERT_EQ(Stage::Result::Won, result.result);
+        ASSERT_EQ(0, result.winner);
+        ASSERT_EQ(0, result.depth);
+    }
+}
+
+// 葉の局面一つから複数回プレイする
+TEST_F(TestMctsEngine, RolloutsPerLeaf) {
+    MctsEngine::Config config;
+    config.n_rollouts = 8;
+    MctsEngine engine(config);
+    constexpr Node::Count n_playouts = 1000;
+
+    engine.playout(engine.initial_stage(), n_playouts);
+    ASSERT_EQ(n_playouts * config.n_rollouts, engine.root_->n_tried());
+    EXPECT_GT(engine.root_->n_first_player_won(), engine.root_->n_second_player_won());
+    ASSERT_TRUE(engine.root_->expanded());
+}
+
+// まとめてプレイしても、勝負がついた局面と一手で勝てる局面では必ず勝つ
+TEST_F(TestMctsEngine, RolloutBatchWon) {
+    MctsEngine::Config config;
+    config.evaluation = MctsEngine::Evaluation::Batched;
+    MctsEngine engine(config);
+    Random gen(1);
+
+    auto stage = engine.initial_stage();
+    for(Board::Coordinate height{0}; height < 3; ++height) {
+        stage.advance(0, height);
+        stage.advance(1, height);
+    }
+
+    constexpr Node::Count n_rollouts = MctsEngine::BatchSize * 3 + 1;
+    auto counts = engine.evaluate(stage, n_rollouts, gen);
+    ASSERT_EQ(n_rollouts, counts.n_first_player_won);
+    ASSERT_EQ(0, counts.n_second_player_won);
+
+    ASSERT_EQ(Stage::Result::Won, stage.advance(0, 3));
+    counts = engine.evaluate(stage, n_rollouts, gen);
+    ASSERT_EQ(n_rollouts, counts.n_first_player_won);
+    ASSERT_EQ(0, counts.n_second_player_won);
+}
+
+// まとめてプレイしても一回ずつプレイしても、勝つ割合は同じくらいになる
+TEST_F(TestMctsEngine, RolloutBatchSameAsSequential) {
+    MctsEngine sequential;
+    MctsEngine::Config config;
+    config.evaluation = MctsEngine::Evaluation::Batched;
+    MctsEngine batched(config);
+    Random gen(1);
+
+    auto stage = sequential.initial_stage();
+    stage.advance(3, 0);
+    stage.advance(3, 1);
+
+    constexpr Node::Count n_rollouts = 20000;
+    const auto expected = sequential.evaluate(stage, n_rollouts, gen);
+    const auto actual = batched.evaluate(stage, n_rollouts, gen);
+
+    ASSERT_GE(n_rollouts, actual.n_first_player_won + actual.n_second_player_won);
+    EXPECT_NEAR(expected.n_first_player_won, actual.n_first_player_won, n_rollouts / 40);
+    EXPECT_NEAR(expected.n_second_player_won, actual.n_second_player_won, n_rollouts / 40);
+}
+
+// 重いプレイで選ぶマス
+TEST_F(TestMctsEngine, HeavyMoves) {
+    const auto bit = [](Board::Coordinate column, Board::Coordinate height) {
+        return Board::to_bit(Board::to_index(column, height));
+    };
+
+    // 相手が次に勝つマスを塞ぐ
+    const Board::Cells other_row = bit(0, 0) | bit(1, 0) | bit(2, 0);
+    const Board::Cells own_row = bit(0, 1) | bit(1, 1);
+    ASSERT_EQ(bit(3, 0), MctsEngine::heavy_moves(own_row, other_row, Board::playable(own_row | other_row)));
+
+    // 相手が勝つマスの真下には打たない
+    const Board::Cells own = bit(0, 0) | bit(1, 0) | bit(2, 0) | bit(4, 0);
+    const Board::Cells other = bit(0, 1) | bit(1, 1) | bit(2, 1) | bit(6, 0);
+    const auto playable = Board::playable(own | other);
+    ASSERT_EQ(playable & ~bit(3, 0), MctsEngine::heavy_moves(own, other, playable));
+
+    // 相手が勝つマスが二つあればどちらかを塞ぐ
+    const Board::Cells other_open = bit(1, 0) | bit(2, 0) | bit(3, 0);
+    const Board::Cells own_open = bit(1, 1) | bit(2, 1);
+    ASSERT_EQ(bit(0, 0) | bit(4, 0),
+              MctsEngine::heavy_moves(own_open, other_open, Board::playable(own_open | other_open)));
+
+    // 置けるマスが全て相手が勝つマスの真下なら、全て候補にする
+    ASSERT_EQ(bit(3, 0), MctsEngine::heavy_moves(own, other, bit(3, 0)));
+    ASSERT_EQ(0, MctsEngine::heavy_moves(own, other, 0));
+}
+
+// 重いプレイでも、まとめてプレイした結果は一回ずつプレイした結果と近い
+TEST_F(TestMctsEngine, RolloutHeavyBatchSameAsSequential) {
+    MctsEngine::Config config;
+    config.rollout = MctsEngine::Rollout::Heavy;
+    MctsEngine sequential(config);
+    config.evaluation = MctsEngine::Evaluation::Batched;
+    MctsEngine batched(config);
+    MctsEngine light;
+    Random gen(1);
+
+    auto stage = sequential.initial_stage();
+    stage.advance(3, 0);
+    stage.advance(3, 1);
+
+    constexpr Node::Count n_rollouts = 20000;
+    const auto expected = sequential.evaluate(stage, n_rollouts, gen);
+    const auto actual = batched.evaluate(stage, n_rollouts, gen);
+    const auto light_counts = light.evaluate(stage, n_rollouts, gen);
+
+    ASSERT_GE(n_rollouts, actual.n_first_player_won + actual.n_second_player_won);
+    EXPECT_NEAR(expected.n_first_player_won, actual.n_first_player_won, n_rollouts / 40);
+    EXPECT_NEAR(expected.n_second_player_won, actual.n_second_player_won, n_rollouts / 40);
+
+    // 相手の勝ちを塞ぐので、引き分けが増える
+    const auto n_draws = n_rollouts - expected.n_first_player_won - expected.n_second_player_won;
+    const auto n_light_draws = n_rollouts - light_counts.n_first_player_won - light_counts.n_second_player_won;
+    ASSERT_LT(n_light_draws, n_draws);
+}
+
+// 葉の局面一つからまとめて複数回プレイする
+TEST_F(TestMctsEngine, RolloutsPerLeafBatched) {
+    MctsEngine::Config config;
+    config.n_rollouts = MctsEngine::BatchSize * 2 + 3;
+    config.evaluation = MctsEngine::Evaluation::Batched;
+    MctsEngine engine(config);
+    constexpr Node::Count n_playouts = 500;
+
+    engine.playout(engine.initial_stage(), n_playouts);
+    ASSERT_EQ(n_playouts * config.n_rollouts, engine.root_->n_tried());
+    EXPECT_GT(engine.root_->n_first_player_won(), engine.root_->n_second_player_won());
+    ASSERT_TRUE(engine.root_->expanded());
+}
+
+// 葉の局面からプレイする回数と方法ごとに、一秒あたりのプレイ回数を測る
+TEST_F(TestMctsEngine, RolloutsPerLeafSpeed) {
+    struct Setting {
+        Node::Count n_rollouts {1};
+        MctsEngine::Evaluation evaluation {MctsEngine::Evaluation::Sequential};
+        std::string name;
+    };
+
+    const std::vector<Setting> settings {
+        {1, MctsEngine::Evaluation::Sequential, "sequential x1"},
+        {MctsEngine::BatchSize, MctsEngine::Evaluation::Sequential, "sequential x8"},
+        {MctsEngine::BatchSize, MctsEngine::Evaluation::Batched, "batched x8"},
+    };
+
+    constexpr Node::Count n_games = 160000;
+    for(const auto& setting : settings) {
+        MctsEngine::Config config;
+        config.n_rollouts = setting.n_rollouts;
+        config.evaluation = setting.evaluation;
+        MctsEngine engine(config);
+
+        const auto start_time = std::chrono::steady_clock::now();
+        engine.playout(engine.initial_stage(), n_games / setting.n_rollouts);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+        ASSERT_EQ(n_games, engine.root_->n_tried());
+        std::cout << setting.name << " : " <<
+            static_cast<Node::Count>(n_games / elapsed.count()) << " games/sec, " <<
+            engine.nodeset_.size() << " nodes\n";
+    }
+}
+
+TEST_F(TestMctsEngine, Playout) {
+    MctsEngine engine;
+
+    std::array<Player, Stage::SizeOfPlayers> ct {0};
+    for(Node::Count i{0}; i<1000; ++i) {
+        engine.playout();
+    }
+
+    EXPECT_GT(engine.root_->n_first_player_won(), engine.root_->n_second_player_won());
+}
+
+// 全スレッドで一つの探索木を共有する
+TEST_F(TestMctsEngine, ParallelTree) {
+    const MctsEngine::Config config {4, MctsEngine::Parallel::Tree};
+    MctsEngine engine(config);
+    constexpr Node::Count n_playouts = 2000;
+
+    engine.playout(engine.initial_stage(), n_playouts);
+    ASSERT_EQ(n_playouts, engine.root_->n_tried());
+    EXPECT_GT(engine.root_->n_first_player_won(), engine.root_->n_second_player_won());
+    ASSERT_TRUE(engine.root_->expanded());
+
+    // 探索が終わったらvirtual lossは残らない
+    engine.nodeset_.for_each([](const Node* node) {
+        ASSERT_FALSE(node->n_virtual_loss());
+    });
+}
+
+// スレッドごとに探索木を作って合算する
+TEST_F(TestMctsEngine, ParallelRoot) {
+    // 左右を反転した局面を同じノードにすると、根の子ノードが孫ノードを共有して
+    // 子ノードの試行回数の和が根の試行回数を超えるので、まとめない
+    MctsEngine::Config config {3, MctsEngine::Parallel::Root};
+    config.symmetric = false;
+    MctsEngine engine(config);
+    constexpr Node::Count n_playouts = 2000;
+
+    engine.playout(engine.initial_stage(), n_playouts);
+    ASSERT_EQ(n_playouts, engine.root_->n_tried());
+    EXPECT_GT(engine.root_->n_first_player_won(), engine.root_->n_second_player_won());
+    ASSERT_TRUE(engine.root_->expanded());
+
+    Node::Count n_children_tried {0};
+    for(const auto& child : engine.root_->children()) {
+        n_children_tried += child->n_tried();
+        ASSERT_EQ(1, child->parents().size());
+        ASSERT_EQ(engine.root_, child->parents()[0]);
+    }
+
+    // 根だけで試行して展開しなかった回数がある
+    ASSERT_GE(n_playouts, n_children_tried);
+    ASSERT_LT(n_playouts - n_children_tried, MctsEngine::ToExpand * config.n_threads + 1);
+}
+
+// 途中の局面から探索した統計を、その先祖にも足す
+TEST_F(TestMctsEngine, Merge) {
+    MctsEngine engine;
+    MctsEngine other(MctsEngine::Config{}, engine.hashkeys_);
+
+    auto stage = engine.initial_stage();
+    engine.advance(stage, Board::Position{3, 0});
+    stage.advance(3, 0);
+
+    constexpr Node::Count n_playouts = 100;
+    other.playout(stage, n_playouts);
+    engine.merge(other, stage);
+
+    const auto node = engine.nodeset_.find(stage);
+    ASSERT_TRUE(node);
+    ASSERT_EQ(n_playouts, node->n_tried());
+    ASSERT_EQ(n_playouts, engine.root_->n_tried());
+    // どちらも初期局面を登録している
+    ASSERT_EQ(other.nodeset_.size(), engine.nodeset_.size());
+    ASSERT_EQ(other.nodeset_.find(stage)->children().size(), node->children().size());
+}
+
+// 手を確定すると、打った後の局面からたどれるノードだけ残す
+TEST_F(TestMctsEngine, Commit) {
+    MctsEngine engine;
+    engine.playout(engine.initial_stage(), 10000);
+
+    auto stage = engine.initial_stage();
+    stage.advance(3, 0);
+    const auto old_top = engine.nodeset_.find(stage);
+    ASSERT_TRUE(old_top);
+
+    // 確定した後に残るはずのノード
+    std::set<const Node*> reachable {old_top};
+    std::queue<const Node*> nodes;
+    nodes.push(old_top);
+    while(!nodes.empty()) {
+        const auto node = nodes.front();
+        nodes.pop();
+        for(const auto& child : node->children()) {
+            if (reachable.insert(child).second) {
+                nodes.push(child);
+            }
+        }
+    }
+
+    std::vector<std::tuple<Stage, Node::Count, Node::Count, Node::Count, size_t, bool>> expected;
+    for(const auto& node : reachable) {
+        expected.emplace_back(node->stage(), node->n_tried(), node->n_first_player_won(),
+                              node->n_second_player_won(), node->children().size(),
+                              node->expanded());
+    }
+
+    const auto n_nodes = engine.nodeset_.size();
+    const auto usage = engine.commit(Board::Position{3, 0});
+    ASSERT_EQ(n_nodes, usage.n_nodes_before);
+    ASSERT_EQ(reachable.size(), usage.n_nodes_after);
+    ASSERT_EQ(reachable.size(), engine.nodeset_.size());
+    ASSERT_GT(usage.n_nodes_before, usage.n_nodes_after);
+    ASSERT_GE(usage.n_bytes_before, usage.n_bytes_after);
+
+    ASSERT_EQ(stage.digest(), engine.root_->stage().digest());
+    ASSERT_EQ(stage.digest(), engine.initial_stage().digest());
+    ASSERT_TRUE(engine.root_->parents().empty());
+
+    for(const auto& [s, n_tried, n_first, n_second, n_children, expanded] : expected) {
+        const auto node = engine.nodeset_.find(s);
+        ASSERT_TRUE(node);
+        ASSERT_EQ(n_tried, node->n_tried());
+        ASSERT_EQ(n_first, node->n_first_player_won());
+        ASSERT_EQ(n_second, node->n_second_player_won());
+        ASSERT_EQ(n_children, node->children().size());
+        ASSERT_EQ(expanded, node->expanded());
+    }
+
+    // 新しい根から探索を続けられる
+    const auto n_tried = engine.root_->n_tried();
+    engine.playout(engine.initial_stage(), 1000);
+    ASSERT_EQ(n_tried + 1000, engine.root_->n_tried());
+}
+
+// 無効な手は確定しない
+TEST_F(TestMctsEngine, CommitInvalid) {
+    MctsEngine engine;
+    engine.playout(engine.initial_stage(), 1000);
+
+    const auto n_nodes = engine.nodeset_.size();
+    const auto root = engine.root_;
+    const auto usage = engine.commit(Board::Position{3, 1});
+    ASSERT_EQ(n_nodes, usage.n_nodes_before);
+    ASSERT_EQ(n_nodes, usage.n_nodes_after);
+    ASSERT_EQ(usage.n_bytes_before, usage.n_bytes_after);
+    ASSERT_EQ(root, engine.root_);
+}
+
+// 手を確定した後の置換表は、たどれるノードと次の探索に見合う大きさにする
+TEST_F(TestMctsEngine, CommitCapacity) {
+    MctsEngine::Config config;
+    MctsEngine engine(config);
+    constexpr Node::Count n_playouts = 2000;
+    const MctsEngine::Budget budget {n_playouts, ZeroMilliSec};
+    auto stage = engine.initial_stage();
+    ASSERT_EQ(0, engine.search(stage, budget).n_failed);
+    ASSERT_EQ(config.capacity, engine.nodeset_.capacity());
+
+    const auto action = engine.select(stage).value();
+    stage.advance(action.column, action.height);
+    const auto n_reachable = engine.count_reachable(stage);
+    ASSERT_LT(0, n_reachable);
+    engine.commit(stage);
+    ASSERT_EQ(n_reachable, engine.nodeset_.size());
+    ASSERT_GT(config.capacity, engine.nodeset_.capacity());
+    ASSERT_LE(n_reachable * 2, engine.nodeset_.capacity());
+    ASSERT_LE(MctsEngine::MinCapacity, engine.nodeset_.capacity());
+
+    // 同じ回数なら置換表を作り直さずに探索できる
+    const auto capacity = engine.nodeset_.capacity();
+    const auto n_tried = engine.root_->n_tried();
+    const auto result = engine.search(stage, budget);
+    ASSERT_EQ(0, result.n_failed);
+    ASSERT_EQ(capacity, engine.nodeset_.capacity());
+    ASSERT_EQ(n_tried + n_playouts, engine.root_->n_tried());
+
+    // 多く探索するなら、探索する前に大きくして統計を引き継ぐ
+    const auto n_nodes = engine.nodeset_.size();
+    const auto larger = engine.search(stage, MctsEngine::Budget{n_playouts * 20, ZeroMilliSec});
+    ASSERT_EQ(0, larger.n_failed);
+    ASSERT_LT(capacity, engine.nodeset_.capacity());
+    ASSERT_LT(n_nodes, engine.nodeset_.size());
+    ASSERT_EQ(n_tried + n_playouts * 21, engine.root_->n_tried());
+    ASSERT_EQ(stage.digest(), engine.root_->stage().digest());
+
+    // 時間で制限するなら、それまでに増えたノードの数から大きさを決める
+    engine.commit(stage);
+    const auto timed = engine.search(stage, MctsEngine::Budget{0, MilliSec{50}});
+    ASSERT_EQ(0, timed.n_failed);
+}
+
+// MCTS同士で一局対戦し、一手ごとに確定してメモリ量を表示する
+TEST_F(TestMctsEngine, CommitMatch) {
+    MctsEngine engine;
+    constexpr Node::Count n_playouts = 20000;
+
+    for(Node::Count depth{0};; ++depth) {
+        engine.playout(engine.initial_stage(), n_playouts);
+        const auto stage = engine.initial_stage();
+        const auto action = engine.select(stage);
+        if (!action.has_value()) {
+            break;
+        }
+
+        auto next_stage = stage;
+        const auto result = next_stage.advance(action.value().column, action.value().height);
+        const auto usage = engine.commit(action.value());
+        ASSERT_GE(usage.n_nodes_before, usage.n_nodes_after);
+        ASSERT_EQ(next_stage.digest(), engine.initial_stage().digest());
+
+        std::cout << "move " << depth << " : nodes " << usage.n_nodes_before << " -> " <<
+            usage.n_nodes_after << " , bytes " << usage.n_bytes_before << " -> " <<
+            usage.n_bytes_after << "\n";
+
+        if (result != Stage::Result::Placed) {
+            break;
+        }
+    }
+}
+
+// 回数を指定して探索する
+TEST_F(TestMctsEngine, SearchPlayouts) {
+    for(const auto parallel : {MctsEngine::Parallel::Tree, MctsEngine::Parallel::Root}) {
+        for(unsigned int n_threads {1}; n_threads <= 3; ++n_threads) {
+            MctsEngine engine(MctsEngine::Config{n_threads, parallel});
+            constexpr Node::Count n_playouts = 3001;
+
+            // 時間に余裕があれば回数で止まる
+            const MctsEngine::Budget budget {n_playouts, MilliSec{60000}};
+            const auto result = engine.search(engine.initial_stage(), budget);
+            ASSERT_EQ(n_playouts, result.n_playouts);
+            ASSERT_EQ(n_playouts, engine.root_->n_tried());
+            ASSERT_TRUE(result.action.has_value());
+            ASSERT_LT(0, result.max_depth);
+            ASSERT_LT(result.n_playouts, result.n_visited);
+            ASSERT_EQ(engine.nodeset_.size(), result.n_nodes);
+            ASSERT_LT(0, result.nodes_per_sec());
+        }
+    }
+}
+
+// 時間を指定して探索する
+TEST_F(TestMctsEngine, SearchTime) {
+    for(const auto parallel : {MctsEngine::Parallel::Tree, MctsEngine::Parallel::Root}) {
+        for(unsigned int n_threads {1}; n_threads <= 2; ++n_threads) {
+            MctsEngine engine(MctsEngine::Config{n_threads, parallel});
+            const MilliSec limit_msec {50};
+            const MctsEngine::Budget budget {0, limit_msec};
+            const auto result = engine.search(engine.initial_stage(), budget);
+
+            ASSERT_LT(0, result.n_playouts);
+            ASSERT_EQ(result.n_playouts, engine.root_->n_tried());
+            ASSERT_TRUE(result.action.has_value());
+            ASSERT_LE(limit_msec, result.elapsed);
+            // 時刻はCheckInterval回ごとに読むので、少し遅れて止まる
+            EXPECT_GT(limit_msec * 4, result.elapsed);
+
+            std::cout << ((parallel == MctsEngine::Parallel::Tree) ? "Tree" : "Root") <<
+                " parallel, " << n_threads << " threads : " << result.n_playouts << " playouts, " <<
+                result.n_nodes << " nodes, max depth " << result.max_depth << ", " <<
+                static_cast<Node::Count>(result.nodes_per_sec()) << " nodes/sec in " <<
+                result.elapsed.count() << " sec\n";
+        }
+    }
+}
+
+// 予算が無ければ探索しない
+TEST_F(TestMctsEngine, SearchEmptyBudget) {
+    MctsEngine engine;
+    const auto result = engine.search(engine.initial_stage(), MctsEngine::Budget{});
+    ASSERT_EQ(0, result.n_playouts);
+    ASSERT_EQ(0, engine.root_->n_tried());
+    ASSERT_EQ(1, result.n_nodes);
+    ASSERT_TRUE(result.action.has_value());
+}
+
+// 親ノードに並べた統計と表を使って選んでも、子ノードのUCB1が最大のものを選ぶ
+TEST_F(TestMctsEngine, SelectSameAsUcb1) {
+    for(const auto parallel : {MctsEngine::Parallel::Tree, MctsEngine::Parallel::Root}) {
+        MctsEngine engine(MctsEngine::Config{2, parallel});
+        engine.playout(engine.initial_stage(), 20000);
+
+        Node::Count n_checked {0};
+        engine.nodeset_.for_each([&engine, &n_checked](const Node* node) {
+            const auto children = node->children();
+            Node::Count all_tried {0};
+            for(size_t i{0}; i<children.size(); ++i) {
+                // 逆伝播とマージで、親ノードに並べた統計は子ノードの統計と一致する
+                ASSERT_EQ(children[i]->n_first_player_won(), node->child_first_player_won(i));
+                ASSERT_EQ(children[i]->n_second_player_won(), node->child_second_player_won(i));
+                ASSERT_EQ(0, node->n_virtual_loss(i));
+                all_tried += children[i]->n_first_player_won() + children[i]->n_second_player_won();
+            }
+
+            const auto index = engine.select_index(node);
+            if (children.empty()) {
+                ASSERT_EQ(Node::MaxEdges, index);
+                return;
+            }
+
+            ASSERT_GT(children.size(), index);
+            if (all_tried == 0) {
+                return;
+            }
+
+            std::vector<MctsEngine::Metric> scores;
+            for(const auto& child : children) {
+                if ((child->n_first_player_won() + child->n_second_player_won()) == 0) {
+                    return;
+                }
+                scores.push_back(engine.ucb1(node->stage().player(), all_tried, child));
+            }
+
+            const auto max_score = *std::max_element(scores.begin(), scores.end());
+            ASSERT_NEAR(max_score, scores.at(index), 1e-6 * max_score);
+            ++n_checked;
+        });
+
+        ASSERT_LT(100, n_checked);
+    }
+}
+
+// 子ノードが多いノードから子ノードを選ぶ速さを測る
+TEST_F(TestMctsEngine, SelectSpeed) {
+    // 子ノードを減らさないように、左右を反転した局面をまとめない
+    MctsEngine::Config config;
+    config.symmetric = false;
+    MctsEngine engine(config);
+    engine.playout(engine.initial_stage(), 20000);
+    ASSERT_EQ(Board::ColumnSize, engine.root_->children().size());
+
+    constexpr Node::Count n_selects = 1000000;
+    size_t checksum {0};
+    const auto start_time = std::chrono::steady_clock::now();
+    for(Node::Count i{0}; i<n_selects; ++i) {
+        checksum += (engine.select(engine.root_) != engine.root_) ? 1 : 0;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+    ASSERT_EQ(n_selects, checksum);
+    std::cout << "select : " << (elapsed.count() * 1e+9 / n_selects) << " nsec/call\n";
+}
+
+// 左右を反転した局面を同じノードにすると、同じ回数探索したときのノードが減る
+TEST_F(TestMctsEngine, SymmetricNodeCount) {
+    constexpr Node::Count n_playouts = 100000;
+    std::array<NodeSet::Size, 2> n_nodes {0, 0};
+    for(const auto symmetric : {false, true}) {
+        MctsEngine::Config config;
+        config.symmetric = symmetric;
+        MctsEngine engine(config);
+        engine.playout(engine.initial_stage(), n_playouts);
+        ASSERT_EQ(n_playouts, engine.root_->n_tried());
+        n_nodes.at(symmetric) = engine.nodeset_.size();
+    }
+
+    ASSERT_LT(n_nodes.at(1), n_nodes.at(0));
+    std::cout << "nodes for " << n_playouts << " playouts : " << n_nodes.at(0) <<
+        " (asymmetric) , " << n_nodes.at(1) << " (symmetric) , ratio " <<
+        (static_cast<double>(n_nodes.at(1)) / n_nodes.at(0)) << "\n";
+}
+
+// シードを決めれば、一つのスレッドで探索した結果は毎回同じになる
+TEST_F(TestMctsEngine, Reproducible) {
+    MctsEngine::Config config;
+    config.seed = 1;
+    MctsEngine engine1(config);
+    MctsEngine engine2(config);
+    config.seed = 2;
+    MctsEngine engine3(config);
+
+    constexpr Node::Count n_playouts = 10000;
+    const MctsEngine::Budget budget {n_playouts, ZeroMilliSec};
+    const auto result1 = engine1.search(engine1.initial_stage(), budget);
+    const auto result2 = engine2.search(engine2.initial_stage(), budget);
+    const auto result3 = engine3.search(engine3.initial_stage(), budget);
+
+    ASSERT_EQ(engine1.initial_stage().digest(), engine2.initial_stage().digest());
+    ASSERT_EQ(result1.n_nodes, result2.n_nodes);
+    ASSERT_EQ(result1.n_visited, result2.n_visited);
+    ASSERT_EQ(result1.max_depth, result2.max_depth);
+    ASSERT_EQ(result1.value, result2.value);
+    ASSERT_TRUE(result1.action.has_value());
+    ASSERT_EQ(result1.action.value().column, result2.action.value().column);
+    ASSERT_EQ(engine1.root_->n_first_player_won(), engine2.root_->n_first_player_won());
+    ASSERT_EQ(engine1.root_->n_second_player_won(), engine2.root_->n_second_player_won());
+
+    // シードが違えば統計も変わる
+    ASSERT_NE(std::make_pair(engine1.root_->n_first_player_won(), result1.n_visited),
+              std::make_pair(engine3.root_->n_first_player_won(), result3.n_visited));
+
+    // 同じ局面の選択も同じになる
+    auto stage1 = engine1.initial_stage();
+    auto stage2 = engine2.initial_stage();
+    for(int i{0}; i < 10; ++i) {
+        const auto action1 = engine1.select_random(stage1);
+        const auto action2 = engine2.select_random(stage2);
+        ASSERT_TRUE(action1.has_value());
+        ASSERT_EQ(action1.value().column, action2.value().column);
+        ASSERT_EQ(action1.value().height, action2.value().height);
+        stage1.advance(action1.value().column, action1.value().height);
+        stage2.advance(action2.value().column, action2.value().height);
     }
 }
 
-// 上まで積みあげる
-TEST_F(TestMctsEngine, ExpandColumns) {
-    MctsEngine engine;
-    Stage stage(engine.hashkeys_);
-    constexpr auto len = Board::MinLen - 1;
+// 盤面の大きさを変えても探索して対局できる
+TEST_F(TestMctsEngine, Variant) {
+    using VariantEngine = BasicMctsEngine<BasicBoard<9, 7, 5>>;
+    VariantEngine::Config config;
+    config.seed = 1;
+    VariantEngine engine(config);
 
-    for(Board::Coordinate column{0}; column < len; ++column) {
-        for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
-            stage.advance(column, height);
+    auto stage = engine.initial_stage();
+    const VariantEngine::Budget budget {200, ZeroMilliSec};
+    Node::Count n_moves {0};
+    for(;;) {
+        const auto result = engine.search(stage, budget);
+        ASSERT_TRUE(result.action.has_value());
+        const auto& action = result.action.value();
+        ASSERT_GT(9, action.column);
+
+        ++n_moves;
+        const auto advanced = stage.advance(action.column, action.height);
+        ASSERT_NE(VariantEngine::Stage::Result::Invalid, advanced);
+        if (advanced != VariantEngine::Stage::Result::Placed) {
+            break;
         }
+        engine.commit(stage);
+    }
 
-        auto new_stage = stage;
-        auto parent_obj = std::make_unique<Node>(new_stage);
-        auto parent = engine.nodeset_.add(parent_obj);
-        ASSERT_FALSE(parent->expanded());
-        engine.expand(parent);
-        ASSERT_TRUE(parent->expanded());
-
-        if ((column + 1) == len) {
-            ASSERT_EQ(1, parent->children().size());
-            const auto& child = parent->children().at(0);
-            ASSERT_FALSE(child->children().size());
-            ASSERT_EQ(1, child->parents().size());
-            ASSERT_EQ(parent, child->parents().at(0));
-        } else {
-            const auto expected = Board::ColumnSize - 1 - column;
-            ASSERT_EQ(expected, parent->children().size());
+    // 5個並べるには少なくとも9手かかる
+    ASSERT_LE(9, n_moves);
+    ASSERT_GE(63, n_moves);
+}
 
-            for(const auto& child : parent->children()) {
-                for(const auto& p : child->parents()) {
-                    ASSERT_FALSE(child->children().size());
-                    ASSERT_EQ(1, child->parents().size());
-                    ASSERT_EQ(parent, child->parents().at(0));
-                }
-            }
+// スレッド数を変えて一秒当たりのplayout回数を測る
+TEST_F(TestMctsEngine, ParallelScaling) {
+    constexpr Node::Count n_playouts = 20000;
+    const auto max_threads = std::max(2u, std::thread::hardware_concurrency());
+
+    for(const auto parallel : {MctsEngine::Parallel::Tree, MctsEngine::Parallel::Root}) {
+        for(unsigned int n_threads {1}; n_threads <= max_threads; n_threads *= 2) {
+            MctsEngine engine(MctsEngine::Config{n_threads, parallel});
+            const auto start_time = std::chrono::steady_clock::now();
+            engine.playout(engine.initial_stage(), n_playouts);
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+            ASSERT_EQ(n_playouts, engine.root_->n_tried());
+
+            std::cout << ((parallel == MctsEngine::Parallel::Tree) ? "Tree" : "Root") <<
+                " parallel, " << n_threads << " threads : " <<
+                static_cast<Node::Count>(n_playouts / elapsed.count()) << " playouts/sec\n";
         }
     }
 }
 
-// 初期状態からランダムにプレイする
-// ランダムなら先手有利らしい
-TEST_F(TestMctsEngine, Play) {
-    MctsEngine engine;
+// ノードに使うメモリの量を測る
+// 10M回にするとTestMctsEngine.MemoryFootprintは数分掛かる
+// 初期局面から一回探索するとノードは約0.13個増えるので、10M回では約130万ノードになる
+// 既定の置換表(NodeSet::DefaultCapacity = 2^20スロット)は約600万回で一杯になるので、2^22スロットにする
+TEST_F(TestMctsEngine, MemoryFootprint) {
+    constexpr Node::Count n_playouts = 100000;
+    MctsEngine::Config config;
+    config.capacity = NodeSet::Size{1} << 22;
+    MctsEngine engine(config);
+    const auto result = engine.search(engine.initial_stage(), MctsEngine::Budget{n_playouts, ZeroMilliSec});
+    ASSERT_EQ(n_playouts, result.n_playouts);
+    // 置換表が一杯になると展開できないノードが残る
+    ASSERT_EQ(0, result.n_failed);
+
+    const auto& nodeset = engine.nodeset_;
+    const auto& arena = nodeset.arena();
+    ASSERT_EQ(nodeset.size(), arena.size());
+    ASSERT_EQ((arena.size() + NodeArena::ChunkSize - 1) / NodeArena::ChunkSize, arena.n_chunks());
+
+    // ノードと親子関係を個別に確保すると、一ノード当たり少なくとも一回はヒープから確保する
+    struct rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "n_playout : " << n_playouts << "\n";
+    std::cout << "nodes : " << nodeset.size() << " , " << sizeof(Node) << " bytes/node\n";
+    std::cout << "heap allocations for nodes : " << arena.n_chunks() << "\n";
+    std::cout << "bytes for nodes and slots : " << nodeset.n_bytes() << "\n";
+    std::cout << "max RSS : " << usage.ru_maxrss << " KiB\n";
+}
 
-    std::array<Player, Stage::SizeOfPlayers> ct {0};
-    for(Node::Count i{0}; i<10000; ++i) {
-        MctsEngine::Result result = engine.play(engine.initial_stage_, 0);
-        if (result.result == Stage::Result::Won) {
-            ct.at(result.winner) += 1;
-        }
+// 探索木の統計を集める
+TEST_F(TestMctsEngine, Report) {
+    MctsEngine::Config config;
+    config.seed = 1;
+    MctsEngine engine(config);
+    const auto stage = engine.initial_stage();
+    const auto result = engine.search(stage, MctsEngine::Budget{20000, ZeroMilliSec});
+    const auto report = engine.report(stage);
+
+    ASSERT_EQ(result.n_nodes, report.n_nodes);
+    ASSERT_EQ(report.n_nodes, std::accumulate(report.depth_histogram.begin(),
+                                              report.depth_histogram.end(), NodeSet::Size{0}));
+    ASSERT_EQ(1, report.depth_histogram.at(0));
+    // 左右対称な初期局面の子ノードは4個にまとまる
+    ASSERT_EQ(4, report.depth_histogram.at(1));
+    ASSERT_LT(0, report.n_expanded);
+    ASSERT_LT(1.0, report.branching_factor);
+    ASSERT_GE(Board::ColumnSize, report.branching_factor);
+    ASSERT_LT(report.n_nodes, report.n_lookups);
+    ASSERT_LT(0.0, report.hit_rate);
+    ASSERT_GT(1.0, report.hit_rate);
+    ASSERT_LE(report.n_nodes * sizeof(Node), report.n_bytes);
+
+    // 読み筋の初手は、探索で選んだ手と同じく最も多く探索した手である
+    ASSERT_LT(1, report.principal_variation.size());
+    auto pv_stage = stage;
+    Node::Count n_tried = std::numeric_limits<Node::Count>::max();
+    for(const auto& move : report.principal_variation) {
+        ASSERT_NE(Stage::Result::Invalid, pv_stage.advance(move.action.column, move.action.height));
+        ASSERT_GE(n_tried, move.n_tried);
+        ASSERT_LE(0.0, move.value);
+        ASSERT_GE(1.0, move.value);
+        n_tried = move.n_tried;
     }
 
-    EXPECT_GT(ct.at(0), ct.at(1));
-    std::cout << "Random match 1st vs 2nd : " << ct.at(0) << " , " << ct.at(1) << "\n";
+    std::cout << "principal variation :";
+    for(const auto& move : report.principal_variation) {
+        std::cout << " " << move.action.column;
+    }
+    std::cout << "\nbranching factor : " << report.branching_factor << ", hit rate : " <<
+        report.hit_rate << ", bytes : " << report.n_bytes << "\n";
 }
 
-TEST_F(TestMctsEngine, Playout) {
+// 部分木を書き出す
+TEST_F(TestMctsEngine, Subtree) {
+    MctsEngine::Config config;
+    config.seed = 1;
+    MctsEngine engine(config);
+    const auto stage = engine.initial_stage();
+    engine.search(stage, MctsEngine::Budget{20000, ZeroMilliSec});
+
+    constexpr size_t top_k = 2;
+    constexpr size_t max_depth = 3;
+    const auto records = engine.subtree(stage, top_k, max_depth);
+    ASSERT_EQ(1 + 2 + 4 + 8, records.size());
+    ASSERT_EQ(stage.digest(), records.at(0).digest);
+    ASSERT_EQ(0, records.at(0).depth);
+
+    for(size_t i{1}; i < records.size(); ++i) {
+        const auto& record = records.at(i);
+        const auto& parent = records.at(record.parent);
+        ASSERT_LT(record.parent, i);
+        ASSERT_EQ(parent.depth + 1, record.depth);
+        ASSERT_GE(max_depth, record.depth);
+        ASSERT_GT(Board::ColumnSize, record.column);
+    }
+
+    // 兄弟は探索した回数が多い順に並ぶ
+    ASSERT_GE(records.at(1).n_tried, records.at(2).n_tried);
+
+    std::ostringstream oss;
+    MctsEngine::write_dot(oss, records);
+    const auto dot = oss.str();
+    ASSERT_EQ(0, dot.find("digraph mcts {"));
+    size_t n_edges {0};
+    for(auto pos = dot.find("->"); pos != std::string::npos; pos = dot.find("->", pos + 1)) {
+        ++n_edges;
+    }
+    ASSERT_EQ(records.size() - 1, n_edges);
+
+    const auto path = (std::filesystem::temp_directory_path() /
+                       (std::string("connect4_tree_") + std::to_string(::getpid()) + ".bin")).string();
+    ASSERT_TRUE(MctsEngine::write_subtree(path, records));
+    ASSERT_EQ(16 + records.size() * sizeof(MctsEngine::SubtreeRecord), std::filesystem::file_size(path));
+    std::filesystem::remove(path);
+}
+
+// 左右を反転して合流した子ノードでも、指定した局面の向きで手を求める
+TEST_F(TestMctsEngine, ReportMirroredChild) {
     MctsEngine engine;
+    // 両端に石がある局面は、石の置き方だけでは左右を反転したかどうか区別できない
+    auto stage = engine.initial_stage();
+    stage.advance(0, 0);
+    stage.advance(6, 0);
+
+    // 2列目に置いた子ノードを、左右を反転した局面で先に登録する
+    auto mirrored = engine.initial_stage();
+    mirrored.advance(6, 0);
+    mirrored.advance(0, 0);
+    mirrored.advance(5, 0);
+    const auto child = engine.nodeset_.add(mirrored);
+    ASSERT_TRUE(child);
+
+    const auto node = engine.nodeset_.add(stage);
+    ASSERT_TRUE(node);
+    engine.expand(node);
+    ASSERT_TRUE(node->expanded());
+    child->add_counts(10, 6, 4);
+
+    const auto report = engine.report(stage);
+    ASSERT_EQ(1, report.principal_variation.size());
+    const auto& action = report.principal_variation.at(0).action;
+    ASSERT_EQ(1, action.column);
+    auto next_stage = stage;
+    ASSERT_EQ(Stage::Result::Placed, next_stage.advance(action.column, action.height));
+    ASSERT_EQ(child, engine.nodeset_.find(next_stage));
+
+    const auto records = engine.subtree(stage, 1, 1);
+    ASSERT_EQ(2, records.size());
+    ASSERT_EQ(1, records.at(1).column);
+    ASSERT_EQ(0, records.at(1).height);
+    ASSERT_EQ(child->digest(), records.at(1).digest);
+}
 
-    std::array<Player, Stage::SizeOfPlayers> ct {0};
-    for(Node::Count i{0}; i<1000; ++i) {
-        engine.playout();
+// 探索木を保存して、別の探索エンジンで読み込んで探索を続ける
+TEST_F(TestMctsEngine, SaveAndLoad) {
+    const auto path = (std::filesystem::temp_directory_path() /
+                       (std::string("connect4_snapshot_") + std::to_string(::getpid()) + ".bin")).string();
+    constexpr Node::Count n_playouts = 5000;
+    const MctsEngine::Budget budget {n_playouts, ZeroMilliSec};
+
+    MctsEngine::Config config;
+    config.capacity = 1 << 14;
+    config.seed = 1;
+    MctsEngine saved(config);
+    auto stage = saved.initial_stage();
+    stage.advance(3, 0);
+    saved.search(saved.initial_stage(), budget);
+    saved.commit(stage);
+    saved.search(stage, budget);
+    ASSERT_TRUE(saved.save(path));
+
+    // ハッシュキーが違っても、局面から読み込める
+    config.seed = 2;
+    MctsEngine loaded(config);
+    ASSERT_TRUE(loaded.load(path));
+    std::filesystem::remove(path);
+
+    // 根は保存したときの局面になる
+    const auto loaded_stage = loaded.initial_stage();
+    ASSERT_EQ(stage.to_string(), loaded_stage.to_string());
+    ASSERT_NE(stage.digest(), loaded_stage.digest());
+
+    const auto expected = saved.report(stage);
+    const auto actual = loaded.report(loaded_stage);
+    ASSERT_EQ(expected.n_nodes, actual.n_nodes);
+    ASSERT_EQ(expected.n_expanded, actual.n_expanded);
+    ASSERT_EQ(expected.depth_histogram, actual.depth_histogram);
+    ASSERT_EQ(expected.principal_variation.size(), actual.principal_variation.size());
+    for(size_t i{0}; i < expected.principal_variation.size(); ++i) {
+        const auto& lhs = expected.principal_variation.at(i);
+        const auto& rhs = actual.principal_variation.at(i);
+        ASSERT_EQ(lhs.action.column, rhs.action.column);
+        ASSERT_EQ(lhs.n_tried, rhs.n_tried);
+        ASSERT_EQ(lhs.value, rhs.value);
     }
 
-    EXPECT_GT(engine.root_->n_first_player_won(), engine.root_->n_second_player_won());
+    const auto saved_root = saved.subtree(stage, Node::MaxEdges, 1);
+    const auto loaded_root = loaded.subtree(loaded_stage, Node::MaxEdges, 1);
+    ASSERT_EQ(saved_root.size(), loaded_root.size());
+    for(size_t i{0}; i < saved_root.size(); ++i) {
+        ASSERT_EQ(saved_root.at(i).n_tried, loaded_root.at(i).n_tried);
+        ASSERT_EQ(saved_root.at(i).n_first_player_won, loaded_root.at(i).n_first_player_won);
+        ASSERT_EQ(saved_root.at(i).column, loaded_root.at(i).column);
+    }
+
+    // 保存した統計に続けて足す
+    const auto n_tried = loaded_root.at(0).n_tried;
+    ASSERT_LE(n_playouts, n_tried);
+    loaded.search(loaded_stage, budget);
+    ASSERT_EQ(n_tried + n_playouts, loaded.subtree(loaded_stage, 1, 0).at(0).n_tried);
+}
+
+// 設定より大きな探索木を読み込んでも、半分以上空いた置換表に入れて、設定は変えない
+TEST_F(TestMctsEngine, LoadCapacity) {
+    const auto path = (std::filesystem::temp_directory_path() /
+                       (std::string("connect4_snapshot_") + std::to_string(::getpid()) + ".bin")).string();
+    const MctsEngine::Budget budget {5000, ZeroMilliSec};
+
+    MctsEngine::Config config;
+    config.capacity = 1 << 14;
+    config.seed = 1;
+    MctsEngine saved(config);
+    saved.search(saved.initial_stage(), budget);
+    const auto n_nodes = saved.nodeset_.size();
+    ASSERT_TRUE(saved.save(path));
+
+    config.capacity = 1 << 8;
+    ASSERT_LT(config.capacity, n_nodes);
+    MctsEngine loaded(config);
+    ASSERT_TRUE(loaded.load(path));
+    std::filesystem::remove(path);
+
+    ASSERT_EQ(n_nodes, loaded.nodeset_.size());
+    ASSERT_LE(n_nodes * 2, loaded.nodeset_.capacity());
+    ASSERT_EQ(config.capacity, loaded.config_.capacity);
+
+    // 探索を続けても、手を確定しても、ノードを欠かない
+    const auto stage = loaded.initial_stage();
+    ASSERT_EQ(0, loaded.search(stage, budget).n_failed);
+    auto next_stage = stage;
+    next_stage.advance(3, 0);
+    const auto n_reachable = loaded.count_reachable(next_stage);
+    loaded.commit(next_stage);
+    ASSERT_EQ(n_reachable, loaded.nodeset_.size());
+}
+
+// 読めないファイルは読み込まない
+TEST_F(TestMctsEngine, LoadInvalid) {
+    const auto path = (std::filesystem::temp_directory_path() /
+                       (std::string("connect4_snapshot_") + std::to_string(::getpid()) + ".bin")).string();
+    MctsEngine::Config config;
+    config.capacity = 1 << 12;
+    config.seed = 1;
+    MctsEngine engine(config);
+    const auto stage = engine.initial_stage();
+    engine.search(stage, MctsEngine::Budget{1000, ZeroMilliSec});
+    const auto n_nodes = engine.report(stage).n_nodes;
+
+    ASSERT_FALSE(engine.load(path));
+    {
+        std::ofstream ofs(path, std::ios::binary);
+        ofs << "C4SNAP01 but not a snapshot";
+    }
+    ASSERT_FALSE(engine.load(path));
+
+    // 途中で切れたファイル
+    ASSERT_TRUE(engine.save(path));
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+    ASSERT_FALSE(engine.load(path));
+
+    // 盤面の大きさが違う
+    using VariantEngine = BasicMctsEngine<BasicBoard<9, 7, 5>>;
+    ASSERT_TRUE(engine.save(path));
+    VariantEngine variant;
+    ASSERT_FALSE(variant.load(path));
+    std::filesystem::remove(path);
+
+    ASSERT_EQ(n_nodes, engine.report(stage).n_nodes);
+}
+
+// 探索中に他のスレッドから統計を集めても、探索を止めない
+TEST_F(TestMctsEngine, ReportDuringSearch) {
+    MctsEngine::Config config;
+    config.n_threads = 2;
+    config.seed = 1;
+    MctsEngine engine(config);
+    const auto stage = engine.initial_stage();
+
+    std::atomic<bool> done {false};
+    NodeSet::Size n_reports {0};
+    std::thread reader([&engine, &stage, &done, &n_reports]() {
+        while(!done.load()) {
+            const auto report = engine.report(stage);
+            const auto records = engine.subtree(stage, 3, 4);
+            n_reports += (report.n_nodes > 0) && !records.empty();
+        }
+    });
+
+    const auto result = engine.search(stage, MctsEngine::Budget{20000, ZeroMilliSec});
+    done.store(true);
+    reader.join();
+
+    ASSERT_EQ(20000, result.n_playouts);
+    ASSERT_LT(0, n_reports);
+    ASSERT_EQ(result.n_nodes, engine.report(stage).n_nodes);
 }
 
 // ランダム同士で対戦する
@@ -2512,12 +7175,782 @@ TEST_F(TestMctsEngine, MatchMctsOfflineRandom) {
     std::cout << "draw : " << result.n_draw << "\n";
 }
 
+// 完全読み
+class TestSolver : public ::testing::Test {
+protected:
+    // 合法手を全て調べて局面の値を求める。Solver::solve()の答え合わせに使う。
+    Solver::Score minimax(const Stage& stage) {
+        const Solver::Score n_moves = std::popcount(stage.cells(0) | stage.cells(1));
+        const auto actions = stage.legal_actions();
+        if (actions.empty()) {
+            return 0;
+        }
+
+        Solver::Score best = -Solver::MaxMoves;
+        for(const auto& action : actions) {
+            auto next = stage;
+            const auto result = next.advance(action.column, action.height);
+            if (result == Stage::Result::Won) {
+                return (Solver::MaxMoves + 1 - n_moves) / 2;
+            }
+
+            const auto score = (result == Stage::Result::Draw) ? 0 : -minimax(next);
+            best = std::max(best, score);
+        }
+
+        return best;
+    }
+
+    // 勝負が付かないように、ランダムにn_moves手打った局面を作る
+    Stage random_stage(const CommonHashKey& keys, Board::Coordinate n_moves, std::mt19937& gen) {
+        for(;;) {
+            Stage stage(keys);
+            Board::Coordinate n_placed {0};
+            for(; n_placed < n_moves; ++n_placed) {
+                // 勝つ手を除く
+                const auto winning = stage.winning_moves();
+                std::vector<Board::Position> actions;
+                for(const auto& action : stage.legal_actions()) {
+                    if (!(winning & Board::to_bit(Board::to_index(action.column, action.height)))) {
+                        actions.push_back(action);
+                    }
+                }
+
+                if (actions.empty()) {
+                    break;
+                }
+
+                std::uniform_int_distribution<size_t> dist(0, actions.size() - 1);
+                const auto& action = actions.at(dist(gen));
+                if (stage.advance(action.column, action.height) != Stage::Result::Placed) {
+                    break;
+                }
+            }
+
+            if (n_placed == n_moves) {
+                return stage;
+            }
+        }
+    }
+};
+
+// 局面のキーは手番の石の配置と列の高さを区別する
+TEST_F(TestSolver, Key) {
+    const auto a = Board::to_bit(Board::to_index(0, 0));
+    const auto b = Board::to_bit(Board::to_index(0, 1));
+    const auto c = Board::to_bit(Board::to_index(1, 0));
+
+    std::set<uint64_t> keys;
+    keys.insert(Solver::key(0, 0));
+    keys.insert(Solver::key(0, a));
+    keys.insert(Solver::key(a, a));
+    keys.insert(Solver::key(0, a | b));
+    keys.insert(Solver::key(a, a | b));
+    keys.insert(Solver::key(b, a | b));
+    keys.insert(Solver::key(a | b, a | b));
+    keys.insert(Solver::key(0, c));
+    keys.insert(Solver::key(c, a | c));
+    keys.insert(Solver::key(a, a | c));
+    ASSERT_EQ(10, keys.size());
+
+    // 最も高い列でも隣の列に繰り上がらない
+    Board::Cells full {0};
+    for(Board::Coordinate height{0}; height < Board::MaxHeight; ++height) {
+        full |= Board::to_bit(Board::to_index(0, height));
+    }
+    ASSERT_EQ(Board::to_bit(Board::to_index(0, Board::MaxHeight)), Solver::key(0, full) + 1);
+    ASSERT_GT(Board::to_bit(Board::to_index(1, 0)), Solver::key(full, full));
+}
+
+// 負けない手
+TEST_F(TestSolver, NonLosingMoves) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+
+    {
+        // 何も無ければ全ての列に打てる
+        Stage stage(keys);
+        const auto mask = stage.cells(0) | stage.cells(1);
+        ASSERT_EQ(stage.playable(), Solver::non_losing_moves(0, mask));
+    }
+
+    {
+        // 後手が横に三つ並べたので、先手はその左右のどちらかを防ぐしかないが両方は防げない
+        Stage stage(keys);
+        for(const auto& [column, height] : std::vector<std::pair<int, int>>{
+                {6, 0}, {1, 0}, {6, 1}, {2, 0}, {5, 0}, {3, 0}}) {
+            ASSERT_EQ(Stage::Result::Placed, stage.advance(column, height));
+        }
+
+        ASSERT_EQ(0, stage.player());
+        const auto current = stage.cells(0);
+        const auto mask = current | stage.cells(1);
+        ASSERT_EQ(0, Solver::non_losing_moves(current, mask));
+    }
+
+    {
+        // 後手が縦に三つ並べたので、先手はその上に打つしかない
+        Stage stage(keys);
+        for(const auto& [column, height] : std::vector<std::pair<int, int>>{
+                {0, 0}, {3, 0}, {0, 1}, {3, 1}, {6, 0}, {3, 2}}) {
+            ASSERT_EQ(Stage::Result::Placed, stage.advance(column, height));
+        }
+
+        const auto current = stage.cells(0);
+        const auto mask = current | stage.cells(1);
+        ASSERT_EQ(Board::to_bit(Board::to_index(3, 3)), Solver::non_losing_moves(current, mask));
+    }
+
+    {
+        // 後手は(1,1)と(5,1)に打てば勝つので、先手はその真下の(1,0)と(5,0)に打たない
+        Stage stage(keys);
+        for(const auto& [column, height] : std::vector<std::pair<int, int>>{
+                {2, 0}, {2, 1}, {3, 0}, {3, 1}, {4, 0}, {4, 1}}) {
+            ASSERT_EQ(Stage::Result::Placed, stage.advance(column, height));
+        }
+
+        ASSERT_EQ(0, stage.player());
+        const auto current = stage.cells(0);
+        const auto mask = current | stage.cells(1);
+        const auto below = Board::to_bit(Board::to_index(1, 0)) | Board::to_bit(Board::to_index(5, 0));
+        ASSERT_EQ(stage.playable() & ~below, Solver::non_losing_moves(current, mask));
+    }
+}
+
+// 勝つマスを多く作る手、中央に近い手の順に並べる
+TEST_F(TestSolver, OrderedMoves) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+
+    {
+        const auto [moves, size] = Solver::ordered_moves(0, 0, stage.playable());
+        ASSERT_EQ(Board::ColumnSize, size);
+        for(size_t i{0}; i < size; ++i) {
+            const auto expected = Board::to_bit(Board::to_index(Solver::ColumnOrder.at(i), 0));
+            ASSERT_EQ(expected, moves.at(i).second);
+            ASSERT_EQ(0, moves.at(i).first);
+        }
+    }
+
+    // 先手が(0,0),(1,0)に置いていれば、(2,0)か(3,0)に置くと勝つマスが一つできる
+    for(const auto& [column, height] : std::vector<std::pair<int, int>>{
+            {0, 0}, {6, 0}, {1, 0}, {6, 1}}) {
+        ASSERT_EQ(Stage::Result::Placed, stage.advance(column, height));
+    }
+
+    const auto current = stage.cells(0);
+    const auto mask = current | stage.cells(1);
+    const auto [moves, size] = Solver::ordered_moves(current, mask, stage.playable());
+    ASSERT_EQ(Board::ColumnSize, size);
+    ASSERT_EQ(Board::to_bit(Board::to_index(3, 0)), moves.at(0).second);
+    ASSERT_EQ(1, moves.at(0).first);
+    ASSERT_EQ(Board::to_bit(Board::to_index(2, 0)), moves.at(1).second);
+    ASSERT_EQ(1, moves.at(1).first);
+    ASSERT_EQ(Board::to_bit(Board::to_index(4, 0)), moves.at(2).second);
+    ASSERT_EQ(0, moves.at(2).first);
+}
+
+// 置換表
+TEST_F(TestSolver, TranspositionTable) {
+    Solver::TranspositionTable table(4);
+    ASSERT_EQ(0, table.get(1));
+
+    table.put(1, 2);
+    table.put(3, 4);
+    ASSERT_EQ(2, table.get(1));
+    ASSERT_EQ(4, table.get(3));
+    ASSERT_EQ(0, table.get(5));
+
+    table.put(1, 5);
+    ASSERT_EQ(5, table.get(1));
+
+    table.clear();
+    ASSERT_EQ(0, table.get(1));
+    ASSERT_EQ(0, table.get(3));
+}
+
+// 勝ち、負け、引き分けが決まっている局面
+TEST_F(TestSolver, Solve) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Solver solver;
+
+    {
+        // 先手が縦に三つ並べたので、次に打つと勝つ
+        Stage stage(keys);
+        for(const auto& [column, height] : std::vector<std::pair<int, int>>{
+                {0, 0}, {6, 0}, {0, 1}, {6, 1}, {0, 2}, {5, 0}}) {
+            ASSERT_EQ(Stage::Result::Placed, stage.advance(column, height));
+        }
+        ASSERT_EQ((Solver::MaxMoves + 1 - 6) / 2, solver.solve(stage));
+    }
+
+    {
+        // 後手は横の三つの左右を両方防げないので、先手の次の手で負ける
+        Stage stage(keys);
+        for(const auto& [column, height] : std::vector<std::pair<int, int>>{
+                {1, 0}, {1, 1}, {2, 0}, {2, 1}, {3, 0}}) {
+            ASSERT_EQ(Stage::Result::Placed, stage.advance(column, height));
+        }
+        ASSERT_EQ(-(Solver::MaxMoves - 5) / 2, solver.solve(stage));
+    }
+}
+
+// 終盤の局面では、全ての合法手を調べた値と一致する
+TEST_F(TestSolver, SameAsMinimax) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    std::mt19937 gen(1);
+    Solver solver(16);
+
+    constexpr int n_trials = 100;
+    constexpr Board::Coordinate n_moves = 30;
+    std::array<int, 3> n_results {0, 0, 0};
+    for(int i{0}; i < n_trials; ++i) {
+        const auto stage = random_stage(keys, n_moves, gen);
+        const auto expected = minimax(stage);
+        solver.reset();
+        ASSERT_EQ(expected, solver.solve(stage));
+        n_results.at((expected > 0) ? 0 : ((expected < 0) ? 1 : 2)) += 1;
+    }
+
+    std::cout << "win, loss, draw : " << n_results.at(0) << " , " <<
+        n_results.at(1) << " , " << n_results.at(2) << "\n";
+}
+
+// 12手打った局面を数秒以内に解く
+TEST_F(TestSolver, SolveSpeed) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    std::mt19937 gen(2);
+    Solver solver;
+
+    constexpr int n_trials = 10;
+    constexpr Board::Coordinate n_moves = 12;
+    for(int i{0}; i < n_trials; ++i) {
+        // 次の一手で勝てる局面は探索しないので除く
+        auto stage = random_stage(keys, n_moves, gen);
+        while(stage.winning_moves()) {
+            stage = random_stage(keys, n_moves, gen);
+        }
+        solver.reset();
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto score = solver.solve(stage);
+        const auto elapsed = std::chrono::duration_cast<MilliSec>(
+            std::chrono::steady_clock::now() - start);
+
+        ASSERT_GE(score, Solver::MinScore);
+        ASSERT_LE(score, Solver::MaxScore);
+        ASSERT_GT(solver.n_nodes(), 0);
+        ASSERT_LT(elapsed.count(), 10000);
+        std::cout << "score " << score << " , " << solver.n_nodes() << " nodes in " <<
+            elapsed.count() << " msec\n";
+    }
+}
+
+// 定石
+class TestOpeningBook : public ::testing::Test {
+protected:
+    // テストで書き出すファイル
+    std::string path_;
+
+    void SetUp() override {
+        const auto name = std::string("connect4_book_") + std::to_string(::getpid()) + ".bin";
+        path_ = (std::filesystem::temp_directory_path() / name).string();
+    }
+
+    void TearDown() override {
+        std::error_code ec;
+        std::filesystem::remove(path_, ec);
+    }
+};
+
+// 左右を反転した局面は同じキーになる
+TEST_F(TestOpeningBook, CanonicalKey) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+    Stage mirrored(keys);
+
+    const auto [initial_key, initial_mirrored] = OpeningBook::canonical_key(stage);
+    ASSERT_FALSE(initial_mirrored);
+
+    std::set<OpeningBook::Key> book_keys {initial_key};
+    for(const auto& [column, height] : std::vector<std::pair<int, int>>{{0, 0}, {1, 0}, {1, 1}}) {
+        ASSERT_EQ(Stage::Result::Placed, stage.advance(column, height));
+        ASSERT_EQ(Stage::Result::Placed, mirrored.advance(Board::ColumnSize - 1 - column, height));
+
+        const auto [key, is_mirrored] = OpeningBook::canonical_key(stage);
+        const auto [mirrored_key, is_mirrored_mirrored] = OpeningBook::canonical_key(mirrored);
+        ASSERT_EQ(key, mirrored_key);
+        ASSERT_NE(is_mirrored, is_mirrored_mirrored);
+        book_keys.insert(key);
+    }
+    ASSERT_EQ(4, book_keys.size());
+
+    // 石の配置が同じでも手番が違えば別のキーになる
+    Stage first(keys);
+    Stage second(keys);
+    ASSERT_EQ(Stage::Result::Placed, first.advance(3, 0));
+    ASSERT_EQ(Stage::Result::Placed, first.advance(3, 1));
+    ASSERT_EQ(Stage::Result::Placed, second.advance(3, 0));
+    ASSERT_NE(OpeningBook::canonical_key(first).first, OpeningBook::canonical_key(second).first);
+}
+
+// 定石を作ってファイルに書き出し、メモリにマップして引く
+TEST_F(TestOpeningBook, WriteAndFind) {
+    MctsEngine engine;
+    constexpr Board::Coordinate max_ply = 2;
+    const auto entries = OpeningBook::generate(engine, max_ply, MctsEngine::Budget{200, ZeroMilliSec});
+
+    // 初期局面、一手目は反転を除いて4通り。
+    // 二手目は49通りのうち、中央に二つ重ねた局面だけが左右対称なので(49 - 1) / 2 + 1通り
+    ASSERT_EQ(1 + 4 + 25, entries.size());
+    ASSERT_TRUE(OpeningBook::write(path_, entries));
+    ASSERT_EQ(16 + entries.size() * sizeof(OpeningBook::Entry), std::filesystem::file_size(path_));
+
+    OpeningBook book(path_);
+    ASSERT_EQ(entries.size(), book.size());
+
+    // 二手目までの全ての局面を、反転した向きからも引ける
+    auto stage = engine.initial_stage();
+    ASSERT_TRUE(book.find(stage).has_value());
+    for(const auto& first : stage.legal_actions()) {
+        auto first_stage = stage;
+        ASSERT_EQ(Stage::Result::Placed, first_stage.advance(first.column, first.height));
+        const auto first_move = book.find(first_stage);
+        ASSERT_TRUE(first_move.has_value());
+
+        // 反転した局面の最善手は、反転した列にある。左右対称な局面は同じ列を返す。
+        const auto mirrored_column = Board::ColumnSize - 1 - first.column;
+        auto mirrored_stage = stage;
+        ASSERT_EQ(Stage::Result::Placed, mirrored_stage.advance(mirrored_column, first.height));
+        const auto mirrored_move = book.find(mirrored_stage);
+        ASSERT_TRUE(mirrored_move.has_value());
+        if (mirrored_column != first.column) {
+            ASSERT_EQ(Board::ColumnSize - 1 - first_move.value().action.column,
+                      mirrored_move.value().action.column);
+        }
+        ASSERT_EQ(first_move.value().action.height, mirrored_move.value().action.height);
+        ASSERT_EQ(first_move.value().value, mirrored_move.value().value);
+
+        for(const auto& second : first_stage.legal_actions()) {
+            auto second_stage = first_stage;
+            ASSERT_EQ(Stage::Result::Placed, second_stage.advance(second.column, second.height));
+            const auto second_move = book.find(second_stage);
+            ASSERT_TRUE(second_move.has_value());
+            ASSERT_GE(second_move.value().value, 0.0f);
+            ASSERT_LE(second_move.value().value, 1.0f);
+
+            // 三手目は登録していない
+            auto third_stage = second_stage;
+            const auto& third = second_move.value().action;
+            ASSERT_EQ(Stage::Result::Placed, third_stage.advance(third.column, third.height));
+            ASSERT_FALSE(book.find(third_stage).has_value());
+        }
+    }
+}
+
+// 局面ごとに根を移すので、全ての局面の探索木は入らない置換表でもノードを欠かずに探索する
+TEST_F(TestOpeningBook, GenerateSmallTable) {
+    MctsEngine::Config config;
+    config.capacity = 1 << 12;
+    MctsEngine engine(config);
+    constexpr Board::Coordinate max_ply = 4;
+    const MctsEngine::Budget budget {100, ZeroMilliSec};
+    NodeSet::Size n_failed {1};
+    const auto entries = OpeningBook::generate(engine, max_ply, budget, &n_failed);
+    ASSERT_EQ(0, n_failed);
+
+    MctsEngine large;
+    ASSERT_EQ(OpeningBook::generate(large, max_ply, budget).size(), entries.size());
+}
+
+// 読めないファイルは空の定石になる
+TEST_F(TestOpeningBook, InvalidFile) {
+    CommonHashKey keys(Stage::SizeOfPlayers);
+    Stage stage(keys);
+
+    {
+        OpeningBook book(path_);
+        ASSERT_EQ(0, book.size());
+        ASSERT_FALSE(book.find(stage).has_value());
+    }
+
+    {
+        std::ofstream ofs(path_, std::ios::binary);
+        ofs << "not a book file";
+    }
+
+    {
+        OpeningBook book(path_);
+        ASSERT_EQ(0, book.size());
+        ASSERT_FALSE(book.find(stage).has_value());
+    }
+
+    // 定石の数とファイルの大きさが合わない
+    ASSERT_TRUE(OpeningBook::write(path_, {OpeningBook::Entry{}}));
+    std::filesystem::resize_file(path_, std::filesystem::file_size(path_) - 1);
+    OpeningBook book(path_);
+    ASSERT_EQ(0, book.size());
+}
+
+// 定石を引く速さを測る
+TEST_F(TestOpeningBook, FindSpeed) {
+    MctsEngine engine;
+    const auto entries = OpeningBook::generate(engine, 4, MctsEngine::Budget{1, ZeroMilliSec});
+    ASSERT_TRUE(OpeningBook::write(path_, entries));
+
+    const auto start = std::chrono::steady_clock::now();
+    OpeningBook book(path_);
+    const auto opened = std::chrono::steady_clock::now();
+    ASSERT_EQ(entries.size(), book.size());
+
+    constexpr int n_trials = 100000;
+    std::mt19937 gen(1);
+    size_t n_found {0};
+    for(int i{0}; i < n_trials; ++i) {
+        auto stage = engine.initial_stage();
+        for(int ply{0}; ply < 4; ++ply) {
+            const auto actions = stage.legal_actions();
+            std::uniform_int_distribution<size_t> dist(0, actions.size() - 1);
+            const auto& action = actions.at(dist(gen));
+            stage.advance(action.column, action.height);
+        }
+        n_found += book.find(stage).has_value();
+    }
+    const auto stop = std::chrono::steady_clock::now();
+    ASSERT_EQ(n_trials, n_found);
+
+    std::cout << book.size() << " positions opened in " <<
+        std::chrono::duration_cast<std::chrono::microseconds>(opened - start).count() << " usec, " <<
+        n_trials << " random plays and lookups in " <<
+        std::chrono::duration_cast<MilliSec>(stop - opened).count() << " msec\n";
+}
+
+// 自己対戦
+class TestTournament : public ::testing::Test {};
+
+// 得点率とEloレーティングの差
+TEST_F(TestTournament, Elo) {
+    ASSERT_DOUBLE_EQ(0.0, Tournament::to_elo(0.5));
+    ASSERT_NEAR(190.85, Tournament::to_elo(0.75), 0.01);
+    ASSERT_NEAR(-190.85, Tournament::to_elo(0.25), 0.01);
+    ASSERT_TRUE(std::isinf(Tournament::to_elo(0.0)));
+    ASSERT_TRUE(std::isinf(Tournament::to_elo(1.0)));
+
+    Tournament::Result result;
+    ASSERT_DOUBLE_EQ(0.5, result.score());
+    ASSERT_DOUBLE_EQ(0.0, result.score_stderr());
+
+    // 30勝10敗
+    Tournament::Game win;
+    win.winner = 0;
+    Tournament::Game loss;
+    loss.winner = 1;
+    for(int i{0}; i < 30; ++i) {
+        result.add(win);
+    }
+    for(int i{0}; i < 10; ++i) {
+        result.add(loss);
+    }
+
+    ASSERT_EQ(40, result.n_games);
+    ASSERT_DOUBLE_EQ(0.75, result.score());
+    ASSERT_NEAR(std::sqrt(0.75 * 0.25 / 40), result.score_stderr(), 1e-12);
+    const auto [lower, upper] = result.elo_interval();
+    ASSERT_LT(lower, result.elo());
+    ASSERT_GT(upper, result.elo());
+    ASSERT_LT(0.0, lower);
+
+    // 引き分けを加えると得点率が0.5に近づき、ばらつきは減る
+    const auto stderr_before = result.score_stderr();
+    result.add(Tournament::Game{});
+    ASSERT_EQ(1, result.n_draws);
+    ASSERT_DOUBLE_EQ(30.5 / 41, result.score());
+    ASSERT_GT(stderr_before, result.score_stderr());
+}
+
+// 探索回数が多い設定の方が強い。シードを決めるとスレッド数によらず同じ結果になる。
+TEST_F(TestTournament, Run) {
+    Tournament::Entrant strong;
+    strong.config.capacity = 1 << 14;
+    strong.budget.n_playouts = 20;
+    Tournament::Entrant weak;
+    weak.config.capacity = 1 << 14;
+    weak.budget.n_playouts = 1;
+
+    constexpr Tournament::Count n_games = 200;
+    const Tournament single(strong, weak, 1, 1);
+    const Tournament multi(strong, weak, 4, 1);
+    const auto expected = single.run(n_games);
+    const auto actual = multi.run(n_games);
+
+    ASSERT_EQ(n_games, expected.n_games);
+    ASSERT_EQ(n_games, expected.n_wins + expected.n_losses + expected.n_draws);
+    ASSERT_EQ(expected.n_wins, actual.n_wins);
+    ASSERT_EQ(expected.n_losses, actual.n_losses);
+    ASSERT_EQ(expected.n_draws, actual.n_draws);
+    ASSERT_EQ(expected.n_moves, actual.n_moves);
+    ASSERT_EQ(expected.n_playouts, actual.n_playouts);
+    ASSERT_EQ(expected.n_moves, expected.n_searches.at(0) + expected.n_searches.at(1));
+
+    ASSERT_GT(expected.n_wins, expected.n_losses);
+    ASSERT_LT(0.0, expected.elo());
+    ASSERT_NEAR(20.0, expected.playouts_per_move(0), 1e-6);
+    ASSERT_NEAR(1.0, expected.playouts_per_move(1), 1e-6);
+
+    const auto [lower, upper] = expected.elo_interval();
+    std::cout << "win, loss, draw : " << expected.n_wins << " , " << expected.n_losses <<
+        " , " << expected.n_draws << "\n";
+    std::cout << "Elo difference : " << expected.elo() << " [" << lower << " , " << upper << "]\n";
+    std::cout << expected.games_per_sec() << " games/sec (1 thread), " <<
+        actual.games_per_sec() << " games/sec (4 threads)\n";
+}
+
+class TestEnginePool : public ::testing::Test {};
+
+// 同時に作って対局しても、一つずつ対局した結果と同じになる
+// make tsan でThreadSanitizerを有効にして実行する
+TEST_F(TestEnginePool, PlaySameAsSequential) {
+    MctsEngine::Config config;
+    config.capacity = 1 << 14;
+    config.seed = 1;
+    constexpr EnginePool::Size n_engines = 4;
+    const MctsEngine::Budget budget {100, ZeroMilliSec};
+
+    EnginePool pool(config, n_engines);
+    ASSERT_EQ(n_engines, pool.size());
+    for(EnginePool::Size i{0}; i < n_engines; ++i) {
+        MctsEngine engine(EnginePool::engine_config(config, i));
+        ASSERT_EQ(engine.initial_stage().digest(), pool.engine(i).initial_stage().digest());
+    }
+
+    const auto games = pool.play(budget);
+    ASSERT_EQ(n_engines, games.size());
+
+    std::set<std::vector<Board::Coordinate>> different;
+    for(EnginePool::Size i{0}; i < n_engines; ++i) {
+        MctsEngine engine(EnginePool::engine_config(config, i));
+        const auto expected = EnginePool::play(engine, budget);
+        const auto& actual = games.at(i);
+
+        ASSERT_EQ(expected.winner, actual.winner);
+        ASSERT_EQ(expected.n_playouts, actual.n_playouts);
+        ASSERT_EQ(expected.moves.size(), actual.moves.size());
+        ASSERT_LE(7, actual.moves.size());
+        std::vector<Board::Coordinate> columns;
+        for(size_t move{0}; move < actual.moves.size(); ++move) {
+            ASSERT_EQ(expected.moves.at(move).column, actual.moves.at(move).column);
+            ASSERT_EQ(expected.moves.at(move).height, actual.moves.at(move).height);
+            columns.push_back(actual.moves.at(move).column);
+        }
+        different.insert(columns);
+    }
+
+    // シードが違うので、局ごとに違う手順になる
+    ASSERT_LT(1, different.size());
+}
+
+// 続けて対局しても、前の局の終盤からではなく初期局面から終局まで対局する
+// 同じシードのエンジンで同じ回数対局すれば、同じ手順になる
+TEST_F(TestEnginePool, PlayTwice) {
+    MctsEngine::Config config;
+    config.capacity = 1 << 14;
+    config.seed = 1;
+    constexpr EnginePool::Size n_engines = 2;
+    const MctsEngine::Budget budget {100, ZeroMilliSec};
+
+    EnginePool pool(config, n_engines);
+    EnginePool same_seed(config, n_engines);
+    for(int round{0}; round < 2; ++round) {
+        const auto games = pool.play(budget);
+        const auto expected = same_seed.play(budget);
+        ASSERT_EQ(n_engines, games.size());
+
+        for(EnginePool::Size i{0}; i < n_engines; ++i) {
+            const auto& actual = games.at(i);
+            ASSERT_EQ(expected.at(i).winner, actual.winner);
+            ASSERT_EQ(expected.at(i).moves.size(), actual.moves.size());
+            ASSERT_LE(7, actual.moves.size());
+
+            // 初期局面から打ち直すと、最後の手で勝つか盤面が埋まる
+            auto stage = pool.engine(i).empty_stage();
+            ASSERT_EQ(0, stage.cells(0) | stage.cells(1));
+            for(size_t move{0}; move < actual.moves.size(); ++move) {
+                const auto& action = actual.moves.at(move);
+                ASSERT_EQ(expected.at(i).moves.at(move).column, action.column);
+                ASSERT_EQ(expected.at(i).moves.at(move).height, action.height);
+                const auto result = stage.advance(action.column, action.height);
+                const bool last = (move + 1 == actual.moves.size());
+                ASSERT_EQ((last && actual.winner.has_value()) ? Stage::Result::Won : Stage::Result::Placed,
+                          result);
+            }
+
+            if (!actual.winner.has_value()) {
+                ASSERT_TRUE(stage.legal_actions().empty());
+            }
+        }
+    }
+}
+
+// 重いプレイと軽いプレイを、同じ探索回数と同じ時間で対局させる
+TEST_F(TestTournament, HeavyRollout) {
+    Tournament::Entrant heavy;
+    heavy.config.capacity = 1 << 14;
+    heavy.config.rollout = MctsEngine::Rollout::Heavy;
+    heavy.budget.n_playouts = 200;
+    Tournament::Entrant light;
+    light.config.capacity = 1 << 14;
+    light.budget.n_playouts = 200;
+
+    constexpr Tournament::Count n_games = 100;
+    const auto same_playouts = Tournament(heavy, light, 1, 1).run(n_games);
+    ASSERT_EQ(n_games, same_playouts.n_games);
+    ASSERT_GT(same_playouts.n_wins, same_playouts.n_losses);
+
+    // CPU時間あたりの強さを比べる。時間で止めるので結果は実行ごとに変わる。
+    heavy.budget = MctsEngine::Budget{0, MilliSec{2}};
+    light.budget = MctsEngine::Budget{0, MilliSec{2}};
+    const auto same_time = Tournament(heavy, light, 1, 1).run(20);
+    ASSERT_EQ(20, same_time.n_games);
+
+    for(const auto& [name, result] : {std::make_pair("same playouts", same_playouts),
+                                      std::make_pair("same time", same_time)}) {
+        std::cout << name << " : heavy win, loss, draw : " << result.n_wins << " , " <<
+            result.n_losses << " , " << result.n_draws << ", Elo difference : " << result.elo() <<
+            ", playouts/move : " << result.playouts_per_move(0) << " , " <<
+            result.playouts_per_move(1) << "\n";
+    }
+}
+
 int main(int argc, char* argv[]) {
     if (argc <= 1) {
         ::testing::InitGoogleTest(&argc, argv);
         return RUN_ALL_TESTS();
     }
 
+    // 定石を作る: connect4 book 手数 ファイル名 [一局面あたりの探索回数]
+    if ((argc >= 4) && (std::string(argv[1]) == "book")) {
+        const Board::Coordinate max_ply = std::stoi(argv[2]);
+        const std::string path {argv[3]};
+        const Node::Count n_playouts = (argc >= 5) ? std::stoull(argv[4]) : 10000;
+
+        MctsEngine engine;
+        NodeSet::Size n_failed {0};
+        const auto entries = OpeningBook::generate(engine, max_ply, MctsEngine::Budget{n_playouts, ZeroMilliSec},
+                                                   &n_failed);
+        if (n_failed) {
+            std::cout << "transposition table full : " << n_failed << " nodes not added\n";
+        }
+
+        if (!OpeningBook::write(path, entries)) {
+            std::cerr << "Cannot write " << path << "\n";
+            return 1;
+        }
+
+        std::cout << entries.size() << " positions written to " << path << "\n";
+        return 0;
+    }
+
+    // 自己対戦する: connect4 tournament 対局数 探索回数1 探索回数2 [スレッド数 [シード]]
+    if ((argc >= 5) && (std::string(argv[1]) == "tournament")) {
+        const Tournament::Count n_games = std::stoull(argv[2]);
+        std::array<Tournament::Entrant, Tournament::SizeOfEntrants> entrants;
+        for(Player i{0}; i < Tournament::SizeOfEntrants; ++i) {
+            entrants.at(i).config.capacity = 1 << 16;
+            entrants.at(i).budget.n_playouts = std::stoull(argv[3 + i]);
+        }
+        const unsigned int n_threads = (argc >= 6) ? std::stoul(argv[5]) :
+            std::max(1u, std::thread::hardware_concurrency());
+        const auto seed = (argc >= 7) ? std::optional<Random::Seed>(std::stoull(argv[6])) : std::nullopt;
+
+        const Tournament tournament(entrants.at(0), entrants.at(1), n_threads, seed);
+        const auto result = tournament.run(n_games);
+        const auto [elo_lower, elo_upper] = result.elo_interval();
+        std::cout << "games : " << result.n_games << " (" << result.games_per_sec() << " games/sec)\n";
+        std::cout << "win, loss, draw : " << result.n_wins << " , " << result.n_losses <<
+            " , " << result.n_draws << "\n";
+        std::cout << "playouts/move : " << result.playouts_per_move(0) << " , " <<
+            result.playouts_per_move(1) << "\n";
+        std::cout << "Elo difference : " << result.elo() << " [" << elo_lower << " , " <<
+            elo_upper << "] (95%)\n";
+        return 0;
+    }
+
+    // 初期局面を探索して統計を表示し、部分木を書き出す: connect4 analyze 探索回数 [DOTファイル名]
+    if ((argc >= 3) && (std::string(argv[1]) == "analyze")) {
+        MctsEngine engine;
+        const auto stage = engine.initial_stage();
+        const auto result = engine.search(stage, MctsEngine::Budget{std::stoll(argv[2]), ZeroMilliSec});
+        const auto report = engine.report(stage);
+
+        std::cout << "principal variation :";
+        for(const auto& move : report.principal_variation) {
+            std::cout << " " << move.action.column << "(" << move.n_tried << "," << move.value << ")";
+        }
+        std::cout << "\nnodes : " << report.n_nodes << " (" << report.n_bytes << " bytes), expanded : " <<
+            report.n_expanded << ", branching factor : " << report.branching_factor << "\n";
+        std::cout << "transposition hit rate : " << report.hit_rate << " (" << report.n_lookups << " lookups)\n";
+        if (result.n_failed) {
+            std::cout << "transposition table full : " << result.n_failed << " nodes not added\n";
+        }
+        std::cout << "depth histogram :";
+        for(const auto n : report.depth_histogram) {
+            std::cout << " " << n;
+        }
+        std::cout << "\n" << result.playouts_per_sec() << " playouts/sec\n";
+
+        if (argc >= 4) {
+            std::ofstream ofs(argv[3]);
+            MctsEngine::write_dot(ofs, engine.subtree(stage, 3, 4));
+        }
+        return 0;
+    }
+
+    // 保存した探索木があれば読み込んで探索を続け、保存し直す: connect4 resume ファイル名 探索回数
+    if ((argc >= 4) && (std::string(argv[1]) == "resume")) {
+        const std::string path {argv[2]};
+        MctsEngine engine;
+        if (engine.load(path)) {
+            std::cout << "Loaded " << path << "\n";
+        }
+
+        const auto stage = engine.initial_stage();
+        const auto result = engine.search(stage, MctsEngine::Budget{std::stoll(argv[3]), ZeroMilliSec});
+        if (!engine.save(path)) {
+            std::cerr << "Cannot write " << path << "\n";
+            return 1;
+        }
+
+        std::cout << result.n_nodes << " nodes, " << engine.subtree(stage, 1, 0).at(0).n_tried <<
+            " playouts in total, best column " <<
+            (result.action.has_value() ? result.action.value().column : -1) << "\n";
+        return 0;
+    }
+
+    // 独立したエンジンで同時に自己対戦する: connect4 pool エンジン数 探索回数
+    if ((argc >= 4) && (std::string(argv[1]) == "pool")) {
+        const EnginePool::Size n_engines = std::stoull(argv[2]);
+        MctsEngine::Config config;
+        config.capacity = 1 << 16;
+        const MctsEngine::Budget budget {std::stoll(argv[3]), ZeroMilliSec};
+
+        const auto start_time = std::chrono::steady_clock::now();
+        EnginePool pool(config, n_engines);
+        const auto games = pool.play(budget);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+        std::array<uint64_t, Stage::SizeOfPlayers + 1> n_results {0, 0, 0};
+        uint64_t n_playouts {0};
+        for(const auto& game : games) {
+            ++n_results.at(game.winner.has_value() ? game.winner.value() : Stage::SizeOfPlayers);
+            n_playouts += game.n_playouts;
+        }
+
+        std::cout << "first, second, draw : " << n_results.at(0) << " , " << n_results.at(1) <<
+            " , " << n_results.at(2) << "\n";
+        std::cout << (games.size() / elapsed.count()) << " games/sec, " <<
+            (n_playouts / elapsed.count()) << " playouts/sec\n";
+        return 0;
+    }
+
     CommonHashKey keys(Stage::SizeOfPlayers);
     Stage stage(keys);
 
@@ -2539,6 +7972,7 @@ int main(int argc, char* argv[]) {
 
     return 0;
 }
+#endif
 
 /*
 Local Variables:
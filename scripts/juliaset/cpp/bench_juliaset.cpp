@@ -1,6 +1,10 @@
 #include "juliaset.h"
 #include <benchmark/benchmark.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <unistd.h>
 
 static void BM_sample(benchmark::State& state) {
@@ -9,11 +13,113 @@ static void BM_sample(benchmark::State& state) {
     const std::filesystem::path png_filepath {"bench.png"};
     constexpr PixelSize n_pixels = 256;
     const ParamSet params(0.5, 0.125, 75, n_pixels, csv_filepath, png_filepath);
-    if (draw(params) != ExitStatus::SUCCESS) {
-        std::cerr << "Failed\n";
+    for (auto _ : state) {
+        if (draw(params) != ExitStatus::SUCCESS) {
+            std::cerr << "Failed\n";
+            return;
+        }
+    }
+}
+
+static void BM_converge_point_set(benchmark::State& state) {
+    using namespace juliaset;
+    const auto level = static_cast<SimdLevel>(state.range(0));
+    if (level > detect_simd_level()) {
+        state.SkipWithError("Unsupported instruction set");
         return;
     }
+
+    constexpr PixelSize n_pixels = 256;
+    const auto xs = map_coordinates(1.5, n_pixels);
+    const auto ys = map_coordinates(1.5, n_pixels);
+    CoordinateSetView x_view = xs[boost::indices[decltype(xs)::index_range()]];
+    CoordinateSetView y_view = ys[boost::indices[decltype(ys)::index_range()]];
+    const Point offset{ParamSet::default_x_offset, ParamSet::default_y_offset};
+    for (auto _ : state) {
+        const auto counts = converge_point_set(x_view, y_view, offset,
+                                               ParamSet::default_max_iter, DefaultEps, level);
+        benchmark::DoNotOptimize(counts.data());
+    }
+}
+
+static void BM_scan_points(benchmark::State& state) {
+    using namespace juliaset;
+    // Points around the origin take many iterations
+    constexpr Coordinate x_offset = -0.8f;
+    constexpr Coordinate y_offset = 0.156f;
+    constexpr Count max_iter = 2000;
+    constexpr PixelSize n_pixels = 512;
+
+    // Bands of rows as many as threads (0) or small tiles (1)
+    TileSchedule schedule;
+    schedule.n_threads = std::max(4u, std::thread::hardware_concurrency());
+    if (state.range(0) == 0) {
+        schedule.tile_height = (n_pixels + schedule.n_threads - 1) / schedule.n_threads;
+        schedule.tile_width = n_pixels;
+    }
+
+    for (auto _ : state) {
+        const auto counts = scan_points(x_offset, y_offset, max_iter, n_pixels, schedule);
+        benchmark::DoNotOptimize(counts.data());
+    }
+
+    // How long the first finished thread waits for the last one
+    const Coordinate half_length = std::sqrt(2.0f) + 0.1f;
+    const auto xs = map_coordinates(half_length, n_pixels);
+    const auto ys = map_coordinates(half_length, n_pixels);
+    using Clock = std::chrono::steady_clock;
+    std::mutex mutex;
+    std::map<std::thread::id, Clock::time_point> finished;
+    const auto tiles = make_tiles(n_pixels, n_pixels, schedule.tile_height, schedule.tile_width);
+    run_tiles(
+        tiles,
+        [&](const Tile& tile) {
+            using Range = CoordinateSet::index_range;
+            CoordinateSetView x_view = xs[boost::indices[Range(tile.x_begin, tile.x_end)]];
+            CoordinateSetView y_view = ys[boost::indices[Range(tile.y_begin, tile.y_end)]];
+            const auto counts = converge_point_set(x_view, y_view, Point{x_offset, y_offset},
+                                                   max_iter, DefaultEps);
+            benchmark::DoNotOptimize(counts.data());
+            std::lock_guard<std::mutex> lock(mutex);
+            finished[std::this_thread::get_id()] = Clock::now();
+        },
+        schedule.n_threads);
+
+    const auto [first, last] = std::minmax_element(
+        finished.begin(), finished.end(),
+        [](const auto& lhs, const auto& rhs) { return lhs.second < rhs.second; });
+    const std::chrono::duration<double, std::milli> tail = last->second - first->second;
+    state.counters["tail_ms"] = tail.count();
+}
+
+static void BM_draw_image(benchmark::State& state) {
+    using namespace juliaset;
+    constexpr PixelSize n_pixels = 2048;
+    constexpr auto x_offset = ParamSet::default_x_offset;
+    constexpr auto y_offset = ParamSet::default_y_offset;
+    constexpr auto max_iter = ParamSet::default_max_iter;
+
+    // scan_points and draw_image (0), or the fused mode with each color scale (1, 2)
+    for (auto _ : state) {
+        if (state.range(0) == 0) {
+            const auto count_set = scan_points(x_offset, y_offset, max_iter, n_pixels);
+            const auto img = draw_image(count_set);
+            benchmark::DoNotOptimize(boost::gil::const_view(img).row_begin(0));
+        } else {
+            const auto color_scale =
+                (state.range(0) == 1) ? ColorScale::MAX_COUNT : ColorScale::MAX_ITER;
+            const auto img = draw_fused(x_offset, y_offset, max_iter, n_pixels, color_scale,
+                                        TileSchedule{}, nullptr);
+            benchmark::DoNotOptimize(boost::gil::const_view(img).row_begin(0));
+        }
+    }
 }
 
 BENCHMARK(BM_sample)->Iterations(100);
+BENCHMARK(BM_scan_points)->Arg(0)->Arg(1)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_draw_image)->Arg(0)->Arg(1)->Arg(2)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_converge_point_set)
+    ->Arg(static_cast<int>(juliaset::SimdLevel::SCALAR))
+    ->Arg(static_cast<int>(juliaset::SimdLevel::AVX2))
+    ->Arg(static_cast<int>(juliaset::SimdLevel::AVX512));
 BENCHMARK_MAIN();
@@ -16,9 +16,11 @@
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <optional>
 #include <string>
 #include <thread>
+#include <vector>
 
 /**
  Drawing Julia sets in C++
@@ -83,6 +85,54 @@ enum class ExitStatus {
     FILE_ERROR
 };
 
+/// An instruction set to transform points
+enum class SimdLevel {
+    /// One point at a time without SIMD instructions
+    SCALAR = 0,
+    /// 8 points at a time with AVX2 instructions
+    AVX2,
+    /// 16 points at a time with AVX-512 instructions
+    AVX512
+};
+
+/// How to normalize counts to colors
+enum class ColorScale {
+    /// Colors counts relative to the maximum count in a screen after computing all counts
+    MAX_COUNT = 0,
+    /// Colors counts relative to the maximum number of iterations as soon as they are computed
+    MAX_ITER
+};
+
+/// A rectangle of pixels in a screen that a thread processes at a time
+struct Tile final {
+    /// The first row
+    PixelSize y_begin;
+    /// The row next to the last row
+    PixelSize y_end;
+    /// The first column
+    PixelSize x_begin;
+    /// The column next to the last column
+    PixelSize x_end;
+};
+
+/// Tiles that cover a screen
+using TileSet = std::vector<Tile>;
+
+/// How to split a screen into tiles and process them in threads
+struct TileSchedule final {
+    /// The height in pixels of tiles
+    PixelSize tile_height {default_tile_height};
+    /// The width in pixels of tiles
+    PixelSize tile_width {default_tile_width};
+    /// The number of threads, or 0 to use all CPUs
+    unsigned int n_threads {0};
+
+    /// The default height in pixels of tiles
+    static inline constexpr PixelSize default_tile_height {8};
+    /// The default width in pixels of tiles that is a multiple of SIMD lanes
+    static inline constexpr PixelSize default_tile_width {64};
+};
+
 /// A parameter set to draw
 struct ParamSet final {
     /// An x offset that is added in iterations
@@ -97,6 +147,10 @@ struct ParamSet final {
     std::optional<std::filesystem::path> csv_filepath;
     /// A path to save counts as an image
     std::optional<std::filesystem::path> image_filepath;
+    /// Whether to colorize counts in each tile without keeping counts in a screen
+    bool fused {false};
+    /// How to normalize counts to colors in the fused mode
+    ColorScale color_scale {ColorScale::MAX_COUNT};
 
     /// The default x offset
     static inline constexpr Coordinate default_x_offset {0.375};
@@ -175,6 +229,26 @@ extern Count converge_point(Coordinate point_x, Coordinate point_y, const Point&
 extern CountSet converge_point_set(CoordinateSetView& xs, CoordinateSetView& ys,
                                    const Point& point_offset, Count max_iter, Coordinate eps);
 
+/**
+ * @brief Returns how many times each point in a screen is transformed with an instruction set
+ * @param[in] xs A X-coordinates view of points in a screen
+ * @param[in] ys A Y-coordinates view of points in a screen
+ * @param[in] point_offset An offset to be added to points
+ * @param[in] max_iter The maximum number of iterations
+ * @param[in] eps Tolerance to check if transformations are converged
+ * @param[in] level An instruction set to use, which is lowered if this CPU does not support it
+ * @return How many times each point in a screen is transformed, same as the scalar counts
+ */
+extern CountSet converge_point_set(CoordinateSetView& xs, CoordinateSetView& ys,
+                                   const Point& point_offset, Count max_iter, Coordinate eps,
+                                   SimdLevel level);
+
+/**
+ * @brief Returns the widest instruction set that this CPU supports
+ * @return The widest instruction set that this CPU supports
+ */
+extern SimdLevel detect_simd_level();
+
 /**
  * @brief Returns pixel coordinates on an axis in a screen
  * @param[in] half_length Maximum x and y coordinates relative to (0,0)
@@ -183,6 +257,26 @@ extern CountSet converge_point_set(CoordinateSetView& xs, CoordinateSetView& ys,
  */
 extern CoordinateSet map_coordinates(Coordinate half_length, PixelSize n_pixels);
 
+/**
+ * @brief Splits a screen into tiles
+ * @param[in] n_ys The number of rows in a screen
+ * @param[in] n_xs The number of columns in a screen
+ * @param[in] tile_height The height in pixels of tiles
+ * @param[in] tile_width The width in pixels of tiles
+ * @return Tiles that cover the screen in row-major order
+ */
+extern TileSet make_tiles(PixelSize n_ys, PixelSize n_xs, PixelSize tile_height,
+                          PixelSize tile_width);
+
+/**
+ * @brief Processes tiles in threads that take the next tile when they finish a tile
+ * @param[in] tiles Tiles to process
+ * @param[in] func A function that processes a tile
+ * @param[in] n_threads The number of threads, or 0 to use all CPUs
+ */
+extern void run_tiles(const TileSet& tiles, const std::function<void(const Tile&)>& func,
+                      unsigned int n_threads);
+
 /**
  * @brief Returns how many times each point in a screen is transformed
  * @param[in] x_offset An x offset that is added in iterations
@@ -194,6 +288,26 @@ extern CoordinateSet map_coordinates(Coordinate half_length, PixelSize n_pixels)
 extern CountSet scan_points(Coordinate x_offset, Coordinate y_offset, Count max_iter,
                             PixelSize n_pixels);
 
+/**
+ * @brief Returns how many times each point in a screen is transformed
+ * @param[in] x_offset An x offset that is added in iterations
+ * @param[in] y_offset A y offset that is added in iterations
+ * @param[in] max_iter The maximum number of iterations
+ * @param[in] n_pixels Numbers of pixels in X and Y axes
+ * @param[in] schedule How to split the screen into tiles and process them in threads
+ * @return How many times each point in a screen is transformed
+ */
+extern CountSet scan_points(Coordinate x_offset, Coordinate y_offset, Count max_iter,
+                            PixelSize n_pixels, const TileSchedule& schedule);
+
+/**
+ * @brief Returns a gradient color for a count
+ * @param[in] count A count to colorize
+ * @param[in] max_count The count that has the highest color
+ * @return The same color as make_gradient_colors(max_count).at(count)
+ */
+extern boost::gil::rgb8_pixel_t gradient_color(Count count, Count max_count);
+
 /**
  * @brief Returns a gradient color table for [0..max_count]
  * @param[in] max_count The maximum index of the color table
@@ -208,6 +322,29 @@ extern RgbPixelTable make_gradient_colors(Count max_count);
  */
 extern Bitmap draw_image(const CountSet& count_set);
 
+/**
+ * @brief Draws a PNG image from an input screen
+ * @param[in] count_set Counts of a Julia set in a screen
+ * @param[in] schedule How to split the screen into tiles and process them in threads
+ * @return A PNG image from an input screen
+ */
+extern Bitmap draw_image(const CountSet& count_set, const TileSchedule& schedule);
+
+/**
+ * @brief Computes counts in each tile and colorizes them without a second scan of a screen
+ * @param[in] x_offset An x offset that is added in iterations
+ * @param[in] y_offset A y offset that is added in iterations
+ * @param[in] max_iter The maximum number of iterations
+ * @param[in] n_pixels Numbers of pixels in X and Y axes
+ * @param[in] color_scale How to normalize counts to colors
+ * @param[in] schedule How to split the screen into tiles and process them in threads
+ * @param[out] count_set Counts in the screen if not nullptr
+ * @return An image same as draw_image(scan_points()) for ColorScale::MAX_COUNT
+ */
+extern Bitmap draw_fused(Coordinate x_offset, Coordinate y_offset, Count max_iter,
+                         PixelSize n_pixels, ColorScale color_scale,
+                         const TileSchedule& schedule, CountSet* count_set);
+
 /**
  * @brief Writes a count set table to a CSV file
  * @param[in] count_set Counts of a Julia set in a screen
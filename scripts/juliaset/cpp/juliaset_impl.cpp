@@ -1,5 +1,6 @@
 #include "juliaset.h"
 #include <algorithm>
+#include <atomic>
 #include <boost/algorithm/string/join.hpp>
 #include <boost/cast.hpp>
 #include <exception>
@@ -10,13 +11,65 @@
 #include <sstream>
 #include <stdexcept>
 #include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define JULIASET_X86_SIMD
+#include <immintrin.h>
+#endif // x86-64
+
+// Round each multiplication and addition separately so that SIMD lanes count points exactly
+// as the scalar code does even if FMA instructions are available
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
 
 namespace juliaset {
+namespace {
+/// Points whose squared moduli exceed this diverge
+constexpr Coordinate limit_modulus = 4;
+
+/// The maximum count that a pixel holds in the fused mode
+constexpr Count max_packed_count = 0xffffff;
+
+/// The maximum count that a color table covers in the fused mode
+constexpr Count max_color_table_count = 0xffff;
+
+/**
+ * @brief Returns maximum x and y coordinates of screens relative to (0,0)
+ * @return Maximum x and y coordinates of screens relative to (0,0)
+ */
+Coordinate screen_half_length() { return std::sqrt(checked_cast<Coordinate>(2)) + 0.1f; }
+
+/**
+ * @brief Holds a count in a pixel
+ * @param[in] count A count that does not exceed max_packed_count
+ * @return A pixel that holds the count
+ */
+boost::gil::rgb8_pixel_t pack_count(Count count) {
+    return boost::gil::rgb8_pixel_t{checked_cast<ColorElement>((count >> 16) & 0xff),
+                                    checked_cast<ColorElement>((count >> 8) & 0xff),
+                                    checked_cast<ColorElement>(count & 0xff)};
+}
+
+/**
+ * @brief Returns a count that a pixel holds
+ * @param[in] pixel A pixel made by pack_count()
+ * @return The count that the pixel holds
+ */
+Count unpack_count(const boost::gil::rgb8_pixel_t& pixel) {
+    return (checked_cast<Count>(boost::gil::at_c<0>(pixel)) << 16) |
+           (checked_cast<Count>(boost::gil::at_c<1>(pixel)) << 8) |
+           checked_cast<Count>(boost::gil::at_c<2>(pixel));
+}
+} // namespace
+
 Point transform_point(const Point& from, const Point& offset) { return from * from + offset; }
 
 Count converge_point(Coordinate point_x, Coordinate point_y, const Point& point_offset,
                      Count max_iter, Coordinate eps) {
-    constexpr Coordinate limit_modulus = 4;
     Coordinate previous_modulus = limit_modulus * limit_modulus;
     Point z{point_x, point_y};
 
@@ -37,18 +90,201 @@ Count converge_point(Coordinate point_x, Coordinate point_y, const Point& point_
     return count;
 }
 
+namespace {
+#ifdef JULIASET_X86_SIMD
+// The kernels below apply the same operations in the same order as transform_point() and
+// norm2_sqr() to each lane. A lane whose point overflows to NaN is marked as overflowed_count
+// and must be recounted by converge_point() because complex multiplications recover infinities.
+
+/// A count that marks a point which overflowed in SIMD lanes
+constexpr Count overflowed_count = -1;
+
+/**
+ * @brief Counts transformations of points in a row 8 points at a time with AVX2
+ * @param[in] xs X coordinates of points in a row
+ * @param[in] n_xs The number of points in the row
+ * @param[in] point_y The y coordinate of the row
+ * @param[in] point_offset An offset to be added to points
+ * @param[in] max_iter The maximum number of iterations
+ * @param[in] eps Tolerance to check if transformations are converged
+ * @param[out] counts How many times each point in the row is transformed or overflowed_count
+ * @return The number of leading points that are counted
+ */
+__attribute__((target("avx2"))) PixelSize
+converge_row_avx2(const Coordinate* xs, PixelSize n_xs, Coordinate point_y,
+                  const Point& point_offset, Count max_iter, Coordinate eps, Count* counts) {
+    constexpr PixelSize n_lanes = 8;
+    const auto offset_x = _mm256_set1_ps(point_offset.real());
+    const auto offset_y = _mm256_set1_ps(point_offset.imag());
+    const auto limit = _mm256_set1_ps(limit_modulus);
+    const auto tolerance = _mm256_set1_ps(eps);
+    const auto sign_bit = _mm256_set1_ps(-0.0f);
+
+    PixelSize x_index = 0;
+    for (; (x_index + n_lanes) <= n_xs; x_index += n_lanes) {
+        auto z_x = _mm256_loadu_ps(xs + x_index);
+        auto z_y = _mm256_set1_ps(point_y);
+        auto previous_modulus = _mm256_set1_ps(limit_modulus * limit_modulus);
+        auto lane_counts = _mm256_setzero_si256();
+        auto active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        auto overflowed = _mm256_setzero_ps();
+
+        for (Count count = 0; count < max_iter; ++count) {
+            const auto xx = _mm256_mul_ps(z_x, z_x);
+            const auto yy = _mm256_mul_ps(z_y, z_y);
+            const auto xy = _mm256_mul_ps(z_x, z_y);
+            const auto next_x = _mm256_add_ps(_mm256_sub_ps(xx, yy), offset_x);
+            const auto next_y = _mm256_add_ps(_mm256_add_ps(xy, xy), offset_y);
+            const auto z_modulus =
+                _mm256_add_ps(_mm256_mul_ps(next_x, next_x), _mm256_mul_ps(next_y, next_y));
+
+            const auto diverged = _mm256_cmp_ps(z_modulus, limit, _CMP_GT_OQ);
+            const auto diff = _mm256_andnot_ps(sign_bit, _mm256_sub_ps(previous_modulus, z_modulus));
+            const auto converged = _mm256_cmp_ps(diff, tolerance, _CMP_LT_OQ);
+            const auto nan = _mm256_cmp_ps(z_modulus, z_modulus, _CMP_UNORD_Q);
+            overflowed = _mm256_or_ps(overflowed, _mm256_and_ps(active, nan));
+            active = _mm256_andnot_ps(_mm256_or_ps(_mm256_or_ps(diverged, converged), nan), active);
+            if (_mm256_movemask_ps(active) == 0) {
+                break;
+            }
+
+            // Active lanes are all ones (-1)
+            lane_counts = _mm256_sub_epi32(lane_counts, _mm256_castps_si256(active));
+            z_x = next_x;
+            z_y = next_y;
+            previous_modulus = z_modulus;
+        }
+
+        lane_counts = _mm256_blendv_epi8(lane_counts, _mm256_set1_epi32(overflowed_count),
+                                         _mm256_castps_si256(overflowed));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(counts + x_index), lane_counts);
+    }
+
+    return x_index;
+}
+
+/**
+ * @brief Counts transformations of points in a row 16 points at a time with AVX-512
+ * @param[in] xs X coordinates of points in a row
+ * @param[in] n_xs The number of points in the row
+ * @param[in] point_y The y coordinate of the row
+ * @param[in] point_offset An offset to be added to points
+ * @param[in] max_iter The maximum number of iterations
+ * @param[in] eps Tolerance to check if transformations are converged
+ * @param[out] counts How many times each point in the row is transformed or overflowed_count
+ * @return The number of leading points that are counted
+ */
+__attribute__((target("avx512f"))) PixelSize
+converge_row_avx512(const Coordinate* xs, PixelSize n_xs, Coordinate point_y,
+                    const Point& point_offset, Count max_iter, Coordinate eps, Count* counts) {
+    constexpr PixelSize n_lanes = 16;
+    const auto offset_x = _mm512_set1_ps(point_offset.real());
+    const auto offset_y = _mm512_set1_ps(point_offset.imag());
+    const auto limit = _mm512_set1_ps(limit_modulus);
+    const auto tolerance = _mm512_set1_ps(eps);
+    const auto one = _mm512_set1_epi32(1);
+
+    PixelSize x_index = 0;
+    for (; (x_index + n_lanes) <= n_xs; x_index += n_lanes) {
+        auto z_x = _mm512_loadu_ps(xs + x_index);
+        auto z_y = _mm512_set1_ps(point_y);
+        auto previous_modulus = _mm512_set1_ps(limit_modulus * limit_modulus);
+        auto lane_counts = _mm512_setzero_si512();
+        __mmask16 active = 0xffff;
+        __mmask16 overflowed = 0;
+
+        for (Count count = 0; count < max_iter; ++count) {
+            const auto xx = _mm512_mul_ps(z_x, z_x);
+            const auto yy = _mm512_mul_ps(z_y, z_y);
+            const auto xy = _mm512_mul_ps(z_x, z_y);
+            const auto next_x = _mm512_add_ps(_mm512_sub_ps(xx, yy), offset_x);
+            const auto next_y = _mm512_add_ps(_mm512_add_ps(xy, xy), offset_y);
+            const auto z_modulus =
+                _mm512_add_ps(_mm512_mul_ps(next_x, next_x), _mm512_mul_ps(next_y, next_y));
+
+            const auto diverged = _mm512_cmp_ps_mask(z_modulus, limit, _CMP_GT_OQ);
+            const auto diff = _mm512_abs_ps(_mm512_sub_ps(previous_modulus, z_modulus));
+            const auto converged = _mm512_cmp_ps_mask(diff, tolerance, _CMP_LT_OQ);
+            const auto nan = _mm512_cmp_ps_mask(z_modulus, z_modulus, _CMP_UNORD_Q);
+            overflowed = _mm512_kor(overflowed, _mm512_kand(active, nan));
+            active = _mm512_kandn(_mm512_kor(_mm512_kor(diverged, converged), nan), active);
+            if (active == 0) {
+                break;
+            }
+
+            lane_counts = _mm512_mask_add_epi32(lane_counts, active, lane_counts, one);
+            z_x = next_x;
+            z_y = next_y;
+            previous_modulus = z_modulus;
+        }
+
+        lane_counts =
+            _mm512_mask_mov_epi32(lane_counts, overflowed, _mm512_set1_epi32(overflowed_count));
+        _mm512_storeu_si512(counts + x_index, lane_counts);
+    }
+
+    return x_index;
+}
+#endif // JULIASET_X86_SIMD
+} // namespace
+
+SimdLevel detect_simd_level() {
+#ifdef JULIASET_X86_SIMD
+    static const SimdLevel level = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return SimdLevel::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return SimdLevel::AVX2;
+        }
+        return SimdLevel::SCALAR;
+    }();
+    return level;
+#else
+    return SimdLevel::SCALAR;
+#endif // JULIASET_X86_SIMD
+}
+
 CountSet converge_point_set(CoordinateSetView& xs, CoordinateSetView& ys, const Point& point_offset,
                             Count max_iter, Coordinate eps) {
+    return converge_point_set(xs, ys, point_offset, max_iter, eps, detect_simd_level());
+}
+
+CountSet converge_point_set(CoordinateSetView& xs, CoordinateSetView& ys, const Point& point_offset,
+                            Count max_iter, Coordinate eps, SimdLevel level) {
+    level = std::min(level, detect_simd_level());
     auto xs_size = xs.shape()[0];
     auto ys_size = ys.shape()[0];
     CountSet mat_counts(boost::extents[ys_size][xs_size]);
 
+    // Views may be strided but the kernels load consecutive x coordinates
+    const std::vector<Coordinate> point_xs(xs.begin(), xs.end());
+
     decltype(ys_size) y_index{0};
     for (auto point_y = ys.begin(); point_y != ys.end(); ++point_y, ++y_index) {
+        auto row_counts = mat_counts.data() + y_index * xs_size;
         decltype(xs_size) x_index{0};
-        for (auto point_x = xs.begin(); point_x != xs.end(); ++point_x, ++x_index) {
-            mat_counts[y_index][x_index] =
-                converge_point(*point_x, *point_y, point_offset, max_iter, eps);
+#ifdef JULIASET_X86_SIMD
+        if (level == SimdLevel::AVX512) {
+            x_index = converge_row_avx512(point_xs.data(), xs_size, *point_y, point_offset,
+                                          max_iter, eps, row_counts);
+        } else if (level == SimdLevel::AVX2) {
+            x_index = converge_row_avx2(point_xs.data(), xs_size, *point_y, point_offset,
+                                        max_iter, eps, row_counts);
+        }
+
+        for (decltype(x_index) i{0}; i < x_index; ++i) {
+            if (row_counts[i] == overflowed_count) {
+                row_counts[i] = converge_point(point_xs[i], *point_y, point_offset, max_iter, eps);
+            }
+        }
+#endif // JULIASET_X86_SIMD
+
+        // Remaining points in a row
+        for (; x_index < xs_size; ++x_index) {
+            row_counts[x_index] =
+                converge_point(point_xs[x_index], *point_y, point_offset, max_iter, eps);
         }
     }
 
@@ -73,8 +309,61 @@ CoordinateSet map_coordinates(Coordinate half_length, PixelSize n_pixels) {
     return coord_set;
 }
 
+TileSet make_tiles(PixelSize n_ys, PixelSize n_xs, PixelSize tile_height,
+                   PixelSize tile_width) {
+    TileSet tiles;
+    if ((tile_height < 1) || (tile_width < 1)) {
+        return tiles;
+    }
+
+    for (PixelSize y_begin{0}; y_begin < n_ys; y_begin += tile_height) {
+        const auto y_end = std::min(y_begin + tile_height, n_ys);
+        for (PixelSize x_begin{0}; x_begin < n_xs; x_begin += tile_width) {
+            const auto x_end = std::min(x_begin + tile_width, n_xs);
+            tiles.push_back(Tile{y_begin, y_end, x_begin, x_end});
+        }
+    }
+
+    return tiles;
+}
+
+void run_tiles(const TileSet& tiles, const std::function<void(const Tile&)>& func,
+               unsigned int n_threads) {
+    if (n_threads == 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    n_threads = std::min(n_threads, checked_cast<unsigned int>(tiles.size()));
+
+    // Points in Julia sets take much more iterations than points outside them. A thread
+    // takes the next tile when it finishes a tile not to wait for threads with costly tiles.
+    std::atomic<size_t> next_index{0};
+    auto run = [&]() -> void {
+        for (;;) {
+            const auto index = next_index.fetch_add(1, std::memory_order_relaxed);
+            if (index >= tiles.size()) {
+                break;
+            }
+            func(tiles[index]);
+        }
+    };
+
+    std::vector<std::future<void>> futureSet;
+    for (decltype(n_threads) i{0}; i < n_threads; ++i) {
+        futureSet.push_back(std::async(std::launch::async, run));
+    }
+
+    for (auto& f : futureSet) {
+        f.get();
+    }
+}
+
 CountSet scan_points(Coordinate x_offset, Coordinate y_offset, Count max_iter, PixelSize n_pixels) {
-    const Coordinate half_length = std::sqrt(checked_cast<Coordinate>(2)) + 0.1f;
+    return scan_points(x_offset, y_offset, max_iter, n_pixels, TileSchedule{});
+}
+
+CountSet scan_points(Coordinate x_offset, Coordinate y_offset, Count max_iter, PixelSize n_pixels,
+                     const TileSchedule& schedule) {
+    const auto half_length = screen_half_length();
     const auto xs = map_coordinates(half_length, n_pixels);
     const auto ys = map_coordinates(half_length, n_pixels);
     const Point point_offset{x_offset, y_offset};
@@ -83,74 +372,60 @@ CountSet scan_points(Coordinate x_offset, Coordinate y_offset, Count max_iter, P
     auto n_xs = xs.shape()[0];
     auto n_ys = ys.shape()[0];
     CountSet mat_counts(boost::extents[n_ys][n_xs]);
-    CoordinateSetView x_view = xs[boost::indices[decltype(xs)::index_range()]];
-
-    auto n_cpus = std::thread::hardware_concurrency();
-    using Index = decltype(n_ys);
-    Index index_start = 0;
-    Index index_span =
-        checked_cast<Index>(std::ceil(checked_cast<double>(n_ys) / checked_cast<double>(n_cpus)));
-    {
-        std::vector<std::future<void>> futureSet;
-        auto run = [&](auto sub_start, auto sub_end) -> void {
-            CoordinateSetView y_view =
-                ys[boost::indices[decltype(ys)::index_range(sub_start, sub_end)]];
-
-            const auto sub_counts = converge_point_set(x_view, y_view, point_offset, max_iter, eps);
-            mat_counts[boost::indices[decltype(mat_counts)::index_range(sub_start, sub_end)]
-                       [decltype(mat_counts)::index_range()]] = sub_counts;
-        };
 
-        for (decltype(n_cpus) i{0}; i < n_cpus; ++i) {
-            Index index_end = index_start + index_span;
-            index_end = std::min(index_end, n_ys);
-            auto job = [=]() -> void {
-                run(index_start, index_end);
-            };
+    const auto tiles = make_tiles(n_ys, n_xs, schedule.tile_height, schedule.tile_width);
+    auto run = [&](const Tile& tile) -> void {
+        using XRange = decltype(xs)::index_range;
+        using YRange = decltype(ys)::index_range;
+        using CountRange = decltype(mat_counts)::index_range;
+        CoordinateSetView x_view = xs[boost::indices[XRange(tile.x_begin, tile.x_end)]];
+        CoordinateSetView y_view = ys[boost::indices[YRange(tile.y_begin, tile.y_end)]];
 
-            futureSet.push_back(std::async(std::launch::async, job));
-            index_start = index_end;
-        }
+        const auto sub_counts = converge_point_set(x_view, y_view, point_offset, max_iter, eps);
+        mat_counts[boost::indices[CountRange(tile.y_begin, tile.y_end)]
+                                 [CountRange(tile.x_begin, tile.x_end)]] = sub_counts;
+    };
+    run_tiles(tiles, run, schedule.n_threads);
 
-        for(auto& f : futureSet) {
-            f.get();
-        }
+    return mat_counts;
+}
+
+boost::gil::rgb8_pixel_t gradient_color(Count count, Count max_count) {
+    if (max_count < 1) {
+        return boost::gil::rgb8_pixel_t{HIGH_COLOR_R, HIGH_COLOR_G, HIGH_COLOR_B};
     }
 
-    return mat_counts;
+    auto inner_point = [count, max_count](ColorElement left, ColorElement right) {
+        using ColorValue = double;
+        const auto weight = checked_cast<ColorValue>(count) / checked_cast<ColorValue>(max_count);
+        auto value = checked_cast<ColorValue>(left) * (1.0 - weight) +
+                     checked_cast<ColorValue>(right) * weight;
+
+        value = std::clamp(value,
+                           checked_cast<ColorValue>(std::numeric_limits<ColorElement>::min()),
+                           checked_cast<ColorValue>(std::numeric_limits<ColorElement>::max()));
+        return checked_cast<ColorElement>(value);
+    };
+
+    const auto r = inner_point(LOW_COLOR_R, HIGH_COLOR_R);
+    const auto g = inner_point(LOW_COLOR_G, HIGH_COLOR_G);
+    const auto b = inner_point(LOW_COLOR_B, HIGH_COLOR_B);
+    return boost::gil::rgb8_pixel_t{r, g, b};
 }
 
 RgbPixelTable make_gradient_colors(Count max_count) {
-    RgbPixelTable table(std::max(0, max_count) + 1);
-
-    if (max_count < 1) {
-        table.at(0) = boost::gil::rgb8_pixel_t{HIGH_COLOR_R, HIGH_COLOR_G, HIGH_COLOR_B};
-    } else {
-        for (decltype(max_count) i{0}; i <= max_count; ++i) {
-            auto inner_point = [i, max_count](ColorElement left, ColorElement right) {
-                using ColorValue = double;
-                const auto weight =
-                    checked_cast<ColorValue>(i) / checked_cast<ColorValue>(max_count);
-                auto value = checked_cast<ColorValue>(left) * (1.0 - weight) +
-                             checked_cast<ColorValue>(right) * weight;
-
-                value = std::clamp(
-                    value, checked_cast<ColorValue>(std::numeric_limits<ColorElement>::min()),
-                    checked_cast<ColorValue>(std::numeric_limits<ColorElement>::max()));
-                return checked_cast<ColorElement>(value);
-            };
-
-            const auto r = inner_point(LOW_COLOR_R, HIGH_COLOR_R);
-            const auto g = inner_point(LOW_COLOR_G, HIGH_COLOR_G);
-            const auto b = inner_point(LOW_COLOR_B, HIGH_COLOR_B);
-            table.at(i) = boost::gil::rgb8_pixel_t{r, g, b};
-        }
+    const auto max_index = std::max(0, max_count);
+    RgbPixelTable table(max_index + 1);
+    for (decltype(max_count) i{0}; i <= max_index; ++i) {
+        table.at(i) = gradient_color(i, max_count);
     }
 
     return table;
 }
 
-Bitmap draw_image(const CountSet& count_set) {
+Bitmap draw_image(const CountSet& count_set) { return draw_image(count_set, TileSchedule{}); }
+
+Bitmap draw_image(const CountSet& count_set, const TileSchedule& schedule) {
     auto n_ys = count_set.shape()[0];
     auto n_xs = count_set.shape()[1];
     Bitmap img(n_xs, n_ys);
@@ -166,40 +441,116 @@ Bitmap draw_image(const CountSet& count_set) {
 
     const auto color_table = make_gradient_colors(max_count);
     auto img_view = view(img);
-    auto height = img_view.height();
-
-    auto n_cpus = std::thread::hardware_concurrency();
-    using Index = decltype(height);
-    Index y_start = 0;
-    Index y_span =
-        checked_cast<Index>(std::ceil(checked_cast<double>(height) / checked_cast<double>(n_cpus)));
-    {
-        std::vector<std::future<void>> futureSet;
-        auto run = [&](auto sub_start, auto sub_end) -> void {
-            for (decltype(sub_start) y{sub_start}; y < sub_end; ++y) {
-                auto it = img_view.row_begin(y);
-                for (decltype(n_xs) x{0}; x < n_xs; ++x, ++it) {
-                    *it = color_table.at(count_set[y][x]);
-                }
+
+    const auto tiles = make_tiles(n_ys, n_xs, schedule.tile_height, schedule.tile_width);
+    auto run = [&](const Tile& tile) -> void {
+        for (auto y{tile.y_begin}; y < tile.y_end; ++y) {
+            auto it = img_view.row_begin(checked_cast<std::ptrdiff_t>(y)) +
+                      checked_cast<std::ptrdiff_t>(tile.x_begin);
+            for (auto x{tile.x_begin}; x < tile.x_end; ++x, ++it) {
+                *it = color_table.at(count_set[y][x]);
             }
-        };
+        }
+    };
+    run_tiles(tiles, run, schedule.n_threads);
 
-        for (decltype(n_cpus) i{0}; i < n_cpus; ++i) {
-            Index y_end = y_start + y_span;
-            y_end = std::min(y_end, height);
-            auto job = [=]() -> void {
-                run(y_start, y_end);
-            };
+    return img;
+}
 
-            futureSet.push_back(std::async(std::launch::async, job));
-            y_start = y_end;
+Bitmap draw_fused(Coordinate x_offset, Coordinate y_offset, Count max_iter, PixelSize n_pixels,
+                  ColorScale color_scale, const TileSchedule& schedule, CountSet* count_set) {
+    if ((color_scale == ColorScale::MAX_COUNT) && (max_iter > max_packed_count)) {
+        // Pixels cannot hold counts
+        auto counts = scan_points(x_offset, y_offset, max_iter, n_pixels, schedule);
+        auto img = draw_image(counts, schedule);
+        if (count_set != nullptr) {
+            count_set->resize(boost::extents[counts.shape()[0]][counts.shape()[1]]);
+            *count_set = counts;
         }
+        return img;
+    }
 
-        for(auto& f : futureSet) {
-            f.get();
+    const auto half_length = screen_half_length();
+    const auto xs = map_coordinates(half_length, n_pixels);
+    const auto ys = map_coordinates(half_length, n_pixels);
+    const Point point_offset{x_offset, y_offset};
+    constexpr auto eps = DefaultEps;
+
+    auto n_xs = xs.shape()[0];
+    auto n_ys = ys.shape()[0];
+    if (count_set != nullptr) {
+        count_set->resize(boost::extents[n_ys][n_xs]);
+    }
+
+    Bitmap img(n_xs, n_ys);
+    auto img_view = view(img);
+    const auto tiles = make_tiles(n_ys, n_xs, schedule.tile_height, schedule.tile_width);
+
+    // Converts counts in a tile to pixels while they are in caches
+    auto scan_tile = [&](const Tile& tile, auto&& to_pixel) -> void {
+        using XRange = decltype(xs)::index_range;
+        using YRange = decltype(ys)::index_range;
+        CoordinateSetView x_view = xs[boost::indices[XRange(tile.x_begin, tile.x_end)]];
+        CoordinateSetView y_view = ys[boost::indices[YRange(tile.y_begin, tile.y_end)]];
+        const auto sub_counts = converge_point_set(x_view, y_view, point_offset, max_iter, eps);
+
+        if (count_set != nullptr) {
+            using CountRange = CountSet::index_range;
+            (*count_set)[boost::indices[CountRange(tile.y_begin, tile.y_end)]
+                                       [CountRange(tile.x_begin, tile.x_end)]] = sub_counts;
         }
+
+        for (auto y{tile.y_begin}; y < tile.y_end; ++y) {
+            auto it = img_view.row_begin(checked_cast<std::ptrdiff_t>(y)) +
+                      checked_cast<std::ptrdiff_t>(tile.x_begin);
+            for (auto x{tile.x_begin}; x < tile.x_end; ++x, ++it) {
+                *it = to_pixel(sub_counts[y - tile.y_begin][x - tile.x_begin]);
+            }
+        }
+    };
+
+    if (color_scale == ColorScale::MAX_ITER) {
+        // Looks up a table while it is small and computes colors for each pixel otherwise
+        const auto color_table =
+            (max_iter <= max_color_table_count) ? make_gradient_colors(max_iter) : RgbPixelTable{};
+        auto run = [&](const Tile& tile) -> void {
+            scan_tile(tile, [&](Count count) {
+                return color_table.empty() ? gradient_color(count, max_iter) : color_table[count];
+            });
+        };
+        run_tiles(tiles, run, schedule.n_threads);
+        return img;
     }
 
+    // The first phase holds counts in pixels to find the maximum count and
+    // the second phase replaces them with colors.
+    std::atomic<Count> max_count{0};
+    auto run_count = [&](const Tile& tile) -> void {
+        Count tile_max_count = 0;
+        scan_tile(tile, [&](Count count) {
+            tile_max_count = std::max(tile_max_count, count);
+            return pack_count(count);
+        });
+
+        auto current = max_count.load();
+        while ((current < tile_max_count) &&
+               !max_count.compare_exchange_weak(current, tile_max_count)) {
+        }
+    };
+    run_tiles(tiles, run_count, schedule.n_threads);
+
+    const auto color_table = make_gradient_colors(max_count.load());
+    auto run_color = [&](const Tile& tile) -> void {
+        for (auto y{tile.y_begin}; y < tile.y_end; ++y) {
+            auto it = img_view.row_begin(checked_cast<std::ptrdiff_t>(y)) +
+                      checked_cast<std::ptrdiff_t>(tile.x_begin);
+            for (auto x{tile.x_begin}; x < tile.x_end; ++x, ++it) {
+                *it = color_table.at(unpack_count(*it));
+            }
+        }
+    };
+    run_tiles(tiles, run_color, schedule.n_threads);
+
     return img;
 }
 
@@ -230,11 +581,23 @@ Bitmap draw_image(const CountSet& count_set) {
 }
 
 [[nodiscard]] ExitStatus draw(const ParamSet& params) {
-    const auto count_set =
-        scan_points(params.x_offset, params.y_offset, params.max_iter, params.n_pixels);
+    std::optional<CountSet> count_set;
+    std::optional<Bitmap> fused_img;
+    if (params.fused && params.image_filepath.has_value()) {
+        // Keeps counts only to write them
+        if (params.csv_filepath.has_value()) {
+            count_set.emplace();
+        }
+        fused_img = draw_fused(params.x_offset, params.y_offset, params.max_iter,
+                               params.n_pixels, params.color_scale, TileSchedule{},
+                               count_set.has_value() ? &count_set.value() : nullptr);
+    } else {
+        count_set = scan_points(params.x_offset, params.y_offset, params.max_iter,
+                                params.n_pixels);
+    }
 
     if (params.csv_filepath.has_value()) {
-        const auto status = write_csv(count_set, params.csv_filepath.value());
+        const auto status = write_csv(count_set.value(), params.csv_filepath.value());
         if (status != ExitStatus::SUCCESS) {
             return status;
         }
@@ -244,7 +607,8 @@ Bitmap draw_image(const CountSet& count_set) {
     if (params.image_filepath.has_value()) {
         bool success = false;
         try {
-            auto img = draw_image(count_set);
+            auto img = fused_img.has_value() ? std::move(fused_img.value())
+                                             : draw_image(count_set.value());
             const auto img_filename = params.image_filepath.value().string();
             boost::gil::write_view(img_filename, const_view(img), boost::gil::png_tag());
             success = true;
@@ -278,6 +642,8 @@ ParamSet parse_args(int argc, const char* const argv[]) {
     const std::string long_opt_size {"size"};
     const std::string long_opt_csv {"csv"};
     const std::string long_opt_image {"image"};
+    const std::string long_opt_fused {"fused"};
+    const std::string long_opt_normalize {"normalize"};
 
     const std::string opts_x_offset = long_opt_x_offset + ",x";
     const std::string opts_y_offset = long_opt_y_offset + ",y";
@@ -285,6 +651,10 @@ ParamSet parse_args(int argc, const char* const argv[]) {
     const std::string opts_opt_size = long_opt_size + ",s";
     const std::string opts_csv = long_opt_csv + ",c";
     const std::string opts_image = long_opt_image + ",o";
+    const std::string opts_fused = long_opt_fused + ",f";
+    const std::string opts_normalize = long_opt_normalize + ",n";
+    const std::string normalize_count {"count"};
+    const std::string normalize_iter {"iter"};
 
     Coordinate x_offset {0};
     Coordinate y_offset {0};
@@ -292,6 +662,8 @@ ParamSet parse_args(int argc, const char* const argv[]) {
     PixelSize n_pixels {0};
     std::string csv_filename;
     std::string image_filename;
+    bool fused {false};
+    std::string normalize;
     std::optional<std::filesystem::path> csv_filepath;
     std::optional<std::filesystem::path> image_filepath;
 
@@ -315,6 +687,12 @@ ParamSet parse_args(int argc, const char* const argv[]) {
         (opts_image.c_str(),
          boost::program_options::value<decltype(image_filename)>()->default_value(ParamSet::default_image_filename),
          "PNG filename")
+        (opts_fused.c_str(),
+         boost::program_options::bool_switch(&fused),
+         "Colorize counts in each tile without keeping counts")
+        (opts_normalize.c_str(),
+         boost::program_options::value<decltype(normalize)>()->default_value(normalize_count),
+         "Normalize colors with the max count (count) or max iterations (iter) in the fused mode")
         ;
 
     boost::program_options::variables_map var_map;
@@ -328,7 +706,15 @@ ParamSet parse_args(int argc, const char* const argv[]) {
     set_optional_path(var_map, long_opt_csv, csv_filepath);
     set_optional_path(var_map, long_opt_image, image_filepath);
 
+    set_option_value(var_map, long_opt_normalize, normalize);
+
     ParamSet params(x_offset, y_offset, max_iter, n_pixels, csv_filepath, image_filepath);
+    params.fused = fused;
+    if (normalize == normalize_iter) {
+        params.color_scale = ColorScale::MAX_ITER;
+    } else if (normalize != normalize_count) {
+        throw boost::program_options::invalid_option_value(normalize);
+    }
     return params;
 }
 
@@ -1,7 +1,9 @@
 #include "juliaset.h"
+#include <atomic>
 #include <fstream>
 #include <gtest/gtest.h>
 #include <random>
+#include <stdexcept>
 #include <tuple>
 
 using namespace juliaset;
@@ -359,6 +361,78 @@ TEST_F(TestConvergePointSet, Limit) {
     EXPECT_EQ(3, actual[0][1]);
 }
 
+TEST_F(TestConvergePointSet, SimdLevels) {
+    // 37 points do not fill SIMD lanes
+    constexpr PixelSize n_xs = 37;
+    constexpr PixelSize n_ys = 5;
+    std::mt19937 engine(1);
+    std::uniform_real_distribution<Coordinate> dist(-1.5, 1.5);
+    CoordinateSet xs(boost::extents[n_xs]);
+    CoordinateSet ys(boost::extents[n_ys]);
+    std::generate(xs.begin(), xs.end(), [&]() { return dist(engine); });
+    std::generate(ys.begin(), ys.end(), [&]() { return dist(engine); });
+    // Overflows to infinities and NaNs
+    xs[3] = 1e20f;
+    xs[4] = -3e19f;
+    ys[4] = 2e30f;
+
+    CoordinateSetView view_xs = xs[boost::indices[decltype(xs)::index_range()]];
+    CoordinateSetView view_ys = ys[boost::indices[decltype(ys)::index_range()]];
+    const std::vector<Point> offsets{{0.375, 0.375}, {0.5, 0.125}, {-0.8f, 0.156f}};
+    const std::vector<Coordinate> eps_set{DefaultEps, 0.0, 0.1f};
+    const std::vector<Count> max_iter_set{0, 1, 100, 1000};
+
+    for (const auto& offset : offsets) {
+        for (const auto eps : eps_set) {
+            for (const auto max_iter : max_iter_set) {
+                const auto expected =
+                    converge_point_set(view_xs, view_ys, offset, max_iter, eps, SimdLevel::SCALAR);
+                for (PixelSize y{0}; y < n_ys; ++y) {
+                    for (PixelSize x{0}; x < n_xs; ++x) {
+                        ASSERT_EQ(converge_point(xs[x], ys[y], offset, max_iter, eps),
+                                  expected[y][x]);
+                    }
+                }
+
+                for (const auto level : {SimdLevel::AVX2, SimdLevel::AVX512}) {
+                    const auto actual =
+                        converge_point_set(view_xs, view_ys, offset, max_iter, eps, level);
+                    ASSERT_EQ(expected, actual);
+                }
+                ASSERT_EQ(expected, converge_point_set(view_xs, view_ys, offset, max_iter, eps));
+            }
+        }
+    }
+}
+
+TEST_F(TestConvergePointSet, Strided) {
+    CoordinateSet xs(boost::extents[40]);
+    CoordinateSet ys(boost::extents[2]);
+    for (PixelSize i{0}; i < xs.size(); ++i) {
+        xs[i] = static_cast<Coordinate>(i) / 20.0f - 1.0f;
+    }
+    ys[0] = 0.375;
+    ys[1] = -0.25;
+
+    const Point offset{0.375, 0.375};
+    using Range = decltype(xs)::index_range;
+    CoordinateSetView view_xs = xs[boost::indices[Range(0, 40, 2)]];
+    CoordinateSetView view_ys = ys[boost::indices[decltype(ys)::index_range()]];
+    const auto expected =
+        converge_point_set(view_xs, view_ys, offset, 100, DefaultEps, SimdLevel::SCALAR);
+    const auto actual = converge_point_set(view_xs, view_ys, offset, 100, DefaultEps);
+    ASSERT_EQ(20, actual.shape()[1]);
+    EXPECT_EQ(expected, actual);
+    EXPECT_EQ(converge_point(xs[38], ys[1], offset, 100, DefaultEps), actual[1][19]);
+}
+
+TEST_F(TestConvergePointSet, DetectSimdLevel) {
+    const auto level = detect_simd_level();
+    EXPECT_LE(SimdLevel::SCALAR, level);
+    EXPECT_GE(SimdLevel::AVX512, level);
+    EXPECT_EQ(level, detect_simd_level());
+}
+
 class TestMapCoordinates : public ::testing::Test {};
 
 TEST_F(TestMapCoordinates, Zero) {
@@ -408,6 +482,81 @@ TEST_F(TestMapCoordinates, Many) {
     ASSERT_EQ(expected_even, actual_even);
 }
 
+class TestMakeTiles : public ::testing::Test {};
+
+TEST_F(TestMakeTiles, Even) {
+    const auto actual = make_tiles(4, 6, 2, 3);
+    ASSERT_EQ(4, actual.size());
+    const std::vector<std::vector<PixelSize>> expected{
+        {0, 2, 0, 3}, {0, 2, 3, 6}, {2, 4, 0, 3}, {2, 4, 3, 6}};
+    for (size_t i{0}; i < expected.size(); ++i) {
+        EXPECT_EQ(expected.at(i).at(0), actual.at(i).y_begin);
+        EXPECT_EQ(expected.at(i).at(1), actual.at(i).y_end);
+        EXPECT_EQ(expected.at(i).at(2), actual.at(i).x_begin);
+        EXPECT_EQ(expected.at(i).at(3), actual.at(i).x_end);
+    }
+}
+
+TEST_F(TestMakeTiles, Ragged) {
+    const auto actual = make_tiles(5, 3, 2, 4);
+    ASSERT_EQ(3, actual.size());
+    EXPECT_EQ(4, actual.at(2).y_begin);
+    EXPECT_EQ(5, actual.at(2).y_end);
+    EXPECT_EQ(0, actual.at(2).x_begin);
+    EXPECT_EQ(3, actual.at(2).x_end);
+}
+
+TEST_F(TestMakeTiles, Empty) {
+    EXPECT_TRUE(make_tiles(0, 3, 2, 2).empty());
+    EXPECT_TRUE(make_tiles(3, 0, 2, 2).empty());
+    EXPECT_TRUE(make_tiles(3, 3, 0, 2).empty());
+    EXPECT_TRUE(make_tiles(3, 3, 2, 0).empty());
+}
+
+class TestRunTiles : public ::testing::Test {};
+
+TEST_F(TestRunTiles, AllOnce) {
+    constexpr PixelSize n_ys = 13;
+    constexpr PixelSize n_xs = 7;
+    const auto tiles = make_tiles(n_ys, n_xs, 2, 3);
+    for (const unsigned int n_threads : {0u, 1u, 3u, 100u}) {
+        std::vector<std::atomic<int>> visits(n_ys * n_xs);
+        run_tiles(
+            tiles,
+            [&](const Tile& tile) {
+                for (auto y{tile.y_begin}; y < tile.y_end; ++y) {
+                    for (auto x{tile.x_begin}; x < tile.x_end; ++x) {
+                        visits.at(y * n_xs + x) += 1;
+                    }
+                }
+            },
+            n_threads);
+
+        for (const auto& visit : visits) {
+            ASSERT_EQ(1, visit.load());
+        }
+    }
+}
+
+TEST_F(TestRunTiles, Empty) {
+    int n_calls = 0;
+    run_tiles(TileSet{}, [&](const Tile&) { ++n_calls; }, 4);
+    EXPECT_EQ(0, n_calls);
+}
+
+TEST_F(TestRunTiles, Exception) {
+    const auto tiles = make_tiles(4, 4, 1, 1);
+    EXPECT_THROW(run_tiles(
+                     tiles,
+                     [](const Tile& tile) {
+                         if (tile.y_begin == 2) {
+                             throw std::runtime_error("tile");
+                         }
+                     },
+                     2),
+                 std::runtime_error);
+}
+
 class TestScanPoints : public ::testing::Test {};
 
 TEST_F(TestScanPoints, Capped) {
@@ -430,8 +579,29 @@ TEST_F(TestScanPoints, Unlimited) {
     EXPECT_EQ(actual, expected);
 }
 
+TEST_F(TestScanPoints, Tiles) {
+    constexpr PixelSize n_pixels = 67;
+    const auto expected =
+        scan_points(0.375, 0.375, 100, n_pixels, TileSchedule{n_pixels, n_pixels, 1});
+    const std::vector<TileSchedule> schedules{
+        {1, 1, 2}, {8, 64, 3}, {5, 17, 0}, {n_pixels, 16, 4}, {100, 100, 2}};
+    for (const auto& schedule : schedules) {
+        EXPECT_EQ(expected, scan_points(0.375, 0.375, 100, n_pixels, schedule));
+    }
+    EXPECT_EQ(expected, scan_points(0.375, 0.375, 100, n_pixels));
+}
+
 class TestMakeGradientColors : public ::testing::Test {};
 
+TEST_F(TestMakeGradientColors, GradientColor) {
+    for (Count max_count{0}; max_count <= 300; ++max_count) {
+        const auto table = make_gradient_colors(max_count);
+        for (Count count{0}; count <= max_count; ++count) {
+            ASSERT_EQ(table.at(count), gradient_color(count, max_count));
+        }
+    }
+}
+
 TEST_F(TestMakeGradientColors, One) {
     const auto table = make_gradient_colors(0);
     ASSERT_EQ(1, table.size());
@@ -560,6 +730,89 @@ TEST_F(TestDrawImage, ManyColors) {
     }
 }
 
+TEST_F(TestDrawImage, Tiles) {
+    const auto count_set = scan_points(0.375, 0.375, 100, 37);
+    const auto expected = draw_image(count_set, TileSchedule{37, 37, 1});
+    const std::vector<TileSchedule> schedules{{1, 1, 2}, {8, 64, 3}, {5, 7, 0}};
+    for (const auto& schedule : schedules) {
+        const auto actual = draw_image(count_set, schedule);
+        EXPECT_TRUE(boost::gil::equal_pixels(boost::gil::const_view(expected),
+                                             boost::gil::const_view(actual)));
+    }
+}
+
+class TestDrawFused : public ::testing::Test {};
+
+TEST_F(TestDrawFused, MaxCount) {
+    for (const PixelSize n_pixels : {0, 1, 37, 128}) {
+        const auto expected_counts = scan_points(0.375, 0.375, 100, n_pixels);
+        const auto expected = draw_image(expected_counts);
+        for (const auto& schedule : {TileSchedule{}, TileSchedule{3, 5, 2}}) {
+            CountSet count_set;
+            const auto actual = draw_fused(0.375, 0.375, 100, n_pixels, ColorScale::MAX_COUNT,
+                                           schedule, &count_set);
+            EXPECT_TRUE(boost::gil::equal_pixels(boost::gil::const_view(expected),
+                                                 boost::gil::const_view(actual)));
+            EXPECT_EQ(expected_counts, count_set);
+
+            const auto img = draw_fused(0.375, 0.375, 100, n_pixels, ColorScale::MAX_COUNT,
+                                        schedule, nullptr);
+            EXPECT_TRUE(boost::gil::equal_pixels(boost::gil::const_view(expected),
+                                                 boost::gil::const_view(img)));
+        }
+    }
+}
+
+TEST_F(TestDrawFused, MaxIter) {
+    constexpr PixelSize n_pixels = 37;
+    constexpr Count max_iter = 100;
+    const auto count_set = scan_points(0.375, 0.375, max_iter, n_pixels);
+    const auto color_table = make_gradient_colors(max_iter);
+    const auto img = draw_fused(0.375, 0.375, max_iter, n_pixels, ColorScale::MAX_ITER,
+                                TileSchedule{}, nullptr);
+
+    auto view = boost::gil::const_view(img);
+    ASSERT_EQ(n_pixels, view.width());
+    ASSERT_EQ(n_pixels, view.height());
+    for (PixelSize y{0}; y < n_pixels; ++y) {
+        auto it = view.row_begin(checked_cast<std::ptrdiff_t>(y));
+        for (PixelSize x{0}; x < n_pixels; ++x, ++it) {
+            ASSERT_EQ(color_table.at(count_set[y][x]), *it);
+        }
+    }
+}
+
+TEST_F(TestDrawFused, LargeMaxIterScale) {
+    // Does not make a color table for [0..max_iter]
+    constexpr PixelSize n_pixels = 4;
+    constexpr Count max_iter = 0x1000000;
+    CountSet count_set;
+    const auto img = draw_fused(0.25, 0.75, max_iter, n_pixels, ColorScale::MAX_ITER,
+                                TileSchedule{}, &count_set);
+
+    auto view = boost::gil::const_view(img);
+    for (PixelSize y{0}; y < n_pixels; ++y) {
+        auto it = view.row_begin(checked_cast<std::ptrdiff_t>(y));
+        for (PixelSize x{0}; x < n_pixels; ++x, ++it) {
+            ASSERT_EQ(gradient_color(count_set[y][x], max_iter), *it);
+        }
+    }
+}
+
+TEST_F(TestDrawFused, LargeMaxIter) {
+    // Pixels cannot hold counts
+    constexpr PixelSize n_pixels = 4;
+    constexpr Count max_iter = 0x1000000;
+    const auto expected_counts = scan_points(0.25, 0.75, max_iter, n_pixels);
+    const auto expected = draw_image(expected_counts);
+    CountSet count_set;
+    const auto actual = draw_fused(0.25, 0.75, max_iter, n_pixels, ColorScale::MAX_COUNT,
+                                   TileSchedule{}, &count_set);
+    EXPECT_TRUE(boost::gil::equal_pixels(boost::gil::const_view(expected),
+                                         boost::gil::const_view(actual)));
+    EXPECT_EQ(expected_counts, count_set);
+}
+
 class TestWriteCsv : public ::testing::Test {};
 
 TEST_F(TestWriteCsv, Success) {
@@ -629,6 +882,52 @@ TEST_F(TestDraw, Success) {
     EXPECT_EQ(LOW_COLOR_B, boost::gil::at_c<2>(pixel));
 }
 
+TEST_F(TestDraw, Fused) {
+    constexpr PixelSize n_pixels = 16;
+    for (const auto color_scale : {ColorScale::MAX_COUNT, ColorScale::MAX_ITER}) {
+        const TempFile csv(".csv");
+        const auto& csv_filepath = csv.Get();
+        ASSERT_TRUE(csv_filepath.has_value());
+
+        const TempFile png(".png");
+        const auto& png_filepath = png.Get();
+        ASSERT_TRUE(png_filepath.has_value());
+
+        ParamSet params(0.5, 0.125, 20, n_pixels, csv_filepath, png_filepath);
+        params.fused = true;
+        params.color_scale = color_scale;
+        ASSERT_EQ(ExitStatus::SUCCESS, draw(params));
+
+        std::ifstream ifs(*csv_filepath);
+        std::string line;
+        PixelSize n_lines = 0;
+        while (std::getline(ifs, line)) {
+            EXPECT_EQ(0, line.find("0,"));
+            ++n_lines;
+        }
+        EXPECT_EQ(n_pixels, n_lines);
+
+        Bitmap img;
+        boost::gil::read_image(png_filepath.value().string(), img, boost::gil::png_tag());
+        const auto expected = draw_fused(0.5, 0.125, 20, n_pixels, color_scale,
+                                         TileSchedule{}, nullptr);
+        EXPECT_TRUE(boost::gil::equal_pixels(boost::gil::const_view(expected),
+                                             boost::gil::const_view(img)));
+    }
+}
+
+TEST_F(TestDraw, FusedImageOnly) {
+    const TempFile png(".png");
+    const auto& png_filepath = png.Get();
+    ASSERT_TRUE(png_filepath.has_value());
+
+    const std::optional<std::filesystem::path> csv_filepath;
+    ParamSet params(0.5, 0.125, 20, 32, csv_filepath, png_filepath);
+    params.fused = true;
+    ASSERT_EQ(ExitStatus::SUCCESS, draw(params));
+    EXPECT_TRUE(std::filesystem::exists(png_filepath.value()));
+}
+
 TEST_F(TestDraw, NoWrites) {
     const std::optional<std::filesystem::path> csv_filepath;
     const std::optional<std::filesystem::path> png_filepath;
@@ -704,6 +1003,8 @@ TEST_F(TestParseArgs, DefaultArgs) {
     ASSERT_FALSE(actual.csv_filepath.has_value());
     ASSERT_TRUE(actual.image_filepath.has_value());
     EXPECT_EQ(expected, actual.image_filepath.value());
+    EXPECT_FALSE(actual.fused);
+    EXPECT_EQ(ColorScale::MAX_COUNT, actual.color_scale);
 }
 
 TEST_F(TestParseArgs, Long) {
@@ -766,6 +1067,30 @@ TEST_F(TestParseArgs, Short) {
     EXPECT_EQ(expected_image, actual.image_filepath.value());
 }
 
+TEST_F(TestParseArgs, Fused) {
+    const std::vector<std::vector<std::string>> arg_sets {
+        {"command", "--fused", "--normalize", "iter"}, {"command", "-f", "-n", "iter"}};
+
+    for (const auto& arg_set : arg_sets) {
+        const auto [argc, argv] = make_argc_argv(arg_set);
+        const auto actual = parse_args(argc, argv.data());
+        EXPECT_TRUE(actual.fused);
+        EXPECT_EQ(ColorScale::MAX_ITER, actual.color_scale);
+    }
+
+    const std::vector<std::string> arg_set {"command", "-n", "count"};
+    const auto [argc, argv] = make_argc_argv(arg_set);
+    const auto actual = parse_args(argc, argv.data());
+    EXPECT_FALSE(actual.fused);
+    EXPECT_EQ(ColorScale::MAX_COUNT, actual.color_scale);
+}
+
+TEST_F(TestParseArgs, InvalidNormalize) {
+    const std::vector<std::string> arg_set {"command", "--normalize", "max"};
+    const auto [argc, argv] = make_argc_argv(arg_set);
+    EXPECT_THROW(parse_args(argc, argv.data()), boost::program_options::invalid_option_value);
+}
+
 class TestCheckedCast : public ::testing::Test {};
 
 TEST_F(TestCheckedCast, Numbers) {